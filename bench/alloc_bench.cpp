@@ -0,0 +1,156 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// Heap allocations the server makes per keep-alive request once warm, for
+// a small route and for a static file. Every operator new is counted
+// except those of the client and of this thread, so the figures are the
+// server's own: the session, parsing, routing, the response and the I/O.
+// Fails if either takes more than `max` allocations per request (1 by
+// default, the message_generator holding the response).
+//
+// usage: alloc_bench [requests] [port] [max]
+
+#include "bench.hpp"
+
+#include "gh/http/server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
+
+namespace {
+
+std::atomic<std::uint64_t> allocations{0};
+thread_local bool counted = true;
+
+} // namespace
+
+auto operator new(std::size_t n) -> void*
+{
+    if (counted) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (auto p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator delete(void* p) noexcept -> void
+{
+    std::free(p);
+}
+
+auto operator delete(void* p, std::size_t) noexcept -> void
+{
+    std::free(p);
+}
+
+namespace {
+
+namespace net = boost::asio;
+namespace http = boost::beast::http;
+using tcp = net::ip::tcp;
+using namespace gh::bench;
+
+char const file_name[] = "alloc_bench.txt";
+
+// Sends `n` requests for `target` over one connection, after as many to
+// warm up, and returns the server's allocations per request.
+auto per_request(unsigned short port, const char* target, int n) -> double
+{
+    double result = 0;
+    std::thread client([&]() {
+        counted = false;
+        net::io_context ioc;
+        tcp::socket socket{ioc};
+        socket.connect(tcp::endpoint{net::ip::make_address("127.0.0.1"), port});
+        auto const request = std::string("GET ") + target +
+            " HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n";
+        boost::beast::flat_buffer buffer;
+        auto const exchange = [&]() {
+            net::write(socket, net::buffer(request));
+            http::response<http::string_body> response;
+            http::read(socket, buffer, response);
+        };
+        for (auto i = 0; i < n; ++i) {
+            exchange();
+        }
+        auto const before = allocations.load();
+        for (auto i = 0; i < n; ++i) {
+            exchange();
+        }
+        result = static_cast<double>(allocations.load() - before) / n;
+    });
+    client.join();
+    return result;
+}
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+    auto const n = argc > 1 ? std::atoi(argv[1]) : 10000;
+    auto const port = static_cast<unsigned short>(argc > 2 ? std::atoi(argv[2]) : 18081);
+    auto const max = argc > 3 ? std::atof(argv[3]) : 1.0;
+    {
+        std::ofstream out(file_name);
+        out << "static file for alloc_bench\n";
+    }
+
+    gh::http::server app{"bench", 1};
+    app.set_doc_root(".");
+    app.get("/ping", [&app](
+            gh::http::router::Matches&& /*matches*/,
+            gh::http::router::Request&& request,
+            gh::http::router::Socket& /*socket*/) {
+        // Fields on the request's arena, as the server's own responses
+        http::response<http::string_body, gh::http::router::Fields> response{
+            std::piecewise_construct, std::make_tuple(), std::make_tuple(request.get_allocator())};
+        response.result(http::status::ok);
+        response.version(request.version());
+        response.set(http::field::server, app.name());
+        response.keep_alive(request.keep_alive());
+        response.body() = "pong";
+        response.prepare_payload();
+        return response;
+    });
+
+    std::thread server([&app, port]() {
+        app.run("127.0.0.1", port);
+    });
+    counted = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    auto ok = true;
+    auto const check = [&ok, max](const char* name, double allocs) {
+        report(name, allocs, "allocs/request");
+        if (allocs > max) {
+            std::printf("%s: %.2f allocations per request, above %.2f\n", name, allocs, max);
+            ok = false;
+        }
+    };
+    check("route /ping", per_request(port, "/ping", n));
+    check("static file", per_request(port, (std::string("/") + file_name).c_str(), n));
+
+    app.stop();
+    server.join();
+    std::remove(file_name);
+    return ok ? 0 : 1;
+}
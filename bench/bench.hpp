@@ -0,0 +1,85 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_BENCH_HPP
+#define GH_BENCH_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace gh {
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+inline auto seconds_since(clock::time_point start) -> double
+{
+    return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+inline auto report(const std::string& name, double value, const char* unit) -> void
+{
+    std::printf("%-48s %14.3f %s\n", name.c_str(), value, unit);
+    std::fflush(stdout);
+}
+
+// Frame `shift` of a synthetic scene: a coloured gradient with sensor
+// noise, and `box` filled in unless it is empty.
+inline auto synthetic_frame(cv::Size size, int shift, cv::Rect box) -> cv::Mat
+{
+    cv::Mat image(size, CV_8UC3);
+    for (auto y = 0; y < size.height; ++y) {
+        auto row = image.ptr<unsigned char>(y);
+        for (auto x = 0; x < size.width * 3; ++x) {
+            row[x] = static_cast<unsigned char>((x / 3 + y + x % 3 * 40) / 4);
+        }
+    }
+    cv::Mat noise(size, CV_8UC3);
+    cv::RNG rng{static_cast<std::uint64_t>(42 + shift)};
+    rng.fill(noise, cv::RNG::NORMAL, 0, 4);
+    image += noise;
+    if (box.area() > 0) {
+        cv::rectangle(image, box, cv::Scalar(30, 200, 60), cv::FILLED);
+    }
+    return image;
+}
+
+// Frame `shift` of a scene with a box moving 12 pixels a frame across it
+inline auto synthetic_frame(cv::Size size, int shift) -> cv::Mat
+{
+    return synthetic_frame(size, shift,
+        cv::Rect(40 + shift * 12, size.height / 3, size.width / 8, size.height / 4));
+}
+
+inline auto synthetic_frames(cv::Size size, int n) -> std::vector<cv::Mat>
+{
+    std::vector<cv::Mat> frames;
+    for (auto i = 0; i < n; ++i) {
+        frames.push_back(synthetic_frame(size, i));
+    }
+    return frames;
+}
+
+// Milliseconds per call of `work` on each of `n` frames, going round
+// `frames`
+template<class Work>
+auto per_frame(const std::vector<cv::Mat>& frames, int n, Work work) -> double
+{
+    auto const start = clock::now();
+    for (auto i = 0; i < n; ++i) {
+        work(frames[i % frames.size()]);
+    }
+    return 1000.0 * seconds_since(start) / n;
+}
+
+} // namespace bench
+} // namespace gh
+
+#endif // GH_BENCH_HPP
@@ -0,0 +1,383 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// Microbenchmarks of the pieces every frame and request goes through, on
+// synthetic inputs, each reported in nanoseconds per operation:
+//   - router matching a request path against the routes of the app
+//   - serving a small static file over a keep-alive connection
+//   - motion_detector::update on 640x480 frames
+//   - JPEG encoding of a 1280x720 frame
+//   - frame fan-out from a channel to 16 subscribers
+//   - resource_manager leases, creating and reusing the resource
+//
+// With --baseline the results are compared to those stored in the file,
+// and the run fails if any got slower by more than --tolerance (0.15 for
+// 15%). A baseline that is missing or cannot be read fails the run as
+// well; --update records one instead of comparing. A benchmark that
+// cannot run fails the run too, and nothing is compared or recorded. The
+// component_bench test runs the comparison, the bench_baseline target
+// records it.
+//
+// usage: component_bench [--baseline file] [--tolerance t] [--update]
+//                        [--runs n] [--port p]
+
+#include "bench.hpp"
+
+#include "gh/frame_channel.hpp"
+#include "gh/motion_detector.hpp"
+#include "gh/resource_manager.hpp"
+#include "gh/http/server.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace {
+
+namespace net = boost::asio;
+namespace http = boost::beast::http;
+using tcp = net::ip::tcp;
+using namespace gh::bench;
+
+struct options
+{
+    std::string baseline;
+    double tolerance;
+    bool update;
+    int runs;
+    unsigned short port;
+};
+
+// What a benchmark returns when it could not run
+double const failed = -1;
+
+// Best of `runs` runs of `n` operations, so that a busy moment of the
+// machine does not read as a regression.
+template<class Work>
+auto ns_per_op(const options& opt, int n, Work work) -> double
+{
+    double best = 0;
+    for (auto run = 0; run < opt.runs; ++run) {
+        auto const start = clock::now();
+        work(n);
+        auto const ns = 1e9 * seconds_since(start) / n;
+        if (run == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+auto router_match(const options& opt) -> double
+{
+    gh::http::router r{"bench"};
+    auto const none = [](gh::http::router::Matches&&, gh::http::router::Request&& request,
+                         gh::http::router::Socket&) -> http::message_generator {
+        return http::response<http::empty_body>{http::status::ok, request.version()};
+    };
+    for (auto path : {"/", "/cam", "/cam/ws", "/cam/events", "/cam/replay", "/metrics",
+                      "/cam/snapshot\\.jpg", "/cam/frame", "/cam/record/(\\d+)",
+                      "/cam/recordings/(\\d+)", "/cam/recordings/(\\d+)\\.avi"}) {
+        r.get(path, none);
+    }
+    std::vector<std::string> const paths{
+        "/metrics", "/cam", "/cam/recordings/42", "/cam/recordings/42.avi", "/js/app.js"};
+    gh::http::router::Matches matches;
+    std::size_t found = 0;
+    auto const ns = ns_per_op(opt, 200000, [&](int n) {
+        for (auto i = 0; i < n; ++i) {
+            found += gh::http::router::match(r.get_table(), paths[i % paths.size()], matches) != nullptr;
+        }
+    });
+    if (found == 0) {
+        std::fprintf(stderr, "router_match: nothing matched\n");
+        return failed;
+    }
+    return ns;
+}
+
+// Connects once the server listens, rather than guessing how long it
+// takes to start; false if it did not within `patience`.
+auto connect_when_listening(tcp::socket& socket, const tcp::endpoint& endpoint, clock::duration patience) -> bool
+{
+    auto const deadline = clock::now() + patience;
+    while (true) {
+        boost::system::error_code ec;
+        socket.connect(endpoint, ec);
+        if (!ec) {
+            return true;
+        }
+        socket.close(ec);
+        if (clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+auto static_file(const options& opt) -> double
+{
+    char const file_name[] = "component_bench.txt";
+    {
+        std::ofstream out(file_name, std::ios::binary);
+        out << std::string(4096, 'x');
+    }
+    gh::http::server app{"bench", 1};
+    app.set_doc_root(".");
+    std::thread server([&app, &opt]() {
+        app.run("127.0.0.1", opt.port);
+    });
+
+    auto ns = failed;
+    try {
+        net::io_context ioc;
+        tcp::socket socket{ioc};
+        if (!connect_when_listening(socket, tcp::endpoint{net::ip::make_address("127.0.0.1"), opt.port},
+                                    std::chrono::seconds(5))) {
+            throw std::runtime_error("the server did not start listening");
+        }
+        auto const request = std::string("GET /") + file_name + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        boost::beast::flat_buffer buffer;
+        ns = ns_per_op(opt, 5000, [&](int n) {
+            for (auto i = 0; i < n; ++i) {
+                net::write(socket, net::buffer(request));
+                http::response<http::string_body> response;
+                http::read(socket, buffer, response);
+                if (response.result() != http::status::ok) {
+                    throw std::runtime_error("got " + std::to_string(response.result_int()));
+                }
+            }
+        });
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "static_file: %s\n", e.what());
+    }
+    app.stop();
+    server.join();
+    std::remove(file_name);
+    return ns;
+}
+
+auto motion_detector_update(const options& opt) -> double
+{
+    auto const frames = synthetic_frames(cv::Size(640, 480), 8);
+    gh::motion_detector d;
+    d.init(frames[0]);
+    cv::Mat image;
+    return ns_per_op(opt, 200, [&](int n) {
+        for (auto i = 0; i < n; ++i) {
+            frames[i % frames.size()].copyTo(image);
+            d.update(image);
+        }
+    });
+}
+
+auto jpeg_encode(const options& opt) -> double
+{
+    auto const image = synthetic_frame(cv::Size(1280, 720), 0);
+    std::vector<unsigned char> jpeg;
+    std::vector<int> const params{cv::IMWRITE_JPEG_QUALITY, 85};
+    return ns_per_op(opt, 100, [&](int n) {
+        for (auto i = 0; i < n; ++i) {
+            cv::imencode(".jpg", image, jpeg, params);
+        }
+    });
+}
+
+// Per delivery, from publishing to the subscriber's handler having run
+auto frame_fanout(const options& opt) -> double
+{
+    int const subscribers = 16;
+    net::io_context ioc;
+    auto guard = net::make_work_guard(ioc);
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < 2; ++i) {
+        threads.emplace_back([&ioc]() { ioc.run(); });
+    }
+
+    gh::frame_channel channel;
+    std::atomic<std::uint64_t> delivered{0};
+    std::vector<gh::frame_channel::subscription> subscriptions;
+    for (auto i = 0; i < subscribers; ++i) {
+        subscriptions.push_back(channel.subscribe(ioc.get_executor(),
+            [&delivered](const gh::frame_ptr&) { ++delivered; }));
+    }
+    auto const f = std::make_shared<gh::frame>();
+    f->jpeg = std::make_shared<const gh::buffer>(64 * 1024);
+
+    auto const ns = ns_per_op(opt, 20000, [&](int n) {
+        auto const expected = delivered.load() + static_cast<std::uint64_t>(n) * subscribers;
+        for (auto i = 0; i < n; ++i) {
+            channel.publish(f);
+        }
+        while (delivered.load() < expected) {
+            std::this_thread::yield();
+        }
+    }) / subscribers;
+
+    subscriptions.clear();
+    guard.reset();
+    for (auto& t : threads) {
+        t.join();
+    }
+    return ns;
+}
+
+struct dummy
+{
+    auto update() -> void
+    { }
+
+    std::vector<char> state = std::vector<char>(256);
+};
+
+auto lease_create(const options& opt) -> double
+{
+    gh::resource_manager<dummy> manager;
+    return ns_per_op(opt, 200000, [&](int n) {
+        for (auto i = 0; i < n; ++i) {
+            auto l = manager.make_or_reuse();
+            l.reset();
+        }
+    });
+}
+
+auto lease_reuse(const options& opt) -> double
+{
+    gh::resource_manager<dummy> manager;
+    auto const held = manager.make_or_reuse();
+    return ns_per_op(opt, 500000, [&](int n) {
+        for (auto i = 0; i < n; ++i) {
+            auto l = manager.make_or_reuse();
+            l.reset();
+        }
+    });
+}
+
+// False if the file is missing, empty, or holds anything but lines of a
+// name and a number.
+auto read_baseline(const std::string& path, std::map<std::string, double>& values) -> bool
+{
+    std::ifstream in(path);
+    std::string name;
+    double value;
+    while (in >> name >> value) {
+        values[name] = value;
+    }
+    return in.eof() && !values.empty();
+}
+
+auto write_baseline(const std::string& path, const std::vector<std::pair<std::string, double>>& results) -> void
+{
+    std::ofstream out(path);
+    for (auto const& r : results) {
+        out << r.first << ' ' << r.second << '\n';
+    }
+}
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+    options opt{"", 0.15, false, 3, 18082};
+    for (auto i = 1; i < argc; ++i) {
+        auto const more = i + 1 < argc;
+        if (!std::strcmp(argv[i], "--baseline") && more) {
+            opt.baseline = argv[++i];
+        } else if (!std::strcmp(argv[i], "--tolerance") && more) {
+            opt.tolerance = std::atof(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--update")) {
+            opt.update = true;
+        } else if (!std::strcmp(argv[i], "--runs") && more) {
+            opt.runs = std::max(1, std::atoi(argv[++i]));
+        } else if (!std::strcmp(argv[i], "--port") && more) {
+            opt.port = static_cast<unsigned short>(std::atoi(argv[++i]));
+        } else {
+            std::fprintf(stderr, "usage: %s [--baseline file] [--tolerance t] [--update] "
+                                 "[--runs n] [--port p]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<std::pair<std::string, double(*)(const options&)>> const benchmarks{
+        {"router_match", router_match},
+        {"static_file", static_file},
+        {"motion_detector_update", motion_detector_update},
+        {"jpeg_encode", jpeg_encode},
+        {"frame_fanout", frame_fanout},
+        {"lease_create", lease_create},
+        {"lease_reuse", lease_reuse},
+    };
+    std::vector<std::pair<std::string, double>> results;
+    auto failures = 0;
+    for (auto const& b : benchmarks) {
+        results.emplace_back(b.first, b.second(opt));
+        if (results.back().second < 0) {
+            std::printf("%-48s %14s\n", b.first.c_str(), "FAILED");
+            ++failures;
+        } else {
+            report(b.first, results.back().second, "ns/op");
+        }
+    }
+    if (failures > 0) {
+        std::printf("%d benchmark(s) failed\n", failures);
+        return 1;
+    }
+
+    if (opt.baseline.empty()) {
+        return 0;
+    }
+    if (opt.update) {
+        write_baseline(opt.baseline, results);
+        std::printf("baseline written to %s\n", opt.baseline.c_str());
+        return 0;
+    }
+    std::map<std::string, double> baseline;
+    if (!read_baseline(opt.baseline, baseline)) {
+        std::printf("no readable baseline in %s, record one with --update\n", opt.baseline.c_str());
+        return 1;
+    }
+
+    auto regressions = 0;
+    for (auto const& r : results) {
+        auto const it = baseline.find(r.first);
+        if (it == baseline.end() || it->second <= 0) {
+            std::printf("%-32s no baseline\n", r.first.c_str());
+            continue;
+        }
+        auto const change = r.second / it->second - 1;
+        auto const regressed = change > opt.tolerance;
+        std::printf("%-32s %+7.1f%% %s\n", r.first.c_str(), 100 * change,
+                    regressed ? "REGRESSION" : "ok");
+        regressions += regressed;
+    }
+    if (regressions > 0) {
+        std::printf("%d regression(s) beyond %.0f%% of %s\n", regressions,
+                    100 * opt.tolerance, opt.baseline.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// The motion detector's default mode against its fused mode, on a scene
+// that is still at times and has something crossing it at others, in BGR
+// and in gray (the luma of YUV captures):
+//   - ms/frame of update()
+//   - memory traffic of the per-pixel stages, in bytes per frame as each
+//     mode is written to move them, and the bandwidth that makes
+//   - how often both modes decide alike whether something moved, and how
+//     much of what one of them sees moving the other sees as well
+// Fails if the decisions agree on fewer than 1 - tolerance of the frames.
+//
+// usage: motion_bench [frames] [tolerance]
+
+#include "bench.hpp"
+
+#include "gh/motion_detector.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace {
+
+using namespace gh::bench;
+
+struct scene
+{
+    cv::Size size;
+    int type;
+    int frames;
+};
+
+// Frame `i` of the scene. From frame 30 on, a box crosses it for 40
+// frames out of every 60.
+auto make_frame(const scene& sc, int i, cv::Mat& image) -> void
+{
+    auto const t = i - 30;
+    auto const box = t >= 0 && t % 60 < 40
+        ? cv::Rect(sc.size.width * (t % 60) / 40, sc.size.height / 3, sc.size.width / 6, sc.size.height / 4)
+        : cv::Rect();
+    image = synthetic_frame(sc.size, i, box);
+    if (sc.type == CV_8UC1) {
+        cv::cvtColor(image, image, cv::COLOR_BGR2GRAY);
+    }
+}
+
+struct run_result
+{
+    double ms_per_frame;
+    std::vector<bool> decisions;
+    std::vector<std::vector<cv::Rect>> detections;
+};
+
+auto run(const scene& sc, bool fused) -> run_result
+{
+    gh::motion_detector d;
+    d.fuse(fused);
+    cv::Mat image;
+    make_frame(sc, 0, image);
+    d.init(image);
+    run_result r;
+    double seconds = 0;
+    for (auto i = 0; i < sc.frames; ++i) {
+        make_frame(sc, i, image);
+        auto const start = clock::now();
+        r.decisions.push_back(d.update(image));
+        seconds += seconds_since(start);
+        r.detections.push_back(d.detections());
+    }
+    r.ms_per_frame = 1000.0 * seconds / sc.frames;
+    return r;
+}
+
+auto rasterize(cv::Size size, const std::vector<cv::Rect>& boxes, cv::Mat& mask) -> void
+{
+    mask.create(size, CV_8UC1);
+    mask.setTo(cv::Scalar::all(0));
+    for (auto const& box : boxes) {
+        cv::rectangle(mask, box, cv::Scalar::all(255), cv::FILLED);
+    }
+}
+
+// Bytes each mode reads and writes per frame in its per-pixel stages,
+// for `pixels` pixels of `cn` channels. The morphology and contours that
+// follow are the same for both.
+auto traffic(std::size_t pixels, int cn, bool fused) -> double
+{
+    auto const n = static_cast<double>(pixels * cn);
+    auto const gray = static_cast<double>(pixels);
+    if (fused) {
+        // Frame, float average read and written, mask
+        return n + 8 * n + gray;
+    }
+    auto bytes = 0.0;
+    bytes += 2 * n;                         // blur
+    bytes += 3 * n;                         // absdiff
+    bytes += cn == 1 ? 0 : n + gray;        // cvtColor
+    bytes += 2 * gray;                      // threshold
+    bytes += n + 8 * n;                     // accumulateWeighted
+    bytes += 4 * n + n;                     // convertScaleAbs
+    return bytes;
+}
+
+auto compare(const char* name, const scene& sc, double tolerance) -> bool
+{
+    auto const plain = run(sc, false);
+    auto const fused = run(sc, true);
+    auto const pixels = static_cast<std::size_t>(sc.size.area());
+    auto const cn = CV_MAT_CN(sc.type);
+
+    std::size_t agree = 0;
+    double overlap = 0;
+    std::size_t moving = 0;
+    cv::Mat a, b, both, either;
+    for (auto i = 0; i < sc.frames; ++i) {
+        agree += plain.decisions[i] == fused.decisions[i];
+        rasterize(sc.size, plain.detections[i], a);
+        rasterize(sc.size, fused.detections[i], b);
+        cv::bitwise_and(a, b, both);
+        cv::bitwise_or(a, b, either);
+        auto const total = cv::countNonZero(either);
+        if (total > 0) {
+            overlap += static_cast<double>(cv::countNonZero(both)) / total;
+            ++moving;
+        }
+    }
+    auto const agreement = static_cast<double>(agree) / sc.frames;
+
+    auto const prefix = std::string(name) + " ";
+    report(prefix + "default", plain.ms_per_frame, "ms/frame");
+    report(prefix + "fused", fused.ms_per_frame, "ms/frame");
+    for (auto mode : {false, true}) {
+        auto const bytes = traffic(pixels, cn, mode);
+        auto const ms = mode ? fused.ms_per_frame : plain.ms_per_frame;
+        report(prefix + (mode ? "fused" : "default") + " traffic", bytes / (1 << 20), "MiB/frame");
+        report(prefix + (mode ? "fused" : "default") + " bandwidth", bytes / (ms * 1e-3) / 1e9, "GB/s");
+    }
+    report(prefix + "decisions agreeing", 100 * agreement, "%");
+    report(prefix + "overlap of detections", moving ? 100 * overlap / moving : 100.0, "%");
+
+    if (agreement < 1 - tolerance) {
+        std::printf("%s: decisions agree on %.1f%% of frames, below %.1f%%\n",
+                    name, 100 * agreement, 100 * (1 - tolerance));
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+    auto const n = argc > 1 ? std::max(2, std::atoi(argv[1])) : 300;
+    auto const tolerance = argc > 2 ? std::atof(argv[2]) : 0.02;
+    auto ok = true;
+    ok = compare("1280x720 bgr", scene{cv::Size(1280, 720), CV_8UC3, n}, tolerance) && ok;
+    ok = compare("1280x720 gray", scene{cv::Size(1280, 720), CV_8UC1, n}, tolerance) && ok;
+    return ok ? 0 : 1;
+}
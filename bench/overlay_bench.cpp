@@ -0,0 +1,58 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// Per-frame cost of burning the camera name and time into 1080p frames:
+// gh::overlay blitting from its glyph atlas against putText drawing the
+// same line, with a background box, into every frame.
+//
+// usage: overlay_bench [frames]
+
+#include "bench.hpp"
+
+#include "gh/overlay.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+using namespace gh::bench;
+
+auto main(int argc, char* argv[]) -> int
+{
+    auto const n = argc > 1 ? std::atoi(argv[1]) : 300;
+    auto const frames = synthetic_frames(cv::Size(1920, 1080), 8);
+    cv::Mat image;
+
+    report("copy only (baseline)", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+    }), "ms/frame");
+
+    gh::overlay stamp{"cam0"};
+    stamp.init(frames[0]);
+    report("overlay (glyph atlas)", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+        stamp.update(image);
+    }), "ms/frame");
+
+    // Same font size and placement as the overlay picks for 1080p
+    auto const face = cv::FONT_HERSHEY_SIMPLEX;
+    auto const scale = 1080 / 30.0 / 22.0;
+    auto const thickness = cvRound(scale * 2);
+    report("putText per frame", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+        auto const text = stamp.text(std::chrono::system_clock::now());
+        int baseline = 0;
+        auto const size = cv::getTextSize(text, face, scale, thickness, &baseline);
+        auto const origin = cv::Point(20, image.rows - 20 - baseline);
+        cv::rectangle(image, cv::Rect(origin.x, origin.y - size.height,
+            size.width, size.height + baseline), cv::Scalar::all(0), cv::FILLED);
+        cv::putText(image, text, origin, face, scale, cv::Scalar::all(255), thickness, cv::LINE_AA);
+    }), "ms/frame");
+
+    return 0;
+}
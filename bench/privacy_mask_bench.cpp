@@ -0,0 +1,86 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// Per-frame cost of privacy masking at 1080p: the precomputed mask of
+// gh::privacy_mask against filling the polygons into every frame, and the
+// motion detector with and without the masked regions left out.
+//
+// usage: privacy_mask_bench [frames]
+
+#include "bench.hpp"
+
+#include "gh/motion_detector.hpp"
+#include "gh/privacy_mask.hpp"
+
+#include <cstdlib>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace {
+
+using namespace gh::bench;
+
+// Two windows and a keypad, about a fifth of the frame
+auto make_polygons() -> std::vector<gh::privacy_mask::polygon>
+{
+    return {
+        {{0.00f, 0.00f}, {0.25f, 0.00f}, {0.25f, 0.30f}, {0.00f, 0.30f}},
+        {{0.70f, 0.05f}, {0.95f, 0.10f}, {0.90f, 0.40f}, {0.68f, 0.35f}},
+        {{0.45f, 0.70f}, {0.55f, 0.70f}, {0.55f, 0.85f}, {0.45f, 0.85f}},
+    };
+}
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+    auto const n = argc > 1 ? std::atoi(argv[1]) : 300;
+    auto const frames = synthetic_frames(cv::Size(1920, 1080), 8);
+    auto const polygons = make_polygons();
+    cv::Mat image;
+
+    gh::privacy_mask mask{polygons};
+    mask.init(frames[0]);
+    report("privacy_mask (precomputed)", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+        mask.update(image);
+    }), "ms/frame");
+
+    std::vector<std::vector<cv::Point>> points;
+    for (auto const& p : polygons) {
+        std::vector<cv::Point> v;
+        for (auto const& q : p) {
+            v.push_back(cv::Point(cvRound(q.x * 1920), cvRound(q.y * 1080)));
+        }
+        points.push_back(v);
+    }
+    report("fillPoly per frame", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+        cv::fillPoly(image, points, cv::Scalar::all(0));
+    }), "ms/frame");
+
+    report("copy only (baseline)", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+    }), "ms/frame");
+
+    gh::motion_detector plain;
+    plain.init(frames[0]);
+    report("motion_detector", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+        plain.update(image);
+    }), "ms/frame");
+
+    gh::motion_detector masked;
+    masked.ignore(mask);
+    masked.init(frames[0]);
+    report("privacy_mask + motion_detector ignoring it", per_frame(frames, n, [&](const cv::Mat& f) {
+        f.copyTo(image);
+        mask.update(image);
+        masked.update(image);
+    }), "ms/frame");
+
+    return 0;
+}
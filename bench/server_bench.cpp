@@ -0,0 +1,267 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// Compares the shared io_context server mode against the sharded one.
+//
+// For each mode it measures
+//   - connection throughput: clients doing connect, GET, close in a loop
+//   - static file throughput: keep-alive clients fetching a file from the
+//     doc root, and the process CPU time spent per request
+//   - frame throughput: clients reading an MJPEG stream fed by a synthetic
+//     publisher
+//
+// Build with -DGH_USE_IO_URING=ON (and -DGH_IO_URING_SOCKETS=ON) to run the
+// same measurements on io_uring.
+//
+// usage: server_bench [threads] [clients] [seconds] [fps] [port]
+
+#include "bench.hpp"
+
+#include "gh/frame_channel.hpp"
+#include "gh/http/mjpeg_stream.hpp"
+#include "gh/http/server.hpp"
+
+#include <atomic>
+#include <ctime>
+#include <cstdlib>
+#include <fstream>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/write.hpp>
+
+namespace {
+
+namespace net = boost::asio;
+namespace http = boost::beast::http;
+using tcp = net::ip::tcp;
+using namespace gh::bench;
+
+struct options
+{
+    int threads;
+    int clients;
+    double seconds;
+    int fps;
+    unsigned short port;
+};
+
+char const file_name[] = "server_bench.bin";
+std::size_t const file_size = 256 * 1024;
+
+auto make_frame(std::uint64_t seq, const gh::buffer_ptr& jpeg) -> gh::frame_ptr
+{
+    auto f = std::make_shared<gh::frame>();
+    f->seq = seq;
+    f->timestamp = std::chrono::system_clock::now();
+    f->changed = true;
+    f->jpeg = jpeg;
+    return f;
+}
+
+auto connect(net::io_context& ioc, const options& opt) -> tcp::socket
+{
+    tcp::socket socket{ioc};
+    socket.connect(tcp::endpoint{net::ip::make_address("127.0.0.1"), opt.port});
+    return socket;
+}
+
+// Runs `clients` threads calling `work` until the deadline and returns the
+// sum of what they counted.
+template<class Work>
+auto run_clients(const options& opt, Work work) -> std::uint64_t
+{
+    std::atomic<std::uint64_t> total{0};
+    auto const deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(opt.seconds));
+    std::vector<std::thread> v;
+    for (auto i = 0; i < opt.clients; ++i) {
+        v.emplace_back([&]() {
+            net::io_context ioc;
+            std::uint64_t n = 0;
+            try {
+                n = work(ioc, deadline);
+            } catch (const std::exception& e) {
+                std::fprintf(stderr, "client: %s\n", e.what());
+            }
+            total += n;
+        });
+    }
+    for (auto& t : v) {
+        t.join();
+    }
+    return total;
+}
+
+auto connections(const options& opt) -> double
+{
+    static char const request[] =
+        "GET /ping HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    auto const n = run_clients(opt, [&opt](net::io_context& ioc, clock::time_point deadline) {
+        std::uint64_t done = 0;
+        char buf[4096];
+        while (clock::now() < deadline) {
+            auto socket = connect(ioc, opt);
+            net::write(socket, net::buffer(request, sizeof(request) - 1));
+            boost::system::error_code ec;
+            while (!ec) {
+                socket.read_some(net::buffer(buf), ec);
+            }
+            ++done;
+        }
+        return done;
+    });
+    return n / opt.seconds;
+}
+
+auto files(const options& opt) -> void
+{
+    std::atomic<std::uint64_t> bytes{0};
+    auto const cpu = std::clock();
+    auto const n = run_clients(opt, [&](net::io_context& ioc, clock::time_point deadline) {
+        auto socket = connect(ioc, opt);
+        http::request<http::empty_body> request{http::verb::get,
+            std::string("/") + file_name, 11};
+        request.set(http::field::host, "localhost");
+        boost::beast::flat_buffer buffer;
+        std::uint64_t done = 0;
+        while (clock::now() < deadline) {
+            http::write(socket, request);
+            http::response<http::string_body> response;
+            http::read(socket, buffer, response);
+            bytes += response.body().size();
+            ++done;
+        }
+        return done;
+    });
+    auto const cpu_ms = 1000.0 * (std::clock() - cpu) / CLOCKS_PER_SEC;
+    report("  file requests", n / opt.seconds, "req/s");
+    report("  file throughput", bytes / opt.seconds / (1024 * 1024), "MiB/s");
+    report("  process cpu per file request", n ? cpu_ms / n : 0.0, "ms");
+}
+
+auto frames(const options& opt, std::size_t frame_bytes) -> double
+{
+    static char const request[] = "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    auto const n = run_clients(opt, [&](net::io_context& ioc, clock::time_point deadline) {
+        auto socket = connect(ioc, opt);
+        net::write(socket, net::buffer(request, sizeof(request) - 1));
+        std::uint64_t bytes = 0;
+        std::vector<char> buf(64 * 1024);
+        while (clock::now() < deadline) {
+            bytes += socket.read_some(net::buffer(buf));
+        }
+        return bytes / frame_bytes;
+    });
+    return n / opt.seconds;
+}
+
+auto run(const options& opt, bool sharded) -> void
+{
+    auto const name = std::string(sharded ? "sharded" : "shared");
+
+    std::vector<unsigned char> bytes(64 * 1024);
+    std::mt19937 rng{42};
+    for (auto& b : bytes) {
+        b = static_cast<unsigned char>(rng());
+    }
+    auto const jpeg = std::make_shared<const gh::buffer>(std::move(bytes));
+
+    auto const channel = std::make_shared<gh::frame_channel>();
+    gh::http::server app{"bench", opt.threads};
+    app.set_sharded(sharded);
+    app.set_doc_root(".");
+
+    app.get("/ping", [&app](
+            gh::http::router::Matches&& /*matches*/,
+            gh::http::router::Request&& request,
+            gh::http::router::Socket& /*socket*/) {
+        http::response<http::string_body> response{http::status::ok, request.version()};
+        response.set(http::field::server, app.name());
+        response.keep_alive(request.keep_alive());
+        response.body() = "pong";
+        response.prepare_payload();
+        return response;
+    });
+
+    app.get("/stream", [&app,channel](
+            gh::http::router::Matches&& /*matches*/,
+            gh::http::router::Request&& request,
+            gh::http::router::Socket& socket) {
+        std::make_shared<gh::http::mjpeg_stream>(std::move(socket), app.name())->start(
+            request.version(), channel);
+        return http::response<http::empty_body>{http::status::ok, request.version()};
+    });
+
+    std::thread server([&app,&opt]() {
+        app.run("127.0.0.1", opt.port);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::printf("%s (%s, async files: %s)\n", name.c_str(),
+        gh::http::server::io_backend(), app.async_files() ? "yes" : "no");
+    report("  connections", connections(opt), "conn/s");
+    files(opt);
+
+    std::atomic<bool> publishing{true};
+    std::thread publisher([&]() {
+        std::uint64_t seq = 0;
+        auto const interval = std::chrono::microseconds(1000000 / opt.fps);
+        auto next = clock::now();
+        while (publishing) {
+            channel->publish(make_frame(++seq, jpeg));
+            next += interval;
+            std::this_thread::sleep_until(next);
+        }
+    });
+    auto const part = std::strlen("\r\n--frame\r\nContent-Type: image/jpeg\r\n\r\n");
+    auto const fps = frames(opt, jpeg->size() + part);
+    report("  frames", fps, "frames/s");
+    report("  frames per client", fps / opt.clients, "frames/s");
+
+    publishing = false;
+    publisher.join();
+    app.stop();
+    server.join();
+}
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+    options opt;
+    opt.threads = argc > 1 ? std::atoi(argv[1])
+                           : static_cast<int>(std::thread::hardware_concurrency());
+    opt.clients = argc > 2 ? std::atoi(argv[2]) : 64;
+    opt.seconds = argc > 3 ? std::atof(argv[3]) : 5.0;
+    opt.fps = argc > 4 ? std::atoi(argv[4]) : 120;
+    opt.port = static_cast<unsigned short>(argc > 5 ? std::atoi(argv[5]) : 18080);
+    if (opt.threads < 1) {
+        opt.threads = 1;
+    }
+
+    {
+        std::ofstream out(file_name, std::ios::binary);
+        std::vector<char> bytes(file_size, 'x');
+        out.write(bytes.data(), bytes.size());
+    }
+
+    run(opt, false);
+    run(opt, true);
+
+    std::remove(file_name);
+    return 0;
+}
@@ -0,0 +1,116 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+// Per-frame cost of getting a YUYV camera frame to JPEG and to the gray
+// image motion detection works on, both ways the webcam can capture:
+//   - bgr:  YUYV converted to BGR (what OpenCV does on capture), encoded
+//           with cv::imencode, and converted to gray for analysis
+//   - yuyv: YUYV split into planes, encoded by gh::yuv_encoder, with the
+//           luma plane as the gray image
+// CPU time counts every thread, as OpenCV converts in parallel.
+//
+// usage: yuv_bench [frames] [width] [height]
+
+#include "bench.hpp"
+
+#include "gh/yuv.hpp"
+
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace {
+
+using namespace gh::bench;
+
+// A synthetic frame packed as YUYV
+auto make_frame(cv::Size size, int shift) -> cv::Mat
+{
+    auto const bgr = synthetic_frame(size, shift);
+    cv::Mat ycrcb;
+    cv::cvtColor(bgr, ycrcb, cv::COLOR_BGR2YCrCb);
+    cv::Mat yuyv(size, CV_8UC2);
+    for (auto y = 0; y < size.height; ++y) {
+        auto const s = ycrcb.ptr<unsigned char>(y);
+        auto const d = yuyv.ptr<unsigned char>(y);
+        for (auto x = 0; x < size.width / 2; ++x) {
+            auto const a = s + 6 * x;
+            auto const b = a + 3;
+            d[4 * x] = a[0];
+            d[4 * x + 1] = static_cast<unsigned char>((a[2] + b[2] + 1) / 2);
+            d[4 * x + 2] = b[0];
+            d[4 * x + 3] = static_cast<unsigned char>((a[1] + b[1] + 1) / 2);
+        }
+    }
+    return yuyv;
+}
+
+struct result
+{
+    double wall_ms;
+    double cpu_ms;
+    double jpeg_bytes;
+};
+
+// Like per_frame, but also the CPU time and the bytes `work` returns
+template<class Work>
+auto per_frame_encoded(const std::vector<cv::Mat>& frames, int n, Work work) -> result
+{
+    std::size_t bytes = 0;
+    auto const start = clock::now();
+    auto const cpu = std::clock();
+    for (auto i = 0; i < n; ++i) {
+        bytes += work(frames[i % frames.size()]);
+    }
+    auto const cpu_seconds = static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC;
+    return result{1000.0 * seconds_since(start) / n, 1000.0 * cpu_seconds / n,
+                  static_cast<double>(bytes) / n};
+}
+
+auto print(const char* name, const result& r) -> void
+{
+    report(std::string(name) + " wall", r.wall_ms, "ms/frame");
+    report(std::string(name) + " cpu", r.cpu_ms, "ms/frame");
+    report(std::string(name) + " jpeg", r.jpeg_bytes / 1024, "KiB/frame");
+}
+
+} // namespace
+
+auto main(int argc, char* argv[]) -> int
+{
+    auto const n = argc > 1 ? std::atoi(argv[1]) : 200;
+    auto const size = cv::Size(argc > 2 ? std::atoi(argv[2]) : 1280, argc > 3 ? std::atoi(argv[3]) : 720);
+    std::vector<cv::Mat> frames;
+    for (auto i = 0; i < 8; ++i) {
+        frames.push_back(make_frame(size, i));
+    }
+    auto const quality = 95;
+
+    cv::Mat bgr;
+    cv::Mat gray;
+    gh::buffer jpeg;
+    std::vector<int> const params{cv::IMWRITE_JPEG_QUALITY, quality};
+    print("bgr", per_frame_encoded(frames, n, [&](const cv::Mat& yuyv) {
+        cv::cvtColor(yuyv, bgr, cv::COLOR_YUV2BGR_YUYV);
+        cv::cvtColor(bgr, gray, cv::COLOR_BGR2GRAY);
+        cv::imencode(".jpg", bgr, jpeg, params);
+        return jpeg.size();
+    }));
+
+    cv::Mat luma;
+    cv::Mat chroma;
+    gh::yuv_encoder encoder;
+    print(gh::yuv_encoder::direct(size.width) ? "yuyv" : "yuyv (through bgr)",
+          per_frame_encoded(frames, n, [&](const cv::Mat& yuyv) {
+        gh::split_yuyv(yuyv, luma, chroma);
+        encoder.encode(luma, chroma, quality, jpeg);
+        return jpeg.size();
+    }));
+    return 0;
+}
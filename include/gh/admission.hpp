@@ -0,0 +1,200 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_ADMISSION_HPP
+#define GH_ADMISSION_HPP
+
+#include "gh/variant_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace gh {
+
+// Decides whether a new viewer fits within the uplink and the encoding
+// time the capture thread can spare, and at which variant.
+//
+// Outbound bytes are counted by the streams through sent(); encoding time
+// and the capture rate come from the variant cache. Both are sampled into
+// rates when viewers ask to be admitted. A viewer admitted recently may
+// not show in the rates yet, so what it was estimated to cost is held as a
+// reservation for a few seconds; a surge of viewers is then judged against
+// everyone admitted before it, not against the rates of a quiet second ago.
+class admission
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct stats_type
+    {
+        double bytes_per_second;
+        // Seconds spent encoding variants per second
+        double encode_load;
+        std::uint64_t admitted;
+        std::uint64_t downgraded;
+        std::uint64_t rejected;
+    };
+
+    // A budget of 0 is no limit.
+    admission(const variant_cache& variants, double bytes_per_second, double encode_load)
+    : m_variants(variants)
+    , m_uplink(bytes_per_second)
+    , m_encode_budget(encode_load)
+    , m_hold(std::chrono::seconds(3))
+    , m_sent(0)
+    , m_sampled(clock::now())
+    , m_last_sent(0)
+    , m_last_frames(0)
+    , m_last_encode(0)
+    , m_bytes_rate(0)
+    , m_encode_load(0)
+    , m_capture_fps(0)
+    , m_admitted(0)
+    , m_downgraded(0)
+    , m_rejected(0)
+    , m_tickets(0)
+    { }
+
+    admission(const admission&) = delete;
+    admission& operator=(const admission&) = delete;
+
+    // Streams add every byte they write to this.
+    auto sent() -> std::atomic<std::uint64_t>&
+    { return m_sent; }
+
+    // Seconds a rejected client should wait before trying again.
+    auto retry_after() const -> int
+    { return static_cast<int>(std::chrono::duration_cast<std::chrono::seconds>(m_hold).count()); }
+
+    // Admits a viewer of `fps` frames per second, 0 for every captured
+    // frame, to the first of `choices` that fits within the budgets, and
+    // returns its index, or -1 if none does. Choices after the first are
+    // downgrades and only considered if they are cheaper than the first.
+    // If `ticket` is given, it is set to what release() takes to give the
+    // reservation back.
+    auto admit(const std::vector<variant_key>& choices, int fps, std::uint64_t* ticket = nullptr) -> int
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto const now = clock::now();
+        sample(now);
+        while (!m_reserved.empty() && m_reserved.front().expires <= now) {
+            m_reserved.pop_front();
+        }
+        auto bytes = m_bytes_rate;
+        auto load = m_encode_load;
+        for (auto const& r : m_reserved) {
+            bytes += r.bytes_per_second;
+            load += r.encode_load;
+        }
+
+        // Until frames have been counted, assume a typical webcam
+        auto const capture_fps = m_capture_fps > 0 ? m_capture_fps : 30.0;
+        auto const rate = fps > 0 ? std::min<double>(fps, capture_fps) : capture_fps;
+        double first_bytes = 0;
+        double first_load = 0;
+        for (std::size_t i = 0; i < choices.size(); ++i) {
+            auto const cost = m_variants.cost(choices[i]);
+            auto const need_bytes = cost.frame_bytes * rate;
+            auto const need_load = cost.active ? 0.0 : cost.encode_seconds * capture_fps;
+            if (i == 0) {
+                first_bytes = need_bytes;
+                first_load = need_load;
+            } else if (need_bytes >= first_bytes && need_load >= first_load) {
+                continue;
+            }
+            if ((m_uplink > 0 && bytes + need_bytes > m_uplink) ||
+                    (m_encode_budget > 0 && load + need_load > m_encode_budget)) {
+                continue;
+            }
+            m_reserved.push_back(reservation{++m_tickets, now + m_hold, need_bytes, need_load});
+            if (ticket) {
+                *ticket = m_tickets;
+            }
+            ++(i == 0 ? m_admitted : m_downgraded);
+            return static_cast<int>(i);
+        }
+        ++m_rejected;
+        return -1;
+    }
+
+    // Gives back the reservation of a viewer admitted with `ticket` that
+    // did not start streaming after all, e.g. because the camera did not
+    // open.
+    auto release(std::uint64_t ticket) -> void
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto const it = std::find_if(m_reserved.begin(), m_reserved.end(),
+            [ticket](const reservation& r) { return r.ticket == ticket; });
+        if (it != m_reserved.end()) {
+            m_reserved.erase(it);
+        }
+    }
+
+    auto stats() -> stats_type
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sample(clock::now());
+        return stats_type{m_bytes_rate, m_encode_load, m_admitted, m_downgraded, m_rejected};
+    }
+
+private:
+    struct reservation
+    {
+        std::uint64_t ticket;
+        clock::time_point expires;
+        double bytes_per_second;
+        double encode_load;
+    };
+
+    // Turns the counters into rates, smoothed over samples taken close
+    // together. After a long quiet spell the new sample stands alone.
+    auto sample(clock::time_point now) -> void
+    {
+        auto const seconds = std::chrono::duration<double>(now - m_sampled).count();
+        if (seconds < 0.5) {
+            return;
+        }
+        auto const sent = m_sent.load();
+        auto const variants = m_variants.stats();
+        auto const weight = seconds > 5 ? 1.0 : 0.5;
+        auto const smooth = [weight](double& value, double sample) {
+            value = (1 - weight) * value + weight * sample;
+        };
+        smooth(m_bytes_rate, (sent - m_last_sent) / seconds);
+        smooth(m_encode_load, (variants.encode_seconds - m_last_encode) / seconds);
+        smooth(m_capture_fps, (variants.frames - m_last_frames) / seconds);
+        m_last_sent = sent;
+        m_last_frames = variants.frames;
+        m_last_encode = variants.encode_seconds;
+        m_sampled = now;
+    }
+
+    const variant_cache& m_variants;
+    double m_uplink;
+    double m_encode_budget;
+    clock::duration m_hold;
+    std::atomic<std::uint64_t> m_sent;
+    std::deque<reservation> m_reserved;
+    clock::time_point m_sampled;
+    std::uint64_t m_last_sent;
+    std::uint64_t m_last_frames;
+    double m_last_encode;
+    double m_bytes_rate;
+    double m_encode_load;
+    double m_capture_fps;
+    std::uint64_t m_admitted;
+    std::uint64_t m_downgraded;
+    std::uint64_t m_rejected;
+    std::uint64_t m_tickets;
+    std::mutex m_mutex;
+};
+
+} // namespace gh
+
+#endif // GH_ADMISSION_HPP
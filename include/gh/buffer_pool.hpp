@@ -0,0 +1,153 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_BUFFER_POOL_HPP
+#define GH_BUFFER_POOL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace gh {
+
+struct pool_stats
+{
+    std::uint64_t hits;
+    std::uint64_t misses;
+    std::size_t objects;
+};
+
+// Keeps a set of objects grouped by size class and hands them out as
+// shared pointers. An object goes back into circulation as soon as the
+// pool holds the only reference to it, so readers never have to return
+// anything explicitly.
+template<class T>
+class object_pool
+{
+public:
+    using pointer = std::shared_ptr<T>;
+    using Recyclable = std::function<bool(const T&)>;
+
+    explicit object_pool(std::size_t max_per_class = 8)
+    : m_max_per_class(max_per_class)
+    , m_hits(0)
+    , m_misses(0)
+    { }
+
+    object_pool(const object_pool&) = delete;
+    object_pool& operator=(const object_pool&) = delete;
+
+    // Extra check for objects that share storage outside of the pointer
+    // (e.g. cv::Mat headers copied from a pooled frame).
+    template <class Callable>
+    auto set_recyclable(Callable&& callback) -> void
+    { m_recyclable = std::move(callback); }
+
+    template <class Make>
+    auto acquire(std::size_t size_class, Make&& make) -> pointer
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::size_t in_class = 0;
+        for (auto& slot : m_slots) {
+            if (slot.size_class != size_class) {
+                continue;
+            }
+            ++in_class;
+            // Only the pool references it, nobody can take a new
+            // reference without going through this lock.
+            if (slot.ptr.use_count() == 1 &&
+                    (!m_recyclable || m_recyclable(*slot.ptr))) {
+                ++m_hits;
+                return slot.ptr;
+            }
+        }
+        ++m_misses;
+        pointer p{make(size_class)};
+        if (in_class < m_max_per_class) {
+            m_slots.push_back(slot_type{size_class, p});
+        }
+        return p;
+    }
+
+    auto acquire(std::size_t size_class) -> pointer
+    {
+        return acquire(size_class, [](std::size_t) { return new T(); });
+    }
+
+    auto stats() const -> pool_stats
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return pool_stats{m_hits, m_misses, m_slots.size()};
+    }
+
+    auto clear() -> void
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_slots.clear();
+    }
+
+private:
+    struct slot_type
+    {
+        std::size_t size_class;
+        pointer ptr;
+    };
+
+    std::size_t m_max_per_class;
+    std::uint64_t m_hits;
+    std::uint64_t m_misses;
+    std::vector<slot_type> m_slots;
+    Recyclable m_recyclable;
+    mutable std::mutex m_mutex;
+};
+
+using buffer = std::vector<unsigned char>;
+using buffer_ptr = std::shared_ptr<const buffer>;
+
+// Pool of byte buffers for encoded images. Requests are rounded up to a
+// power-of-two size class so buffers keep their capacity across frames
+// whose encoded size fluctuates.
+class buffer_pool
+{
+public:
+    static constexpr std::size_t min_size_class = 16 * 1024;
+
+    explicit buffer_pool(std::size_t max_per_class = 8)
+    : m_pool(max_per_class)
+    { }
+
+    static auto size_class(std::size_t n) -> std::size_t
+    {
+        std::size_t c = min_size_class;
+        while (c < n) {
+            c <<= 1;
+        }
+        return c;
+    }
+
+    // Returns an empty buffer with at least `size_hint` bytes reserved.
+    auto acquire(std::size_t size_hint) -> std::shared_ptr<buffer>
+    {
+        auto p = m_pool.acquire(size_class(size_hint), [](std::size_t n) {
+            auto b = new buffer();
+            b->reserve(n);
+            return b;
+        });
+        p->clear();
+        return p;
+    }
+
+    auto stats() const -> pool_stats
+    { return m_pool.stats(); }
+
+private:
+    object_pool<buffer> m_pool;
+};
+
+} // namespace gh
+
+#endif // GH_BUFFER_POOL_HPP
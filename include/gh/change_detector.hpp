@@ -0,0 +1,66 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_CHANGE_DETECTOR_HPP
+#define GH_CHANGE_DETECTOR_HPP
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace gh {
+
+// Tells whether a frame looks different from the last frame it reported
+// as changed, by comparing coarse grayscale thumbnails. A cell of the
+// thumbnail averages thousands of pixels, so sensor noise stays far below
+// the threshold while anything moving in the scene does not. Comparing
+// against the last changed frame instead of the previous one makes slow
+// drifts (e.g. daylight) add up until they count as a change.
+class change_detector
+{
+public:
+    explicit change_detector(cv::Size grid = cv::Size(32, 24), int threshold = 12)
+    : m_grid(grid)
+    , m_threshold(threshold)
+    { }
+
+    change_detector(const change_detector&) = delete;
+    change_detector& operator=(const change_detector&) = delete;
+
+    auto set_threshold(int threshold) -> void
+    { m_threshold = threshold; }
+
+    auto update(cv::InputArray frame) -> bool
+    {
+        cv::resize(frame, m_small, m_grid, 0, 0, cv::INTER_AREA);
+        if (m_small.channels() == 3) {
+            cv::cvtColor(m_small, m_gray, cv::COLOR_BGR2GRAY);
+        } else {
+            m_gray = m_small;
+        }
+        if (m_reference.empty() || m_reference.size() != m_gray.size()) {
+            m_gray.copyTo(m_reference);
+            return true;
+        }
+        cv::absdiff(m_gray, m_reference, m_diff);
+        double max = 0;
+        cv::minMaxLoc(m_diff, nullptr, &max);
+        if (max < m_threshold) {
+            return false;
+        }
+        m_gray.copyTo(m_reference);
+        return true;
+    }
+
+private:
+    cv::Size m_grid;
+    int m_threshold;
+    cv::Mat m_small;
+    cv::Mat m_gray;
+    cv::Mat m_diff;
+    cv::Mat m_reference;
+};
+
+} // namespace gh
+
+#endif // GH_CHANGE_DETECTOR_HPP
@@ -0,0 +1,254 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_CHANNEL_HPP
+#define GH_CHANNEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/execution/context_as.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/query.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+namespace gh {
+
+// Fans published messages out to subscribers running on io_contexts.
+// Messages are shared, typically shared_ptr<const T>, as every subscriber
+// gets the same one.
+//
+// Subscribers are grouped by the io_context their executor belongs to.
+// A publish posts one notification per io_context, which then delivers
+// the message to that context's subscribers on their own executors. With
+// one io_context per thread this keeps every delivery on the thread that
+// owns the subscriber's socket.
+template<class Message>
+class channel
+{
+public:
+    using message_type = Message;
+    using executor_type = boost::asio::any_io_executor;
+    using Handler = std::function<void(const Message&)>;
+
+private:
+    struct subscriber
+    {
+        executor_type executor;
+        Handler handler;
+        std::atomic<bool> active;
+    };
+
+    struct shard
+    {
+        const void* context;
+        executor_type executor;
+        std::vector<std::shared_ptr<subscriber>> subscribers;
+    };
+
+    using shard_list = std::vector<std::shared_ptr<const shard>>;
+
+public:
+    // Unsubscribes when destroyed.
+    class subscription
+    {
+    public:
+        subscription() noexcept
+        : m_channel(nullptr)
+        { }
+
+        subscription(const subscription&) = delete;
+        subscription& operator=(const subscription&) = delete;
+
+        subscription(subscription&& other) noexcept
+        : m_channel(other.m_channel)
+        , m_subscriber(std::move(other.m_subscriber))
+        { other.m_channel = nullptr; }
+
+        subscription& operator=(subscription&& other)
+        {
+            if (this != &other) {
+                reset();
+                m_channel = other.m_channel;
+                m_subscriber = std::move(other.m_subscriber);
+                other.m_channel = nullptr;
+            }
+            return *this;
+        }
+
+        ~subscription()
+        { reset(); }
+
+        explicit operator bool() const noexcept
+        { return m_channel != nullptr; }
+
+        auto reset() -> void
+        {
+            if (m_channel) {
+                m_channel->unsubscribe(m_subscriber);
+                m_channel = nullptr;
+                m_subscriber.reset();
+            }
+        }
+
+    private:
+        friend class channel;
+
+        subscription(channel* c, std::shared_ptr<subscriber> s) noexcept
+        : m_channel(c)
+        , m_subscriber(std::move(s))
+        { }
+
+        channel* m_channel;
+        std::shared_ptr<subscriber> m_subscriber;
+    };
+
+    channel()
+    : m_shards(std::make_shared<shard_list>())
+    , m_size(0)
+    { }
+
+    channel(const channel&) = delete;
+    channel& operator=(const channel&) = delete;
+
+    // `handler` is invoked on `executor` for every message published
+    // after this call returns.
+    auto subscribe(const executor_type& executor, Handler handler) -> subscription
+    {
+        auto s = std::make_shared<subscriber>();
+        s->executor = executor;
+        s->handler = std::move(handler);
+        s->active = true;
+
+        auto const context = context_of(executor);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto shards = std::make_shared<shard_list>(*m_shards);
+        bool found = false;
+        for (auto& sh : *shards) {
+            if (sh->context == context) {
+                auto copy = std::make_shared<shard>(*sh);
+                copy->subscribers.push_back(s);
+                sh = std::move(copy);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            auto sh = std::make_shared<shard>();
+            sh->context = context;
+            sh->executor = shard_executor(executor);
+            sh->subscribers.push_back(s);
+            shards->push_back(std::move(sh));
+        }
+        m_shards = std::move(shards);
+        ++m_size;
+        return subscription{this, std::move(s)};
+    }
+
+    auto publish(const Message& m) -> void
+    {
+        std::shared_ptr<const shard_list> shards;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_latest = m;
+            shards = m_shards;
+        }
+        for (auto const& sh : *shards) {
+            std::shared_ptr<const shard> target = sh;
+            boost::asio::post(sh->executor, [target, m]() {
+                for (auto const& s : target->subscribers) {
+                    deliver(s, m);
+                }
+            });
+        }
+    }
+
+    auto latest() const -> Message
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_latest;
+    }
+
+    auto size() const -> std::size_t
+    { return m_size.load(); }
+
+    auto shards() const -> std::size_t
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_shards->size();
+    }
+
+private:
+    static auto context_of(const executor_type& executor) -> const void*
+    {
+        return &boost::asio::query(executor,
+            boost::asio::execution::context_as_t<boost::asio::execution_context&>());
+    }
+
+    // Notifications go to the io_context or thread pool itself rather than
+    // to the first subscriber's strand, so they never queue behind its
+    // socket work or file writes.
+    static auto shard_executor(const executor_type& executor) -> executor_type
+    {
+        using io_executor = boost::asio::io_context::executor_type;
+        using pool_executor = boost::asio::thread_pool::executor_type;
+        auto strand = executor.target<boost::asio::strand<io_executor>>();
+        if (strand) {
+            return strand->get_inner_executor();
+        }
+        auto pool_strand = executor.target<boost::asio::strand<pool_executor>>();
+        if (pool_strand) {
+            return pool_strand->get_inner_executor();
+        }
+        return executor;
+    }
+
+    static auto deliver(const std::shared_ptr<subscriber>& s, const Message& m) -> void
+    {
+        if (!s->active) {
+            return;
+        }
+        boost::asio::dispatch(s->executor, [s, m]() {
+            if (s->active) {
+                s->handler(m);
+            }
+        });
+    }
+
+    auto unsubscribe(const std::shared_ptr<subscriber>& s) -> void
+    {
+        s->active = false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto shards = std::make_shared<shard_list>();
+        shards->reserve(m_shards->size());
+        for (auto const& sh : *m_shards) {
+            auto copy = std::make_shared<shard>(*sh);
+            auto& v = copy->subscribers;
+            v.erase(std::remove(v.begin(), v.end(), s), v.end());
+            if (!v.empty()) {
+                shards->push_back(std::move(copy));
+            }
+        }
+        m_shards = std::move(shards);
+        --m_size;
+    }
+
+    std::shared_ptr<const shard_list> m_shards;
+    Message m_latest;
+    std::atomic<std::size_t> m_size;
+    mutable std::mutex m_mutex;
+};
+
+} // namespace gh
+
+#endif // GH_CHANNEL_HPP
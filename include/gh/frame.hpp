@@ -0,0 +1,99 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_FRAME_HPP
+#define GH_FRAME_HPP
+
+#include "gh/buffer_pool.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include <boost/asio/buffer.hpp>
+
+#include <opencv2/core.hpp>
+
+namespace gh {
+
+// A captured image together with its encoded form. Frames are published
+// as shared pointers to const, so every reader sees the same bytes
+// without copying.
+struct frame
+{
+    std::uint64_t seq;
+    std::chrono::system_clock::time_point timestamp;
+    // An extension (e.g. the motion detector) reported activity.
+    bool motion;
+    // Differs visibly from the last frame marked as changed. Streams may
+    // skip frames that are not.
+    bool changed;
+    // BGR, or for YUV captures the luma plane, see yuv.hpp
+    cv::Mat image;
+    // Empty for BGR captures; for YUV captures Cb and Cr side by side
+    cv::Mat chroma;
+    buffer_ptr jpeg;
+    // Encoded bytes that live elsewhere, e.g. in a mapped journal segment
+    // kept there by `storage`. Only used when `jpeg` is null.
+    std::shared_ptr<const void> storage;
+    boost::asio::const_buffer stored;
+
+    // The encoded bytes, wherever they are
+    auto encoded() const -> boost::asio::const_buffer
+    { return jpeg ? boost::asio::buffer(*jpeg) : stored; }
+};
+
+using frame_ptr = std::shared_ptr<const frame>;
+
+// Receives every frame a webcam publishes, on the capture thread.
+class frame_sink
+{
+public:
+    virtual auto publish(const frame_ptr& f) -> void = 0;
+
+    // The webcam stopped capturing for good, e.g. because it was
+    // unplugged. Sinks passing frames on tell their readers here.
+    virtual auto end() -> void
+    { }
+};
+
+// Pool of frames keyed by the byte size of their image, so the capture
+// keeps writing into the same cv::Mat storage once the resolution is
+// known.
+class frame_pool
+{
+public:
+    explicit frame_pool(std::size_t max_per_class = 8)
+    : m_pool(max_per_class)
+    {
+        // A cv::Mat header copied out of a frame keeps its storage alive
+        // even after the frame pointer is gone.
+        m_pool.set_recyclable([](const frame& f) {
+            return (f.image.u == nullptr || f.image.u->refcount <= 1) &&
+                   (f.chroma.u == nullptr || f.chroma.u->refcount <= 1);
+        });
+    }
+
+    auto acquire(std::size_t image_bytes) -> std::shared_ptr<frame>
+    {
+        auto f = m_pool.acquire(image_bytes);
+        f->jpeg.reset();
+        f->storage.reset();
+        f->stored = boost::asio::const_buffer();
+        return f;
+    }
+
+    static auto size_class(const cv::Mat& image) -> std::size_t
+    { return image.total() * image.elemSize(); }
+
+    auto stats() const -> pool_stats
+    { return m_pool.stats(); }
+
+private:
+    object_pool<frame> m_pool;
+};
+
+} // namespace gh
+
+#endif // GH_FRAME_HPP
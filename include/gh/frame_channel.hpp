@@ -0,0 +1,27 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_FRAME_CHANNEL_HPP
+#define GH_FRAME_CHANNEL_HPP
+
+#include "gh/channel.hpp"
+#include "gh/frame.hpp"
+
+namespace gh {
+
+// A channel of frames, which can be installed on a webcam. A null frame
+// means the webcam failed; subscribers streaming its frames end there.
+class frame_channel : public channel<frame_ptr>, public frame_sink
+{
+public:
+    auto publish(const frame_ptr& f) -> void override
+    { channel<frame_ptr>::publish(f); }
+
+    auto end() -> void override
+    { channel<frame_ptr>::publish(nullptr); }
+};
+
+} // namespace gh
+
+#endif // GH_FRAME_CHANNEL_HPP
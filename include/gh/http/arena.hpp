@@ -0,0 +1,248 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_ARENA_HPP
+#define GH_HTTP_ARENA_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace gh {
+namespace http {
+
+// Bump allocator for the header fields of a request and its response.
+//
+// Fields are carved out of a fixed block one after the other and never
+// given back one by one; once every allocation has been released the
+// whole block is free again, which for a session happens between two
+// requests. What does not fit goes to the heap. Not thread-safe: the
+// session's strand is the only user.
+class arena
+{
+public:
+    static constexpr std::size_t capacity = 8 * 1024;
+
+    arena()
+    : m_used(0)
+    , m_live(0)
+    { }
+
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+
+    auto allocate(std::size_t n) -> void*
+    {
+        auto const align = alignof(std::max_align_t);
+        auto const size = (n + align - 1) / align * align;
+        if (capacity - m_used < size) {
+            return ::operator new(n);
+        }
+        auto const p = m_storage + m_used;
+        m_used += size;
+        ++m_live;
+        return p;
+    }
+
+    auto deallocate(void* p) noexcept -> void
+    {
+        if (p < static_cast<void*>(m_storage) || p >= static_cast<void*>(m_storage + capacity)) {
+            return ::operator delete(p);
+        }
+        if (--m_live == 0) {
+            m_used = 0;
+        }
+    }
+
+private:
+    alignas(std::max_align_t) char m_storage[capacity];
+    std::size_t m_used;
+    std::size_t m_live;
+};
+
+// Standard allocator over a shared arena. A default constructed one uses
+// the heap. Messages holding it keep the arena alive, so a request a route
+// holds on to stays valid after its session is gone.
+template<class T>
+class arena_allocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    arena_allocator() noexcept
+    { }
+
+    explicit arena_allocator(std::shared_ptr<arena> a) noexcept
+    : m_arena(std::move(a))
+    { }
+
+    template<class U>
+    arena_allocator(const arena_allocator<U>& other) noexcept
+    : m_arena(other.m_arena)
+    { }
+
+    auto allocate(std::size_t n) -> T*
+    {
+        return static_cast<T*>(m_arena
+            ? m_arena->allocate(n * sizeof(T))
+            : ::operator new(n * sizeof(T)));
+    }
+
+    auto deallocate(T* p, std::size_t /*n*/) noexcept -> void
+    {
+        if (m_arena) {
+            m_arena->deallocate(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template<class U>
+    friend auto operator==(const arena_allocator& a, const arena_allocator<U>& b) noexcept -> bool
+    { return a.m_arena == b.m_arena; }
+
+    template<class U>
+    friend auto operator!=(const arena_allocator& a, const arena_allocator<U>& b) noexcept -> bool
+    { return a.m_arena != b.m_arena; }
+
+private:
+    template<class U>
+    friend class arena_allocator;
+
+    std::shared_ptr<arena> m_arena;
+};
+
+// Memory for the operations a session has in flight, a read or a write
+// and what Asio and Beast allocate for them, which is the same few blocks
+// from one request to the next. Blocks are released by whichever thread
+// completes the operation, so the slots are claimed atomically. When all
+// are taken, or a block is too large, the heap is used.
+class handler_memory
+{
+public:
+    static constexpr std::size_t slots = 4;
+    static constexpr std::size_t slot_size = 1024;
+
+    handler_memory()
+    {
+        for (auto& used : m_used) {
+            used.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    handler_memory(const handler_memory&) = delete;
+    handler_memory& operator=(const handler_memory&) = delete;
+
+    auto allocate(std::size_t n) -> void*
+    {
+        if (n <= slot_size) {
+            for (std::size_t i = 0; i < slots; ++i) {
+                if (!m_used[i].exchange(true, std::memory_order_acquire)) {
+                    return m_storage[i].bytes;
+                }
+            }
+        }
+        return ::operator new(n);
+    }
+
+    auto deallocate(void* p) noexcept -> void
+    {
+        for (std::size_t i = 0; i < slots; ++i) {
+            if (p == m_storage[i].bytes) {
+                m_used[i].store(false, std::memory_order_release);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+private:
+    struct slot
+    {
+        alignas(std::max_align_t) char bytes[slot_size];
+    };
+
+    std::array<slot, slots> m_storage;
+    std::array<std::atomic<bool>, slots> m_used;
+};
+
+template<class T>
+class handler_allocator
+{
+public:
+    using value_type = T;
+
+    explicit handler_allocator(handler_memory& memory) noexcept
+    : m_memory(&memory)
+    { }
+
+    template<class U>
+    handler_allocator(const handler_allocator<U>& other) noexcept
+    : m_memory(other.m_memory)
+    { }
+
+    auto allocate(std::size_t n) const -> T*
+    { return static_cast<T*>(m_memory->allocate(n * sizeof(T))); }
+
+    auto deallocate(T* p, std::size_t /*n*/) const noexcept -> void
+    { m_memory->deallocate(p); }
+
+    template<class U>
+    friend auto operator==(const handler_allocator& a, const handler_allocator<U>& b) noexcept -> bool
+    { return a.m_memory == b.m_memory; }
+
+    template<class U>
+    friend auto operator!=(const handler_allocator& a, const handler_allocator<U>& b) noexcept -> bool
+    { return a.m_memory != b.m_memory; }
+
+private:
+    template<class U>
+    friend class handler_allocator;
+
+    handler_memory* m_memory;
+};
+
+// A completion handler whose associated allocator draws from `memory`.
+template<class Handler>
+class recycled_handler
+{
+public:
+    using allocator_type = handler_allocator<Handler>;
+
+    recycled_handler(handler_memory& memory, Handler handler)
+    : m_memory(&memory)
+    , m_handler(std::move(handler))
+    { }
+
+    auto get_allocator() const noexcept -> allocator_type
+    { return allocator_type(*m_memory); }
+
+    template<class... Args>
+    auto operator()(Args&&... args) -> void
+    { m_handler(std::forward<Args>(args)...); }
+
+private:
+    handler_memory* m_memory;
+    Handler m_handler;
+};
+
+template<class Handler>
+auto recycle(handler_memory& memory, Handler&& handler)
+    -> recycled_handler<typename std::decay<Handler>::type>
+{
+    return recycled_handler<typename std::decay<Handler>::type>(
+        memory, std::forward<Handler>(handler));
+}
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_ARENA_HPP
@@ -0,0 +1,206 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_EVENT_STREAM_HPP
+#define GH_HTTP_EVENT_STREAM_HPP
+
+#include "gh/motion_events.hpp"
+#include "gh/http/router.hpp"
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/write.hpp>
+
+namespace gh {
+namespace http {
+
+// Pushes motion events as Server-Sent Events over a socket taken from
+// the session:
+//
+//     id: 1234
+//     event: motion
+//     data: {"motion":true,"seq":1234,...,"coalesced":0}
+//
+// with `event: still` once motion stops. Events arriving while one is
+// being written are coalesced into the newest, which reports how many it
+// stands for, so a slow subscriber always ends up with the current state
+// without queueing. A comment goes out when nothing else has for a while,
+// to keep proxies from closing the connection.
+class event_stream : public std::enable_shared_from_this<event_stream>
+{
+public:
+    using Socket = router::Socket;
+
+    event_stream(Socket&& socket, boost::core::string_view name)
+    : m_socket(std::move(socket))
+    , m_timer(m_socket.get_executor())
+    , m_heartbeat(std::chrono::seconds(15))
+    , m_coalesced(0)
+    , m_writing(false)
+    {
+        namespace http = boost::beast::http;
+        m_response.result(http::status::ok);
+        m_response.set(http::field::server, name);
+        m_response.set(http::field::cache_control, "no-cache");
+        m_response.set(http::field::content_type, "text/event-stream");
+    }
+
+    event_stream(const event_stream&) = delete;
+    event_stream& operator=(const event_stream&) = delete;
+
+    // Writes the response header and forwards events published to
+    // `channel` from then on. The channel and `guard` are held until the
+    // stream ends.
+    auto start(unsigned version, std::shared_ptr<event_channel> channel,
+               std::shared_ptr<void> guard = nullptr) -> void
+    {
+        m_guard = std::move(guard);
+        m_channel = std::move(channel);
+        m_response.version(version);
+
+        std::weak_ptr<event_stream> weak = shared_from_this();
+        m_subscription = m_channel->subscribe(m_socket.get_executor(),
+            [weak](const motion_event_ptr& e) {
+                auto self = weak.lock();
+                if (self) {
+                    self->on_event(e);
+                }
+            });
+
+        do_read();
+        wait();
+
+        m_writing = true;
+        boost::beast::http::async_write(m_socket, m_response,
+            boost::beast::bind_front_handler(
+                &event_stream::on_write,
+                shared_from_this()));
+    }
+
+private:
+    // As for mjpeg_stream, this notices the client going away.
+    auto do_read() -> void
+    {
+        m_socket.async_read_some(boost::asio::buffer(m_discard),
+            boost::beast::bind_front_handler(
+                &event_stream::on_read,
+                shared_from_this()));
+    }
+
+    auto on_read(boost::system::error_code ec, std::size_t /*bytes_transferred*/) -> void
+    {
+        if (ec) {
+            return close();
+        }
+        do_read();
+    }
+
+    auto wait() -> void
+    {
+        m_timer.expires_after(m_heartbeat);
+        m_timer.async_wait(
+            boost::beast::bind_front_handler(
+                &event_stream::on_timer,
+                shared_from_this()));
+    }
+
+    auto on_timer(boost::system::error_code ec) -> void
+    {
+        if (ec || !m_socket.is_open()) {
+            return;
+        }
+        if (!m_writing) {
+            write(": keepalive\n\n");
+        }
+        wait();
+    }
+
+    auto on_event(const motion_event_ptr& e) -> void
+    {
+        // The webcam failed
+        if (!e) {
+            return close();
+        }
+        if (m_writing) {
+            if (m_pending) {
+                ++m_coalesced;
+            }
+            m_pending = e;
+            return;
+        }
+        send(e);
+    }
+
+    auto send(const motion_event_ptr& e) -> void
+    {
+        auto json = e->to_json();
+        json.insert(json.size() - 1, ",\"coalesced\":" + std::to_string(m_coalesced));
+        m_coalesced = 0;
+        write("id: " + std::to_string(e->seq) +
+              (e->motion ? "\nevent: motion\ndata: " : "\nevent: still\ndata: ") +
+              json + "\n\n");
+    }
+
+    auto write(std::string message) -> void
+    {
+        m_writing = true;
+        m_out = std::move(message);
+        boost::asio::async_write(m_socket, boost::asio::buffer(m_out),
+            boost::beast::bind_front_handler(
+                &event_stream::on_write,
+                shared_from_this()));
+    }
+
+    auto on_write(boost::system::error_code ec, std::size_t /*bytes_transferred*/) -> void
+    {
+        m_writing = false;
+        if (ec) {
+            return close();
+        }
+        if (m_pending) {
+            auto e = std::move(m_pending);
+            m_pending.reset();
+            send(e);
+        }
+    }
+
+    auto close() -> void
+    {
+        m_subscription.reset();
+        m_channel.reset();
+        m_pending.reset();
+        m_guard.reset();
+        m_timer.cancel();
+        boost::system::error_code ec;
+        m_socket.shutdown(Socket::shutdown_both, ec);
+        m_socket.close(ec);
+    }
+
+    Socket m_socket;
+    boost::asio::steady_timer m_timer;
+    boost::beast::http::response<boost::beast::http::empty_body> m_response;
+    std::shared_ptr<event_channel> m_channel;
+    event_channel::subscription m_subscription;
+    std::shared_ptr<void> m_guard;
+    motion_event_ptr m_pending;
+    std::string m_out;
+    std::array<char, 64> m_discard;
+    std::chrono::steady_clock::duration m_heartbeat;
+    unsigned m_coalesced;
+    bool m_writing;
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_EVENT_STREAM_HPP
@@ -0,0 +1,162 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_FRAME_POLL_HPP
+#define GH_HTTP_FRAME_POLL_HPP
+
+#include "gh/frame_channel.hpp"
+#include "gh/http/router.hpp"
+#include "gh/http/shared_buffer_body.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/string_body.hpp>
+
+namespace gh {
+namespace http {
+
+// Answers one request with the first frame of a channel other than the
+// one the client already has, or with 204 No Content if none shows up in
+// time. Nothing blocks while waiting.
+//
+// A frame is new if its sequence number differs from `after`, which also
+// covers the numbering starting over when the camera is opened again.
+// Clients passing back the sequence number they got see every frame at
+// most once.
+class frame_poll : public std::enable_shared_from_this<frame_poll>
+{
+public:
+    using executor_type = boost::asio::any_io_executor;
+
+    frame_poll(const executor_type& executor, boost::core::string_view name,
+               router::Responder respond)
+    : m_timer(executor)
+    , m_executor(executor)
+    , m_name(name)
+    , m_respond(std::move(respond))
+    , m_after(0)
+    , m_version(11)
+    , m_keep_alive(true)
+    , m_done(false)
+    { }
+
+    frame_poll(const frame_poll&) = delete;
+    frame_poll& operator=(const frame_poll&) = delete;
+
+    // Must be called on the executor given to the constructor.
+    auto start(const router::Request& request, const std::shared_ptr<frame_channel>& channel,
+               std::uint64_t after, std::chrono::steady_clock::duration timeout) -> void
+    {
+        m_version = request.version();
+        m_keep_alive = request.keep_alive();
+        m_after = after;
+
+        // Subscribe first, a frame published in between is not missed
+        std::weak_ptr<frame_poll> weak = shared_from_this();
+        m_subscription = channel->subscribe(m_executor, [weak](const frame_ptr& f) {
+            auto self = weak.lock();
+            if (self) {
+                self->on_frame(f);
+            }
+        });
+        m_channel = channel;
+
+        auto const f = channel->latest();
+        if (f) {
+            on_frame(f);
+        }
+        if (m_done) {
+            return;
+        }
+
+        m_timer.expires_after(timeout);
+        m_timer.async_wait(
+            boost::beast::bind_front_handler(
+                &frame_poll::on_timeout,
+                shared_from_this()));
+    }
+
+private:
+    auto on_frame(const frame_ptr& f) -> void
+    {
+        namespace http = boost::beast::http;
+        using namespace std::chrono;
+
+        if (m_done) {
+            return;
+        }
+        if (!f) {
+            // The webcam failed, the next poll opens it again
+            http::response<http::string_body> response{http::status::service_unavailable, m_version};
+            response.set(http::field::server, m_name);
+            response.set(http::field::content_type, "text/plain");
+            response.set(http::field::retry_after, "1");
+            response.keep_alive(m_keep_alive);
+            response.body() = "The camera stopped.";
+            response.prepare_payload();
+            return finish(std::move(response));
+        }
+        if (f->seq == m_after) {
+            return;
+        }
+
+        http::response<shared_buffer_body> response{http::status::ok, m_version};
+        response.set(http::field::server, m_name);
+        response.set(http::field::content_type, "image/jpeg");
+        response.set(http::field::cache_control, "no-cache");
+        response.set("X-Frame-Sequence", std::to_string(f->seq));
+        response.set("X-Frame-Timestamp", std::to_string(
+            duration_cast<milliseconds>(f->timestamp.time_since_epoch()).count()));
+        response.set("X-Frame-Motion", f->motion ? "1" : "0");
+        response.keep_alive(m_keep_alive);
+        response.body() = f->jpeg;
+        response.prepare_payload();
+        finish(std::move(response));
+    }
+
+    auto on_timeout(boost::system::error_code ec) -> void
+    {
+        if (ec || m_done) {
+            return;
+        }
+        namespace http = boost::beast::http;
+        http::response<http::empty_body> response{http::status::no_content, m_version};
+        response.set(http::field::server, m_name);
+        response.set("X-Frame-Sequence", std::to_string(m_after));
+        response.keep_alive(m_keep_alive);
+        finish(std::move(response));
+    }
+
+    auto finish(boost::beast::http::message_generator&& msg) -> void
+    {
+        m_done = true;
+        m_subscription.reset();
+        m_channel.reset();
+        m_timer.cancel();
+        m_respond(std::move(msg));
+    }
+
+    boost::asio::steady_timer m_timer;
+    executor_type m_executor;
+    std::string m_name;
+    router::Responder m_respond;
+    std::shared_ptr<frame_channel> m_channel;
+    frame_channel::subscription m_subscription;
+    std::uint64_t m_after;
+    unsigned m_version;
+    bool m_keep_alive;
+    bool m_done;
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_FRAME_POLL_HPP
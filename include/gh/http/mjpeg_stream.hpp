@@ -0,0 +1,260 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_MJPEG_STREAM_HPP
+#define GH_HTTP_MJPEG_STREAM_HPP
+
+#include "gh/frame_channel.hpp"
+#include "gh/rate_controller.hpp"
+#include "gh/http/router.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/write.hpp>
+
+namespace gh {
+namespace http {
+
+// Streams frames from a channel as multipart/x-mixed-replace over a
+// socket taken from the session, without blocking the I/O thread.
+//
+// At most one frame is in flight. A frame arriving while the previous one
+// is still being written replaces any frame already waiting, so a slow
+// client skips frames instead of queueing them.
+//
+// With a keep-alive interval set, frames not marked as changed are only
+// sent once per interval, which is all a static scene needs. A frame rate
+// limit drops frames arriving too soon after the last one sent; if one of
+// them was a change, the next frame goes out regardless.
+//
+// An adaptive stream times its writes and moves between the channels of a
+// quality ladder to keep up its frame rate on the client's link.
+class mjpeg_stream : public std::enable_shared_from_this<mjpeg_stream>
+{
+public:
+    using Socket = router::Socket;
+    using Resolver = std::function<std::shared_ptr<frame_channel>(std::size_t rung)>;
+
+    mjpeg_stream(Socket&& socket, boost::core::string_view name)
+    : m_socket(std::move(socket))
+    , m_keepalive(0)
+    , m_min_interval(0)
+    , m_counter(nullptr)
+    , m_writing(false)
+    , m_dirty(false)
+    {
+        // Source: https://github.com/boostorg/beast/issues/1740#issuecomment-922143751
+        namespace http = boost::beast::http;
+        m_response.result(http::status::ok);
+        m_response.set(http::field::server, name);
+        m_response.set(http::field::cache_control, "no-cache");
+        m_response.set(http::field::content_type, "multipart/x-mixed-replace; boundary=frame");
+        m_response.set(http::field::expires, "0");
+        m_response.set(http::field::pragma, "no-cache");
+    }
+
+    mjpeg_stream(const mjpeg_stream&) = delete;
+    mjpeg_stream& operator=(const mjpeg_stream&) = delete;
+
+    auto set_keepalive(std::chrono::steady_clock::duration interval) -> void
+    { m_keepalive = interval; }
+
+    auto set_max_fps(int fps) -> void
+    {
+        m_min_interval = fps > 0
+            ? std::chrono::steady_clock::duration(std::chrono::seconds(1)) / fps
+            : std::chrono::steady_clock::duration(0);
+    }
+
+    // Adds every byte written to `bytes` from then on.
+    auto set_counter(std::atomic<std::uint64_t>& bytes) -> void
+    { m_counter = &bytes; }
+
+    // Switch between `rungs` channels given by `resolve`, 0 being the
+    // cheapest, to deliver `fps` frames per second. Starts at `rung`.
+    // Where `resolve` gives no channel the stream stays on the one it has.
+    auto set_adaptive(std::size_t rungs, std::size_t rung, int fps, Resolver resolve) -> void
+    {
+        m_rate.reset(new rate_controller(rungs, rung, fps));
+        m_resolve = std::move(resolve);
+        set_max_fps(fps);
+
+        // Keep the kernel from buffering seconds of video, so that write
+        // times reflect the link and a late frame is replaced, not queued.
+        boost::system::error_code ec;
+        m_socket.set_option(Socket::send_buffer_size(128 * 1024), ec);
+    }
+
+    // Writes the response header and forwards frames published to
+    // `channel` from then on. The channel and `guard` are held until the
+    // stream ends. An adaptive stream may pass no channel to start at the
+    // rung given to set_adaptive().
+    auto start(unsigned version, std::shared_ptr<frame_channel> channel,
+               std::shared_ptr<void> guard = nullptr) -> void
+    {
+        m_guard = std::move(guard);
+        m_response.version(version);
+
+        if (!channel && m_rate) {
+            channel = m_resolve(m_rate->rung());
+        }
+        subscribe(std::move(channel));
+        if (!m_channel) {
+            return close();
+        }
+
+        do_read();
+
+        m_writing = true;
+        m_pending = m_channel->latest();
+        boost::beast::http::async_write(m_socket, m_response,
+            boost::beast::bind_front_handler(
+                &mjpeg_stream::on_write,
+                shared_from_this()));
+    }
+
+private:
+    auto subscribe(std::shared_ptr<frame_channel> channel) -> void
+    {
+        if (!channel) {
+            return;
+        }
+        std::weak_ptr<mjpeg_stream> weak = shared_from_this();
+        m_subscription = channel->subscribe(m_socket.get_executor(),
+            [weak](const frame_ptr& f) {
+                auto self = weak.lock();
+                if (self) {
+                    self->on_frame(f);
+                }
+            });
+        m_channel = std::move(channel);
+    }
+
+    // The client never sends anything, but keeping a read pending tells us
+    // as soon as it goes away and keeps the stream alive in between frames.
+    auto do_read() -> void
+    {
+        m_socket.async_read_some(boost::asio::buffer(m_discard),
+            boost::beast::bind_front_handler(
+                &mjpeg_stream::on_read,
+                shared_from_this()));
+    }
+
+    auto on_read(boost::system::error_code ec, std::size_t /*bytes_transferred*/) -> void
+    {
+        if (ec) {
+            return close();
+        }
+        do_read();
+    }
+
+    auto on_frame(const frame_ptr& f) -> void
+    {
+        // The webcam failed
+        if (!f) {
+            return close();
+        }
+        auto const elapsed = std::chrono::steady_clock::now() - m_last_sent;
+        if (elapsed < m_min_interval) {
+            m_dirty = m_dirty || f->changed;
+            return;
+        }
+        if (!f->changed && !m_dirty && m_keepalive.count() > 0 &&
+                elapsed < m_keepalive) {
+            return;
+        }
+        if (m_writing) {
+            m_pending = f;
+            return;
+        }
+        write(f);
+    }
+
+    auto write(frame_ptr f) -> void
+    {
+        static char const part[] = "\r\n--frame\r\nContent-Type: image/jpeg\r\n\r\n";
+
+        m_writing = true;
+        m_dirty = false;
+        m_last_sent = std::chrono::steady_clock::now();
+        m_write_started = m_last_sent;
+        m_inflight = std::move(f);
+        std::array<boost::asio::const_buffer, 2> const buffers{{
+            boost::asio::buffer(part, sizeof(part) - 1),
+            m_inflight->encoded()
+        }};
+        boost::asio::async_write(m_socket, buffers,
+            boost::beast::bind_front_handler(
+                &mjpeg_stream::on_write,
+                shared_from_this()));
+    }
+
+    auto on_write(boost::system::error_code ec, std::size_t bytes_transferred) -> void
+    {
+        m_writing = false;
+        if (m_counter) {
+            *m_counter += bytes_transferred;
+        }
+        if (ec) {
+            m_inflight.reset();
+            return close();
+        }
+        // Frames only, the response header tells nothing about the link
+        if (m_rate && m_inflight) {
+            auto const rung = m_rate->rung();
+            auto const took = std::chrono::steady_clock::now() - m_write_started;
+            if (m_rate->on_write(bytes_transferred, took) != rung) {
+                subscribe(m_resolve(m_rate->rung()));
+            }
+        }
+        m_inflight.reset();
+        if (m_pending) {
+            write(std::move(m_pending));
+        }
+    }
+
+    auto close() -> void
+    {
+        m_subscription.reset();
+        m_channel.reset();
+        m_pending.reset();
+        m_guard.reset();
+        boost::system::error_code ec;
+        m_socket.shutdown(Socket::shutdown_both, ec);
+        m_socket.close(ec);
+    }
+
+    Socket m_socket;
+    boost::beast::http::response<boost::beast::http::empty_body> m_response;
+    std::shared_ptr<frame_channel> m_channel;
+    frame_channel::subscription m_subscription;
+    std::unique_ptr<rate_controller> m_rate;
+    Resolver m_resolve;
+    std::shared_ptr<void> m_guard;
+    frame_ptr m_inflight;
+    frame_ptr m_pending;
+    std::array<char, 64> m_discard;
+    std::chrono::steady_clock::duration m_keepalive;
+    std::chrono::steady_clock::duration m_min_interval;
+    std::chrono::steady_clock::time_point m_last_sent;
+    std::chrono::steady_clock::time_point m_write_started;
+    std::atomic<std::uint64_t>* m_counter;
+    bool m_writing;
+    bool m_dirty;
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_MJPEG_STREAM_HPP
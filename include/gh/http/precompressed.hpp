@@ -0,0 +1,293 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_PRECOMPRESSED_HPP
+#define GH_HTTP_PRECOMPRESSED_HPP
+
+#include "gh/buffer_pool.hpp"
+
+#include <cctype>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <boost/beast/core/string.hpp>
+#include <boost/crc.hpp>
+#include <boost/beast/zlib/deflate_stream.hpp>
+
+namespace gh {
+namespace http {
+
+// Compressed forms of static files and views, picked by Accept-Encoding.
+//
+// A file stored next to the original with .br or .gz appended is sent as
+// is. Otherwise the gzip form made by prepare(), when the server starts,
+// or by refresh() is sent, and kept in memory until the file changes.
+// Requests themselves never compress anything: a file without a gzip form,
+// or whose form predates a change, goes uncompressed and select() tells
+// the caller to refresh() it elsewhere. Files too small to gain, or that
+// do not shrink, are remembered as such and sent uncompressed.
+//
+// select() still looks the file and its .br and .gz forms up with up to
+// three stat() calls on the calling thread.
+class precompressed
+{
+public:
+    struct variant
+    {
+        // Content-Encoding, "br" or "gzip"
+        const char* encoding;
+        // A file to send, or else the bytes in `data`
+        std::string path;
+        buffer_ptr data;
+        std::uint64_t size;
+    };
+
+    explicit precompressed(std::size_t max_file_size = 4 * 1024 * 1024)
+    : m_max_file_size(max_file_size)
+    { }
+
+    precompressed(const precompressed&) = delete;
+    precompressed& operator=(const precompressed&) = delete;
+
+    // Whether a client sending `accept_encoding` takes `coding`, that is
+    // lists it, or `*`, without q=0.
+    static auto accepts(boost::beast::string_view accept_encoding, boost::beast::string_view coding) -> bool
+    {
+        auto rest = accept_encoding;
+        while (!rest.empty()) {
+            auto const end = rest.find(',');
+            auto item = trim(rest.substr(0, end));
+            rest = end == boost::beast::string_view::npos
+                ? boost::beast::string_view() : rest.substr(end + 1);
+
+            auto const semicolon = item.find(';');
+            auto const name = trim(item.substr(0, semicolon));
+            if (!iequals(name, coding) && name != "*") {
+                continue;
+            }
+            if (semicolon == boost::beast::string_view::npos) {
+                return true;
+            }
+            auto const params = item.substr(semicolon + 1);
+            auto const q = params.find("q=");
+            if (q == boost::beast::string_view::npos) {
+                return true;
+            }
+            auto const value = trim(params.substr(q + 2));
+            // q=0, q=0.0, q=0.00 and so on turn the coding down
+            return value.find_first_not_of("0.") != boost::beast::string_view::npos;
+        }
+        return false;
+    }
+
+    // How to send the file at `path` to a client sending
+    // `accept_encoding`. False if it should go uncompressed. Sets `stale`
+    // if the gzip form is missing or outdated and nobody refreshes it yet;
+    // the caller is then expected to call refresh(), or abandon().
+    auto select(const std::string& path, boost::beast::string_view accept_encoding, variant& v,
+                bool* stale = nullptr) -> bool
+    {
+        if (accept_encoding.empty()) {
+            return false;
+        }
+        std::uint64_t size = 0;
+        std::time_t modified = 0;
+        if (accepts(accept_encoding, "br") && stat(path + ".br", size, modified)) {
+            v = variant{"br", path + ".br", nullptr, size};
+            return true;
+        }
+        if (!accepts(accept_encoding, "gzip")) {
+            return false;
+        }
+        if (stat(path + ".gz", size, modified)) {
+            v = variant{"gzip", path + ".gz", nullptr, size};
+            return true;
+        }
+        if (!stat(path, size, modified) || size > m_max_file_size) {
+            return false;
+        }
+
+        auto const data = lookup(path, size, modified, stale);
+        if (!data) {
+            return false;
+        }
+        v = variant{"gzip", std::string(), data, data->size()};
+        return true;
+    }
+
+    // Makes the gzip form of the file at `path` from its current content.
+    // Reads and compresses the whole file, so not on an I/O thread.
+    auto refresh(const std::string& path) -> void
+    {
+        std::uint64_t size = 0;
+        std::time_t modified = 0;
+        if (stat(path, size, modified) && size <= m_max_file_size) {
+            std::ifstream in(path, std::ios::binary);
+            buffer const original{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+            auto gzip = original.size() >= 256 ? compress(original) : nullptr;
+            if (gzip && gzip->size() >= original.size() * 9 / 10) {
+                gzip.reset();
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_entries[path] = entry{size, modified, gzip};
+        }
+        abandon(path);
+    }
+
+    // For a stale file select() reported that will not be refreshed after
+    // all, so that a later select() reports it again.
+    auto abandon(const std::string& path) -> void
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_refreshing.erase(path);
+    }
+
+    // Refreshes every file under `directory` for which `compressible` is
+    // true, e.g. when the server starts.
+    auto prepare(std::string directory, const std::function<bool(const std::string&)>& compressible) -> void
+    {
+        while (directory.size() > 1 && directory.back() == '/') {
+            directory.pop_back();
+        }
+        auto const dir = ::opendir(directory.c_str());
+        if (!dir) {
+            return;
+        }
+        while (auto const e = ::readdir(dir)) {
+            std::string const name = e->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            auto const path = directory + "/" + name;
+            struct ::stat st;
+            if (::stat(path.c_str(), &st) != 0) {
+                continue;
+            }
+            if ((st.st_mode & S_IFMT) == S_IFDIR) {
+                prepare(path, compressible);
+            } else if (compressible(path)) {
+                refresh(path);
+            }
+        }
+        ::closedir(dir);
+    }
+
+private:
+    struct entry
+    {
+        std::uint64_t size;
+        std::time_t modified;
+        // Null if compressing did not pay off
+        buffer_ptr gzip;
+    };
+
+    static auto trim(boost::beast::string_view s) -> boost::beast::string_view
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+
+    static auto iequals(boost::beast::string_view a, boost::beast::string_view b) -> bool
+    {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            if (std::tolower(static_cast<unsigned char>(a[i])) !=
+                    std::tolower(static_cast<unsigned char>(b[i]))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static auto stat(const std::string& path, std::uint64_t& size, std::time_t& modified) -> bool
+    {
+        struct ::stat st;
+        if (::stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+            return false;
+        }
+        size = static_cast<std::uint64_t>(st.st_size);
+        modified = st.st_mtime;
+        return true;
+    }
+
+    auto lookup(const std::string& path, std::uint64_t size, std::time_t modified, bool* stale) -> buffer_ptr
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto const it = m_entries.find(path);
+        if (it != m_entries.end() && it->second.size == size && it->second.modified == modified) {
+            return it->second.gzip;
+        }
+        if (stale) {
+            *stale = m_refreshing.insert(path).second;
+        }
+        return nullptr;
+    }
+
+    // RFC 1952: a fixed header, the raw deflate stream, then the CRC-32
+    // and the size of the original, both little endian.
+    static auto compress(const buffer& original) -> buffer_ptr
+    {
+        namespace zlib = boost::beast::zlib;
+
+        zlib::deflate_stream deflate;
+        deflate.reset(9, 15, 8, zlib::Strategy::normal);
+
+        auto out = std::make_shared<buffer>();
+        out->assign({0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 0xff});
+        auto const header = out->size();
+        out->resize(header + deflate.upper_bound(original.size()));
+
+        zlib::z_params zs;
+        zs.next_in = original.data();
+        zs.avail_in = original.size();
+        zs.next_out = out->data() + header;
+        zs.avail_out = out->size() - header;
+        boost::system::error_code ec;
+        deflate.write(zs, zlib::Flush::finish, ec);
+        if (ec != zlib::error::end_of_stream) {
+            return nullptr;
+        }
+        out->resize(header + zs.total_out);
+
+        boost::crc_32_type crc;
+        crc.process_bytes(original.data(), original.size());
+        auto const put = [&out](std::uint32_t value) {
+            for (auto i = 0; i < 4; ++i) {
+                out->push_back(static_cast<unsigned char>(value >> (8 * i)));
+            }
+        };
+        put(crc.checksum());
+        put(static_cast<std::uint32_t>(original.size()));
+        return out;
+    }
+
+    std::size_t m_max_file_size;
+    std::map<std::string, entry> m_entries;
+    // Stale files handed to a caller to refresh
+    std::set<std::string> m_refreshing;
+    std::mutex m_mutex;
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_PRECOMPRESSED_HPP
@@ -5,11 +5,17 @@
 #ifndef GH_HTTP_ROUTER_HPP
 #define GH_HTTP_ROUTER_HPP
 
+#include "gh/http/arena.hpp"
+#include "gh/http/precompressed.hpp"
+#include "gh/http/worker_pool.hpp"
+
 #include <vector>
 #include <string>
-#include <unordered_map>
 #include <cstdint>
+#include <functional>
 
+#include <boost/regex.hpp>
+#include <boost/beast/http/fields.hpp>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/message_generator.hpp>
 #include <boost/beast/http/string_body.hpp>
@@ -22,10 +28,26 @@ class router
 {
 public:
     using Matches = std::vector<std::string>;
-    using Request = boost::beast::http::request<boost::beast::http::string_body>;
+    // Header fields live in an arena of the session, see arena.hpp
+    using Fields = boost::beast::http::basic_fields<arena_allocator<char>>;
+    using Request = boost::beast::http::request<boost::beast::http::string_body, Fields>;
     using Socket = boost::beast::tcp_stream::socket_type;
     using Callback = std::function<boost::beast::http::message_generator(Matches&& matches, Request&& req, Socket& socket)>;
-    using Table = std::unordered_map<std::string, Callback>;
+    // Sends the response of an asynchronous route. It may be called from
+    // any thread, and must be called exactly once.
+    using Responder = std::function<void(boost::beast::http::message_generator&& msg)>;
+    using AsyncCallback = std::function<void(Matches&& matches, Request&& req, Socket& socket, Responder respond)>;
+
+    // Patterns are compiled once, when the route is added.
+    template<class Function>
+    struct Route
+    {
+        std::string path;
+        boost::regex pattern;
+        Function callback;
+    };
+    using Table = std::vector<Route<Callback>>;
+    using AsyncTable = std::vector<Route<AsyncCallback>>;
 
 public:
     explicit router(boost::core::string_view name)
@@ -38,18 +60,104 @@ public:
 
     template <class Callable>
     auto get(const char *path, Callable &&callback) -> void
-    { table[path] = std::move(callback); }
+    { add(table, path, std::forward<Callable>(callback)); }
 
     auto get_table() const -> const Table&
     { return table; }
 
+    // A route whose response is not ready when it returns. The session
+    // reads no further request until `respond` is called, and does not
+    // hold the I/O thread in the meantime. The socket's executor is the
+    // session's, for the route to wait on.
+    template <class Callable>
+    auto get_async(const char *path, Callable &&callback) -> void
+    { add(async_table, path, std::forward<Callable>(callback)); }
+
+    auto get_async_table() const -> const AsyncTable&
+    { return async_table; }
+
+    // A route that blocks or computes for a while, e.g. opens a device or
+    // a file. It is called like one added with get(), but on a thread of
+    // workers() instead of an I/O thread, and its response goes back to
+    // the session's strand. The socket is only there for its executor.
+    // When the workers are too far behind the client gets 503.
+    template <class Callable>
+    auto get_blocking(const char *path, Callable &&callback) -> void
+    { add_blocking(path, Callback(std::forward<Callable>(callback))); }
+
+    // Where routes added with get_blocking() run.
+    auto workers() -> worker_pool&
+    { return m_workers; }
+
+    // Sends the view compressed to clients that take it.
     auto view(Request &request, boost::string_view name)
             -> boost::beast::http::message_generator;
 
+    // Compressed forms of the views and static files.
+    auto assets() -> precompressed&
+    { return m_assets; }
+
+    // Makes the compressed forms of the views and of the static files
+    // under `doc_root`. Blocks; the server calls it before taking requests.
+    auto prepare_assets(const std::string& doc_root) -> void;
+
+    // Has the compressed form of `path`, which assets() found stale,
+    // remade on workers().
+    auto refresh_asset(const std::string& path) -> void;
+
+    // Value of `key` in the query string of the request target, or
+    // `fallback` if it is not there. Routes only match the path, so this
+    // is how they read their parameters.
+    static auto query(const Request& request, boost::core::string_view key,
+                      boost::core::string_view fallback = {}) -> std::string;
+
+    // The first route of `routes` matching all of `path`, or null. What
+    // the pattern's groups matched goes to `matches`, whose strings are
+    // reused.
+    template <class Function>
+    static auto match(const std::vector<Route<Function>>& routes,
+                      boost::core::string_view path, Matches& matches) -> const Route<Function>*
+    {
+        // Reused as well, matching allocates nothing once warm
+        static thread_local boost::cmatch m;
+        for (auto const& route : routes) {
+            if (!boost::regex_match(path.data(), path.data() + path.size(), m, route.pattern)) {
+                continue;
+            }
+            matches.resize(m.size());
+            for (std::size_t i = 0; i < m.size(); ++i) {
+                if (m[i].matched) {
+                    matches[i].assign(m[i].first, m[i].second);
+                } else {
+                    matches[i].clear();
+                }
+            }
+            return &route;
+        }
+        return nullptr;
+    }
+
 private:
+    template <class Function, class Callable>
+    static auto add(std::vector<Route<Function>>& routes, const char* path, Callable&& callback) -> void
+    {
+        for (auto& route : routes) {
+            if (route.path == path) {
+                route.callback = std::forward<Callable>(callback);
+                return;
+            }
+        }
+        routes.push_back(Route<Function>{path, boost::regex(path), std::forward<Callable>(callback)});
+    }
+
+    auto add_blocking(const char* path, Callback callback) -> void;
+
     std::string m_name;
     std::string m_view_dir;
     Table table;
+    AsyncTable async_table;
+    precompressed m_assets;
+    worker_pool m_workers;
 };
 
 } // namespace http
@@ -7,6 +7,16 @@
 
 #include "gh/http/router.hpp"
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace boost {
+namespace asio {
+class io_context;
+} // namespace asio
+} // namespace boost
+
 namespace gh {
 namespace http {
 
@@ -16,13 +26,15 @@ public:
     server(boost::core::string_view name, int threads=1)
     : router(name)
     , m_threads(threads)
+    , m_sharded(false)
+    , m_async_files(false)
+    , m_stop(false)
     , m_doc_root("../public")
     { }
 
     auto run(const char* host="127.0.0.1", unsigned short port=5000) -> int;
 
-    auto stop() -> void
-    { m_stop = true; }
+    auto stop() -> void;
 
     auto running() const -> bool
     { return !m_stop; }
@@ -33,6 +45,23 @@ public:
     auto threads() const -> int
     { return m_threads; }
 
+    // Run one io_context per thread, each pinned to a core and accepting
+    // on its own SO_REUSEPORT socket, instead of one io_context shared by
+    // all threads. Connections stay on the thread that accepted them.
+    auto set_sharded(bool sharded) -> void
+    { m_sharded = sharded; }
+
+    auto sharded() const -> bool
+    { return m_sharded; }
+
+    // Whether static files are read asynchronously. Decided by run()
+    // depending on what the build and the kernel support.
+    auto async_files() const -> bool
+    { return m_async_files; }
+
+    // Name of the reactor the server was built with.
+    static auto io_backend() -> const char*;
+
     auto set_doc_root(const char* path) -> void
     { m_doc_root = path; }
 
@@ -41,8 +70,12 @@ public:
 
 protected:
     int m_threads;
-    bool m_stop;
+    bool m_sharded;
+    bool m_async_files;
+    std::atomic<bool> m_stop;
     std::string m_doc_root;
+    std::vector<boost::asio::io_context*> m_contexts;
+    std::mutex m_mutex;
 };
 
 } // namespace http
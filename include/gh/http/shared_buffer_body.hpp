@@ -0,0 +1,62 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_SHARED_BUFFER_BODY_HPP
+#define GH_HTTP_SHARED_BUFFER_BODY_HPP
+
+#include "gh/buffer_pool.hpp"
+
+#include <cstdint>
+#include <utility>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+
+namespace gh {
+namespace http {
+
+// A response body sending a shared, immutable buffer as is, so an encoded
+// frame goes out without being copied into the response.
+struct shared_buffer_body
+{
+    using value_type = buffer_ptr;
+
+    static auto size(const value_type& body) -> std::uint64_t
+    { return body ? body->size() : 0; }
+
+    class writer
+    {
+    public:
+        using const_buffers_type = boost::asio::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(const boost::beast::http::header<isRequest, Fields>& /*header*/,
+               const value_type& body)
+        : m_body(body)
+        { }
+
+        auto init(boost::beast::error_code& ec) -> void
+        { ec = {}; }
+
+        auto get(boost::beast::error_code& ec)
+            -> boost::optional<std::pair<const_buffers_type, bool>>
+        {
+            ec = {};
+            if (!m_body || m_body->empty()) {
+                return boost::none;
+            }
+            return std::make_pair(const_buffers_type(m_body->data(), m_body->size()), false);
+        }
+
+    private:
+        const value_type& m_body;
+    };
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_SHARED_BUFFER_BODY_HPP
@@ -0,0 +1,170 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_WORKER_POOL_HPP
+#define GH_HTTP_WORKER_POOL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace gh {
+namespace http {
+
+// Threads for the work routes must not do on an I/O thread: blocking
+// calls such as opening the camera or a file, and long computations.
+//
+// Jobs run in the order they were posted. The queue is bounded, so a
+// burst of slow requests is turned away instead of piling up; post()
+// tells the caller. The threads start with the first job and end with
+// stop(), which drops what is still queued.
+class worker_pool
+{
+public:
+    using job = std::function<void()>;
+
+    struct stats_type
+    {
+        // Jobs waiting for a thread, and the most there ever were
+        std::size_t queued;
+        std::size_t peak;
+        std::size_t running;
+        std::uint64_t completed;
+        std::uint64_t rejected;
+        // Time jobs spent queued before a thread took them
+        double wait_seconds;
+        double max_wait_seconds;
+    };
+
+    explicit worker_pool(int threads = 2, std::size_t max_queued = 64)
+    : m_threads(std::max(1, threads))
+    , m_max_queued(max_queued)
+    , m_stopped(false)
+    , m_peak(0)
+    , m_running(0)
+    , m_completed(0)
+    , m_rejected(0)
+    , m_wait(0)
+    , m_max_wait(0)
+    { }
+
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+
+    ~worker_pool()
+    { stop(); }
+
+    // Takes effect if no job was posted yet.
+    auto configure(int threads, std::size_t max_queued) -> void
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_workers.empty()) {
+            m_threads = std::max(1, threads);
+        }
+        m_max_queued = max_queued;
+    }
+
+    // Queues `work`, or returns false, without running it, if the queue
+    // is full or the pool stopped.
+    auto post(job work) -> bool
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stopped || m_queue.size() >= m_max_queued) {
+                ++m_rejected;
+                return false;
+            }
+            if (m_workers.empty()) {
+                for (auto i = 0; i < m_threads; ++i) {
+                    m_workers.emplace_back(&worker_pool::work, this);
+                }
+            }
+            m_queue.emplace_back(std::move(work), clock::now());
+            m_peak = std::max(m_peak, m_queue.size());
+        }
+        m_ready.notify_one();
+        return true;
+    }
+
+    // Waits for the running jobs and drops the queued ones.
+    auto stop() -> void
+    {
+        std::vector<std::thread> workers;
+        std::deque<entry> dropped;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopped = true;
+            workers.swap(m_workers);
+            dropped.swap(m_queue);
+        }
+        m_ready.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    auto stats() const -> stats_type
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return stats_type{m_queue.size(), m_peak, m_running, m_completed, m_rejected,
+                          std::chrono::duration<double>(m_wait).count(),
+                          std::chrono::duration<double>(m_max_wait).count()};
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+    using entry = std::pair<job, clock::time_point>;
+
+    auto work() -> void
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_ready.wait(lock, [this]() { return m_stopped || !m_queue.empty(); });
+            if (m_stopped) {
+                return;
+            }
+            auto next = std::move(m_queue.front());
+            m_queue.pop_front();
+            auto const waited = clock::now() - next.second;
+            m_wait += waited;
+            m_max_wait = std::max(m_max_wait, waited);
+            ++m_running;
+            lock.unlock();
+
+            next.first();
+            next.first = nullptr;
+
+            lock.lock();
+            --m_running;
+            ++m_completed;
+        }
+    }
+
+    int m_threads;
+    std::size_t m_max_queued;
+    bool m_stopped;
+    std::deque<entry> m_queue;
+    std::vector<std::thread> m_workers;
+    std::size_t m_peak;
+    std::size_t m_running;
+    std::uint64_t m_completed;
+    std::uint64_t m_rejected;
+    clock::duration m_wait;
+    clock::duration m_max_wait;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_ready;
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_WORKER_POOL_HPP
@@ -0,0 +1,253 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_HTTP_WS_STREAM_HPP
+#define GH_HTTP_WS_STREAM_HPP
+
+#include "gh/frame_channel.hpp"
+#include "gh/http/router.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/core/buffers_to_string.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/websocket/stream.hpp>
+
+namespace gh {
+namespace http {
+
+// Streams frames from a channel over a WebSocket taken from the session,
+// one binary message per frame:
+//
+//     offset  size  content
+//          0     8  sequence number, little endian
+//          8     8  capture time in milliseconds since the epoch, little endian
+//         16     4  flags, bit 0 set for motion, bit 1 for a changed frame
+//         20     -  the JPEG
+//
+// The client acknowledges each frame it is done with by sending its
+// sequence number as a text message, which acknowledges the frames sent
+// before it as well. At most `window` frames are sent without an
+// acknowledgment; while the window is full, newer frames
+// replace the one waiting, so a slow client skips frames instead of
+// buffering them. Frames are written from the shared encoded buffers
+// without copying.
+class ws_stream : public std::enable_shared_from_this<ws_stream>
+{
+public:
+    using Socket = router::Socket;
+
+    ws_stream(Socket&& socket, boost::core::string_view name)
+    : m_ws(std::move(socket))
+    , m_name(name)
+    , m_window(2)
+    , m_counter(nullptr)
+    , m_writing(false)
+    , m_closed(false)
+    { }
+
+    ws_stream(const ws_stream&) = delete;
+    ws_stream& operator=(const ws_stream&) = delete;
+
+    auto set_window(int frames) -> void
+    { m_window = frames > 0 ? frames : 1; }
+
+    // Adds every byte of frames written to `bytes` from then on.
+    auto set_counter(std::atomic<std::uint64_t>& bytes) -> void
+    { m_counter = &bytes; }
+
+    // Completes the upgrade `request` asked for and forwards frames
+    // published to `channel` from then on. The channel and `guard` are
+    // held until the socket is closed.
+    auto start(const router::Request& request, std::shared_ptr<frame_channel> channel,
+               std::shared_ptr<void> guard = nullptr) -> void
+    {
+        namespace beast = boost::beast;
+        namespace websocket = boost::beast::websocket;
+
+        m_guard = std::move(guard);
+        m_channel = std::move(channel);
+
+        // The websocket keeps its own timeouts
+        beast::get_lowest_layer(m_ws).expires_never();
+        m_ws.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        auto const name = m_name;
+        m_ws.set_option(websocket::stream_base::decorator(
+            [name](websocket::response_type& response) {
+                response.set(boost::beast::http::field::server, name);
+            }));
+        m_ws.binary(true);
+        m_ws.async_accept(request,
+            beast::bind_front_handler(
+                &ws_stream::on_accept,
+                shared_from_this()));
+    }
+
+private:
+    auto on_accept(boost::system::error_code ec) -> void
+    {
+        if (ec) {
+            return close();
+        }
+        std::weak_ptr<ws_stream> weak = shared_from_this();
+        m_subscription = m_channel->subscribe(m_ws.get_executor(),
+            [weak](const frame_ptr& f) {
+                auto self = weak.lock();
+                if (self) {
+                    self->on_frame(f);
+                }
+            });
+        do_read();
+
+        auto const f = m_channel->latest();
+        if (f) {
+            on_frame(f);
+        }
+    }
+
+    auto do_read() -> void
+    {
+        m_ws.async_read(m_read,
+            boost::beast::bind_front_handler(
+                &ws_stream::on_read,
+                shared_from_this()));
+    }
+
+    // An acknowledgment opens the window for the frame it names and those
+    // sent before it. Duplicates, stale ones, and anything but a number
+    // of a frame outstanding are ignored.
+    auto on_read(boost::system::error_code ec, std::size_t /*bytes_transferred*/) -> void
+    {
+        if (ec) {
+            return close();
+        }
+        auto const text = boost::beast::buffers_to_string(m_read.data());
+        m_read.consume(m_read.size());
+        char* end = nullptr;
+        auto const seq = std::strtoull(text.c_str(), &end, 10);
+        if (!text.empty() && end == text.c_str() + text.size()) {
+            auto const it = std::find(m_unacked.begin(), m_unacked.end(), seq);
+            if (it != m_unacked.end()) {
+                m_unacked.erase(m_unacked.begin(), it + 1);
+            }
+        }
+        if (m_pending && !m_writing && !full()) {
+            write(std::move(m_pending));
+        }
+        do_read();
+    }
+
+    auto full() const -> bool
+    { return m_unacked.size() >= static_cast<std::size_t>(m_window); }
+
+    auto on_frame(const frame_ptr& f) -> void
+    {
+        // The webcam failed
+        if (!f) {
+            return close();
+        }
+        if (m_closed || f->encoded().size() == 0) {
+            return;
+        }
+        if (m_writing || full()) {
+            m_pending = f;
+            return;
+        }
+        write(f);
+    }
+
+    auto write(frame_ptr f) -> void
+    {
+        m_writing = true;
+        m_unacked.push_back(f->seq);
+        m_inflight = std::move(f);
+
+        auto const ts = std::chrono::duration_cast<std::chrono::milliseconds>(
+            m_inflight->timestamp.time_since_epoch()).count();
+        auto const flags = (m_inflight->motion ? 1u : 0u) | (m_inflight->changed ? 2u : 0u);
+        put(&m_header[0], m_inflight->seq, 8);
+        put(&m_header[8], static_cast<std::uint64_t>(ts), 8);
+        put(&m_header[16], flags, 4);
+
+        std::array<boost::asio::const_buffer, 2> const buffers{{
+            boost::asio::buffer(m_header),
+            m_inflight->encoded()
+        }};
+        m_ws.async_write(buffers,
+            boost::beast::bind_front_handler(
+                &ws_stream::on_write,
+                shared_from_this()));
+    }
+
+    auto on_write(boost::system::error_code ec, std::size_t bytes_transferred) -> void
+    {
+        m_writing = false;
+        m_inflight.reset();
+        if (m_counter) {
+            *m_counter += bytes_transferred;
+        }
+        if (ec) {
+            return close();
+        }
+        if (m_pending && !full()) {
+            write(std::move(m_pending));
+        }
+    }
+
+    auto close() -> void
+    {
+        if (m_closed) {
+            return;
+        }
+        m_closed = true;
+        m_subscription.reset();
+        m_channel.reset();
+        m_pending.reset();
+        m_guard.reset();
+        boost::system::error_code ec;
+        auto& socket = boost::beast::get_lowest_layer(m_ws).socket();
+        socket.shutdown(Socket::shutdown_both, ec);
+        socket.close(ec);
+    }
+
+    static auto put(unsigned char* out, std::uint64_t value, int bytes) -> void
+    {
+        for (auto i = 0; i < bytes; ++i) {
+            out[i] = static_cast<unsigned char>(value >> (8 * i));
+        }
+    }
+
+    boost::beast::websocket::stream<boost::beast::tcp_stream> m_ws;
+    std::string m_name;
+    std::shared_ptr<frame_channel> m_channel;
+    frame_channel::subscription m_subscription;
+    std::shared_ptr<void> m_guard;
+    boost::beast::flat_buffer m_read;
+    frame_ptr m_inflight;
+    frame_ptr m_pending;
+    std::array<unsigned char, 20> m_header;
+    int m_window;
+    // Sequence numbers of the frames sent and not acknowledged yet
+    std::deque<std::uint64_t> m_unacked;
+    std::atomic<std::uint64_t>* m_counter;
+    bool m_writing;
+    bool m_closed;
+};
+
+} // namespace http
+} // namespace gh
+
+#endif // GH_HTTP_WS_STREAM_HPP
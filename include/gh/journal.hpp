@@ -0,0 +1,487 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_JOURNAL_HPP
+#define GH_JOURNAL_HPP
+
+#include "gh/frame_channel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+
+namespace gh {
+
+// Keeps the encoded frames of a channel on disk for replay.
+//
+// Frames are appended to segment files of about `segment_bytes`, each
+// named after the time of its first frame. Next to every segment an index
+// file holds one (timestamp, offset) entry per frame, so finding a point
+// in time is a binary search over the segments and then over one index.
+// Once the journal takes more than `budget` bytes the oldest segments not
+// being read are removed, so how far back it goes depends on the rate
+// frames come in at; budget_for() sizes it for a given rewind. The
+// default keeps an hour of 720p at quality 95 and 30 fps, which comes to
+// about 4.5 MB/s and 16 GB. Idle captures (webcam::set_idle) and smaller
+// frames stretch that.
+//
+// Appending happens on a thread of the journal, never on the capture
+// thread. Readers map the files they read and never take the writer's
+// locks for more than looking up a segment.
+class journal
+{
+public:
+    using clock = std::chrono::system_clock;
+
+    struct stats_type
+    {
+        std::size_t segments;
+        std::uint64_t bytes;
+        std::uint64_t frames;
+    };
+
+private:
+    struct record_header
+    {
+        std::uint64_t seq;
+        std::int64_t timestamp;
+        std::uint32_t size;
+        std::uint32_t flags;
+    };
+
+    struct index_entry
+    {
+        std::int64_t timestamp;
+        std::uint64_t offset;
+    };
+
+    enum : std::uint32_t
+    {
+        flag_motion = 1,
+        flag_changed = 2
+    };
+
+    struct segment
+    {
+        std::int64_t first;
+        std::string base;
+        std::atomic<std::uint64_t> bytes;
+        std::atomic<std::uint64_t> entries;
+
+        auto data_path() const -> std::string
+        { return base + ".dat"; }
+
+        auto index_path() const -> std::string
+        { return base + ".idx"; }
+    };
+
+    using segment_ptr = std::shared_ptr<segment>;
+
+public:
+    // Reads frames in order from some point in time on, following the
+    // journal as it grows.
+    class reader
+    {
+    public:
+        // Next frame, or nullptr if there is none yet. Frames refer to the
+        // mapped segment instead of holding a copy of their bytes.
+        auto next() -> frame_ptr
+        {
+            // The journal was empty when the reader was opened
+            if (!m_segment) {
+                auto first = m_journal->first();
+                if (!first) {
+                    return nullptr;
+                }
+                open(std::move(first), m_from);
+            }
+            while (m_segment) {
+                if (m_position < m_entries || remap()) {
+                    return read(m_position++);
+                }
+                auto next = m_journal->after(m_segment->first);
+                if (!next) {
+                    return nullptr;
+                }
+                // Nothing is appended to a segment once there is a next one,
+                // but the last frames may have come in since we looked
+                if (remap()) {
+                    continue;
+                }
+                open(std::move(next), 0);
+            }
+            return nullptr;
+        }
+
+    private:
+        friend class journal;
+
+        reader(journal* j, segment_ptr s, std::int64_t from)
+        : m_journal(j)
+        , m_from(from)
+        , m_position(0)
+        , m_entries(0)
+        , m_mapped_bytes(0)
+        , m_mapped_entries(0)
+        {
+            if (s) {
+                open(std::move(s), from);
+            }
+        }
+
+        auto open(segment_ptr s, std::int64_t from) -> void
+        {
+            m_segment = std::move(s);
+            m_data.reset();
+            m_index = region{};
+            m_entries = 0;
+            m_mapped_bytes = 0;
+            m_mapped_entries = 0;
+            m_position = 0;
+            remap();
+
+            auto const begin = entries();
+            auto const it = std::lower_bound(begin, begin + m_entries, from,
+                [](const index_entry& e, std::int64_t t) { return e.timestamp < t; });
+            m_position = static_cast<std::uint64_t>(it - begin);
+        }
+
+        // Makes what has been written to the segment so far readable; true
+        // if that is more than before. A reader following the live segment
+        // maps ahead of the writer, so most new frames need no new mapping.
+        auto remap() -> bool
+        {
+            auto const entries = m_segment->entries.load();
+            if (entries <= m_entries) {
+                return false;
+            }
+            auto const bytes = m_segment->bytes.load();
+            using namespace boost::interprocess;
+            try {
+                if (bytes > m_mapped_bytes) {
+                    // A segment ends on the first frame past its size
+                    auto const ahead = std::max<std::uint64_t>(
+                        std::min(2 * m_mapped_bytes, m_journal->m_segment_bytes),
+                        std::uint64_t(1) << 20);
+                    // Frames read from the last mapping keep it alive
+                    m_data = std::make_shared<const mapped_region>(
+                        map(m_segment->data_path(), bytes, std::max(bytes, ahead)));
+                    m_mapped_bytes = m_data->get_size();
+                }
+                if (entries > m_mapped_entries) {
+                    auto const ahead = std::max<std::uint64_t>(2 * m_mapped_entries, 4096);
+                    m_index = region{map(m_segment->index_path(),
+                        entries * sizeof(index_entry),
+                        std::max(entries, ahead) * sizeof(index_entry))};
+                    m_mapped_entries = m_index.map.get_size() / sizeof(index_entry);
+                }
+            } catch (const interprocess_exception&) {
+                return false;
+            }
+            m_entries = entries;
+            return true;
+        }
+
+        // Maps `wanted` bytes of the file if the platform lets a view reach
+        // past its end, the `needed` bytes written so far otherwise.
+        static auto map(const std::string& path, std::uint64_t needed, std::uint64_t wanted)
+            -> boost::interprocess::mapped_region
+        {
+            using namespace boost::interprocess;
+            file_mapping file(path.c_str(), read_only);
+            try {
+                return mapped_region(file, read_only, 0, wanted);
+            } catch (const interprocess_exception&) {
+                return mapped_region(file, read_only, 0, needed);
+            }
+        }
+
+        auto entries() const -> const index_entry*
+        { return static_cast<const index_entry*>(m_index.map.get_address()); }
+
+        auto read(std::uint64_t position) const -> frame_ptr
+        {
+            auto const base = static_cast<const unsigned char*>(m_data->get_address());
+            record_header header;
+            std::memcpy(&header, base + entries()[position].offset, sizeof(header));
+            auto const bytes = base + entries()[position].offset + sizeof(header);
+
+            auto f = std::make_shared<frame>();
+            f->seq = header.seq;
+            f->timestamp = clock::time_point(std::chrono::milliseconds(header.timestamp));
+            f->motion = (header.flags & flag_motion) != 0;
+            f->changed = (header.flags & flag_changed) != 0;
+            f->storage = m_data;
+            f->stored = boost::asio::const_buffer(bytes, header.size);
+            return f;
+        }
+
+        // mapped_region is movable only
+        struct region
+        {
+            boost::interprocess::mapped_region map;
+        };
+
+        journal* m_journal;
+        std::int64_t m_from;
+        segment_ptr m_segment;
+        std::shared_ptr<const boost::interprocess::mapped_region> m_data;
+        region m_index;
+        std::uint64_t m_position;
+        std::uint64_t m_entries;
+        std::uint64_t m_mapped_bytes;
+        std::uint64_t m_mapped_entries;
+    };
+
+    // Bytes that keep `rewind` of frames coming in at `bytes_per_second`
+    static auto budget_for(double bytes_per_second, std::chrono::seconds rewind) -> std::uint64_t
+    { return static_cast<std::uint64_t>(bytes_per_second * rewind.count()); }
+
+    journal(std::string directory,
+            std::uint64_t budget = budget_for(4.5e6, std::chrono::hours(1)),
+            std::uint64_t segment_bytes = 64ull << 20)
+    : m_directory(std::move(directory))
+    , m_budget(budget)
+    , m_segment_bytes(segment_bytes)
+    , m_pool(2)
+    , m_strand(m_pool.get_executor())
+    , m_data(nullptr)
+    , m_index(nullptr)
+    , m_last(0)
+    , m_frames(0)
+    {
+        cv::utils::fs::createDirectories(m_directory);
+        load();
+    }
+
+    journal(const journal&) = delete;
+    journal& operator=(const journal&) = delete;
+
+    ~journal()
+    {
+        m_subscription.reset();
+        m_pool.stop();
+        m_pool.join();
+        close();
+    }
+
+    // Appends every frame published to `channel` from now on.
+    auto start(std::shared_ptr<frame_channel> channel) -> void
+    {
+        m_subscription = channel->subscribe(m_strand, [this](const frame_ptr& f) {
+            // Null when the webcam failed, the next one continues
+            if (f) {
+                append(*f);
+            }
+        });
+        m_channel = std::move(channel);
+    }
+
+    // Readers and replays run their own work here, off the I/O threads.
+    auto get_executor() -> boost::asio::thread_pool::executor_type
+    { return m_pool.get_executor(); }
+
+    // Reader starting at the first frame captured at `from` or later.
+    auto open(clock::time_point from) -> reader
+    {
+        auto const t = to_ms(from);
+        segment_ptr s;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = std::upper_bound(m_segments.begin(), m_segments.end(), t,
+                [](std::int64_t t, const segment_ptr& s) { return t < s->first; });
+            if (it != m_segments.begin()) {
+                --it;
+            }
+            if (it != m_segments.end()) {
+                s = *it;
+            }
+        }
+        return reader{this, std::move(s), t};
+    }
+
+    auto stats() const -> stats_type
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats_type s{m_segments.size(), 0, m_frames.load()};
+        for (auto const& seg : m_segments) {
+            s.bytes += seg->bytes + seg->entries * sizeof(index_entry);
+        }
+        return s;
+    }
+
+    // Runs on the strand.
+    auto append(const frame& f) -> void
+    {
+        if (!f.jpeg || f.jpeg->empty()) {
+            return;
+        }
+        // The index must stay sorted even if the clock steps back
+        auto const t = std::max(to_ms(f.timestamp), m_last);
+        m_last = t;
+
+        if (!m_current || m_current->bytes >= m_segment_bytes) {
+            if (!roll(t)) {
+                return;
+            }
+        }
+
+        record_header header{f.seq, t, static_cast<std::uint32_t>(f.jpeg->size()),
+            (f.motion ? flag_motion : 0u) | (f.changed ? flag_changed : 0u)};
+        index_entry entry{t, m_current->bytes};
+        if (std::fwrite(&header, sizeof(header), 1, m_data) != 1 ||
+                std::fwrite(f.jpeg->data(), f.jpeg->size(), 1, m_data) != 1 ||
+                std::fflush(m_data) != 0) {
+            return close();
+        }
+        // The frame is in place before the index points readers to it
+        if (std::fwrite(&entry, sizeof(entry), 1, m_index) != 1 ||
+                std::fflush(m_index) != 0) {
+            return close();
+        }
+        m_current->bytes += sizeof(header) + f.jpeg->size();
+        ++m_current->entries;
+        ++m_frames;
+    }
+
+private:
+    static auto to_ms(clock::time_point t) -> std::int64_t
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            t.time_since_epoch()).count();
+    }
+
+    static auto file_size(const std::string& path) -> std::uint64_t
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        return in ? static_cast<std::uint64_t>(in.tellg()) : 0;
+    }
+
+    // Picks up the segments left by a previous run. They are complete as
+    // far as their index goes and are never appended to again.
+    auto load() -> void
+    {
+        std::vector<cv::String> files;
+        cv::glob(m_directory + "/*.idx", files, false);
+        for (auto const& file : files) {
+            auto s = std::make_shared<segment>();
+            s->base = file.substr(0, file.size() - 4);
+            auto const name = s->base.substr(s->base.find_last_of("/\\") + 1);
+            s->first = std::strtoll(name.c_str(), nullptr, 10);
+            s->entries = file_size(s->index_path()) / sizeof(index_entry);
+            s->bytes = file_size(s->data_path());
+            if (s->entries > 0) {
+                m_last = std::max(m_last, s->first);
+                m_segments.push_back(std::move(s));
+            }
+        }
+        std::sort(m_segments.begin(), m_segments.end(),
+            [](const segment_ptr& a, const segment_ptr& b) { return a->first < b->first; });
+    }
+
+    auto roll(std::int64_t t) -> bool
+    {
+        close();
+        auto s = std::make_shared<segment>();
+        s->first = t;
+        s->base = m_directory + "/" + std::to_string(t);
+        s->bytes = 0;
+        s->entries = 0;
+        m_data = std::fopen(s->data_path().c_str(), "wb");
+        m_index = std::fopen(s->index_path().c_str(), "wb");
+        if (!m_data || !m_index) {
+            close();
+            return false;
+        }
+        m_current = s;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_segments.push_back(std::move(s));
+        trim();
+        return true;
+    }
+
+    // Drops the oldest segments beyond the budget, unless being read.
+    auto trim() -> void
+    {
+        std::uint64_t total = 0;
+        for (auto const& s : m_segments) {
+            total += s->bytes + s->entries * sizeof(index_entry);
+        }
+        while (total > m_budget && m_segments.size() > 1 &&
+                m_segments.front().use_count() == 1) {
+            auto const& s = m_segments.front();
+            total -= s->bytes + s->entries * sizeof(index_entry);
+            std::remove(s->data_path().c_str());
+            std::remove(s->index_path().c_str());
+            m_segments.pop_front();
+        }
+    }
+
+    auto close() -> void
+    {
+        if (m_data) {
+            std::fclose(m_data);
+            m_data = nullptr;
+        }
+        if (m_index) {
+            std::fclose(m_index);
+            m_index = nullptr;
+        }
+        m_current.reset();
+    }
+
+    // The oldest segment, if any.
+    auto first() const -> segment_ptr
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_segments.empty() ? nullptr : m_segments.front();
+    }
+
+    // The segment following the one starting at `first`, if any.
+    auto after(std::int64_t first) const -> segment_ptr
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::upper_bound(m_segments.begin(), m_segments.end(), first,
+            [](std::int64_t t, const segment_ptr& s) { return t < s->first; });
+        return it != m_segments.end() ? *it : nullptr;
+    }
+
+    std::string m_directory;
+    std::uint64_t m_budget;
+    std::uint64_t m_segment_bytes;
+    boost::asio::thread_pool m_pool;
+    boost::asio::strand<boost::asio::thread_pool::executor_type> m_strand;
+    std::shared_ptr<frame_channel> m_channel;
+    frame_channel::subscription m_subscription;
+    std::deque<segment_ptr> m_segments;
+    segment_ptr m_current;
+    std::FILE* m_data;
+    std::FILE* m_index;
+    std::int64_t m_last;
+    std::atomic<std::uint64_t> m_frames;
+    mutable std::mutex m_mutex;
+};
+
+} // namespace gh
+
+#endif // GH_JOURNAL_HPP
@@ -0,0 +1,94 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_LEASE_HOLDER_HPP
+#define GH_LEASE_HOLDER_HPP
+
+#include "gh/resource_manager.hpp"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace gh {
+
+// Holds a single lease on behalf of clients that come and go instead of
+// staying connected, such as pollers. Every touch() keeps the resource
+// for another `idle` interval, so a client coming back in time finds it
+// still open, and all of them together take one lease from the manager.
+template<class T>
+class lease_holder
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using lease = typename resource_manager<T>::lease;
+
+    lease_holder(resource_manager<T>& manager, clock::duration idle)
+    : m_manager(manager)
+    , m_idle(idle)
+    , m_armed(false)
+    { }
+
+    lease_holder(const lease_holder&) = delete;
+    lease_holder& operator=(const lease_holder&) = delete;
+
+    // Makes or reuses the resource with `args` and keeps it for the idle
+    // interval from now, timed on `executor`. False if the manager has no
+    // lease left to give. A resource that failed is given back for a new
+    // one.
+    template<class... Args>
+    auto touch(const boost::asio::any_io_executor& executor, Args&&... args) -> bool
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_lease && m_manager.failed(*m_lease)) {
+            m_lease.reset();
+        }
+        if (!m_lease) {
+            m_lease = m_manager.make_or_reuse(std::forward<Args>(args)...);
+            if (!m_lease) {
+                return false;
+            }
+        }
+        m_until = clock::now() + m_idle;
+        if (!m_armed) {
+            arm(executor, m_until);
+        }
+        return true;
+    }
+
+private:
+    // At most one timer is pending. When it fires early because the lease
+    // was touched again, it waits for the rest.
+    auto arm(const boost::asio::any_io_executor& executor, clock::time_point at) -> void
+    {
+        m_armed = true;
+        auto timer = std::make_shared<boost::asio::steady_timer>(executor, at);
+        timer->async_wait([this, timer](boost::system::error_code ec) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_armed = false;
+            if (ec) {
+                return;
+            }
+            if (clock::now() < m_until) {
+                return arm(timer->get_executor(), m_until);
+            }
+            m_lease.reset();
+        });
+    }
+
+    resource_manager<T>& m_manager;
+    clock::duration m_idle;
+    lease m_lease;
+    clock::time_point m_until;
+    bool m_armed;
+    std::mutex m_mutex;
+};
+
+} // namespace gh
+
+#endif // GH_LEASE_HOLDER_HPP
@@ -5,8 +5,15 @@
 #ifndef GH_MOTION_DETECTOR_HPP
 #define GH_MOTION_DETECTOR_HPP
 
+#include "privacy_mask.hpp"
 #include "webcam.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
@@ -17,45 +24,98 @@ class motion_detector : public webcam_extension
 {
 public:
     motion_detector()
-    : m_blur_ksize(cv::Size(4, 4))
+    : m_area(0)
+    , m_blur_ksize(cv::Size(4, 4))
+    , m_mask(nullptr)
     , m_mark(false)
     , m_debug(false)
+    , m_fused(false)
+    , m_avg_stale(false)
     { }
 
     motion_detector(cv::InputArray frame)
-    : m_blur_ksize(cv::Size(4, 4))
+    : m_area(0)
+    , m_blur_ksize(cv::Size(4, 4))
+    , m_mask(nullptr)
     , m_mark(false)
     , m_debug(false)
+    , m_fused(false)
+    , m_avg_stale(false)
     { init(frame); }
 
     motion_detector(const motion_detector&) = delete;
     motion_detector& operator=(const motion_detector&) = delete;
 
     auto init(cv::InputArray frame) -> void override{
-        cv::blur(frame, m_avg, m_blur_ksize);
+        auto const image = frame.getMat();
+        cv::blur(image(region(image.size())), m_avg, m_blur_ksize);
         m_avg.convertTo(m_avg_float, CV_32F);
+        m_avg_stale = false;
     }
 
+    // Leaves out what `mask` blacks out: only the part of the frame it
+    // keeps is looked at, and nothing it masks counts as motion. The mask
+    // must be installed before the detector.
+    auto ignore(const privacy_mask& mask) -> void
+    { m_mask = &mask; }
+
     auto mark() -> void
     { m_mark = true; }
 
     auto debug() -> void
     { m_debug = true; }
 
+    // Finds what moved in a single pass over the frame, split across the
+    // cores, instead of one OpenCV call after another each going over all
+    // of it (see fused_pass()). Its decisions match those of the default
+    // mode but for pixels within rounding of the threshold; bench/
+    // motion_bench measures how closely. The modes share the running
+    // average, so either may be switched to between frames.
+    auto fuse(bool fused = true) -> void
+    { m_fused = fused; }
+
     auto update(cv::InputOutputArray frame) -> bool override
     {
-        // Source: https://blog.gtwang.org/programming/opencv-motion-detection-and-tracking-tutorial/
-        cv::Mat blur;
-        cv::blur(frame, blur, m_blur_ksize);
+        auto image = frame.getMat();
+        auto const roi = region(image.size());
+        if (roi.size() != m_avg_float.size() || image.channels() != m_avg_float.channels()) {
+            init(image);
+        }
+        auto view = image(roi);
+
+        cv::Mat thresh;
+        if (m_fused) {
+            fused_pass(view, thresh);
+            m_avg_stale = true;
+        } else {
+            if (m_avg_stale) {
+                // Only the float average was kept up by the fused mode
+                cv::convertScaleAbs(m_avg_float, m_avg);
+                m_avg_stale = false;
+            }
+            // Source: https://blog.gtwang.org/programming/opencv-motion-detection-and-tracking-tutorial/
+            cv::Mat blur;
+            cv::blur(view, blur, m_blur_ksize);
 
-        cv::Mat diff;
-        cv::absdiff(m_avg, blur, diff);
+            cv::Mat diff;
+            cv::absdiff(m_avg, blur, diff);
 
-        cv::Mat gray;
-        cv::cvtColor(diff, gray, cv::COLOR_BGR2GRAY);
+            // YUV captures hand over the luma plane, which is gray already
+            cv::Mat gray;
+            if (diff.channels() == 1) {
+                gray = diff;
+            } else {
+                cv::cvtColor(diff, gray, cv::COLOR_BGR2GRAY);
+            }
+            cv::threshold(gray, thresh, threshold, 255, cv::THRESH_BINARY);
 
-        cv::Mat thresh;
-        cv::threshold(gray, thresh, 25, 255, cv::THRESH_BINARY);
+            cv::accumulateWeighted(blur, m_avg_float, alpha);
+            cv::convertScaleAbs(m_avg_float, m_avg);
+        }
+        if (m_mask && m_mask->keep().size() == image.size()) {
+            // The blur smears frame content across the mask's edges
+            cv::bitwise_and(thresh, m_mask->keep()(roi), thresh);
+        }
 
         cv::Mat kernel = cv::getStructuringElement(0, cv::Size(5, 5));
         cv::morphologyEx(thresh, thresh, cv::MORPH_OPEN, kernel, cv::Point(-1, -1), 2);
@@ -65,33 +125,174 @@ public:
         std::vector<std::vector<cv::Point>> contours;
         cv::findContours(thresh.clone(), contours, hierarchy, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
         bool detected = false;
+        m_boxes.clear();
+        m_area = 0;
         for (auto& c : contours) {
             // Ignore small area
-            if (cv::contourArea(c) < 2500) {
+            auto const area = cv::contourArea(c);
+            if (area < 2500) {
                 continue;
             }
             detected = true;
+            cv::Rect rec = cv::boundingRect(c) + roi.tl();
+            m_boxes.push_back(rec);
+            m_area += area;
             if (m_mark) {
-                cv::Rect rec = cv::boundingRect(c);
-                cv::rectangle(frame, rec, cv::Scalar(0, 255, 0), 2);
+                cv::rectangle(image, rec, cv::Scalar(0, 255, 0), 2);
             }
         }
 
         if (m_debug) {
-            cv::drawContours(frame, contours, -1, cv::Scalar(0, 255, 255), 2);
+            cv::drawContours(view, contours, -1, cv::Scalar(0, 255, 255), 2);
         }
-
-        cv::accumulateWeighted(blur, m_avg_float, 0.01);
-        cv::convertScaleAbs(m_avg_float, m_avg);
         return detected;
     }
 
+    // Bounding boxes of what moved in the last frame, on the thread
+    // calling update().
+    auto detections() const -> const std::vector<cv::Rect>&
+    { return m_boxes; }
+
+    // Total area of what moved in the last frame, in pixels.
+    auto area() const -> double
+    { return m_area; }
+
 private:
+    // Gray level a pixel must differ from the running average by, and
+    // the weight of each frame in that average
+    static constexpr int threshold = 25;
+    static constexpr float alpha = 0.01f;
+
+    // What cv::blur does at the edges (BORDER_REFLECT_101)
+    static auto reflect(int i, int n) -> int
+    {
+        if (n == 1) {
+            return 0;
+        }
+        i = i < 0 ? -i : i;
+        return i < n ? i : 2 * n - 2 - i;
+    }
+
+    // The default mode's blur, absdiff, cvtColor, threshold,
+    // accumulateWeighted and convertScaleAbs, done row by row while the
+    // row is in cache: the 4x4 box sums, the difference from the running
+    // average, which is updated in the same go, and the gray level of that
+    // difference against the threshold. Only the frame, the float average
+    // and the thresholded mask are touched, once each. Bands of rows run
+    // on OpenCV's threads, the inner loops on its universal intrinsics.
+    //
+    // The difference is taken in floats, not between the blurred frame
+    // and the average rounded to bytes, which is where the two modes may
+    // disagree near the threshold.
+    auto fused_pass(const cv::Mat& view, cv::Mat& thresh) -> void
+    {
+        thresh.create(view.size(), CV_8UC1);
+        auto const rows = view.rows;
+        auto const cols = view.cols;
+        auto const cn = view.channels();
+        auto const n = cols * cn;
+        cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& band) {
+            // Column sums with two pixels of border on the left and one on
+            // the right, as the kernel spans x - 2 to x + 1
+            static thread_local std::vector<std::uint16_t> sums;
+            static thread_local std::vector<float> blur;
+            static thread_local std::vector<float> diff;
+            sums.resize(n + 3 * cn);
+            blur.resize(n);
+            diff.resize(n);
+            auto const s = sums.data() + 2 * cn;
+            for (auto y = band.start; y < band.end; ++y) {
+                const unsigned char* src[4];
+                for (auto k = 0; k < 4; ++k) {
+                    src[k] = view.ptr<unsigned char>(reflect(y - 2 + k, rows));
+                }
+                column_sums(src, s, n);
+                for (auto c = 0; c < cn; ++c) {
+                    s[c - 2 * cn] = s[reflect(-2, cols) * cn + c];
+                    s[c - cn] = s[reflect(-1, cols) * cn + c];
+                    s[n + c] = s[reflect(cols, cols) * cn + c];
+                }
+                for (auto j = 0; j < n; ++j) {
+                    blur[j] = (s[j - 2 * cn] + s[j - cn] + s[j] + s[j + cn]) * (1.0f / 16);
+                }
+                running_average(blur.data(), m_avg_float.ptr<float>(y), diff.data(), n);
+
+                auto const t = thresh.ptr<unsigned char>(y);
+                if (cn == 1) {
+                    for (auto x = 0; x < cols; ++x) {
+                        t[x] = diff[x] > threshold ? 255 : 0;
+                    }
+                } else {
+                    for (auto x = 0; x < cols; ++x) {
+                        auto const d = &diff[x * cn];
+                        auto const gray = 0.114f * d[0] + 0.587f * d[1] + 0.299f * d[2];
+                        t[x] = gray > threshold ? 255 : 0;
+                    }
+                }
+            }
+        }, std::max(1, rows / 32));
+    }
+
+    static auto column_sums(const unsigned char* const* src, std::uint16_t* sums, int n) -> void
+    {
+        auto j = 0;
+#if CV_SIMD128
+        for (; j + 16 <= n; j += 16) {
+            cv::v_uint16x8 lo, hi, next_lo, next_hi;
+            cv::v_expand(cv::v_load(src[0] + j), lo, hi);
+            for (auto k = 1; k < 4; ++k) {
+                cv::v_expand(cv::v_load(src[k] + j), next_lo, next_hi);
+                lo = lo + next_lo;
+                hi = hi + next_hi;
+            }
+            cv::v_store(sums + j, lo);
+            cv::v_store(sums + j + 8, hi);
+        }
+#endif
+        for (; j < n; ++j) {
+            sums[j] = static_cast<std::uint16_t>(src[0][j] + src[1][j] + src[2][j] + src[3][j]);
+        }
+    }
+
+    // diff = |average - blur|, then average += alpha * (blur - average)
+    static auto running_average(const float* blur, float* average, float* diff, int n) -> void
+    {
+        auto j = 0;
+#if CV_SIMD128
+        auto const a = cv::v_setall_f32(alpha);
+        for (; j + 4 <= n; j += 4) {
+            auto const b = cv::v_load(blur + j);
+            auto const m = cv::v_load(average + j);
+            cv::v_store(diff + j, cv::v_abs(m - b));
+            cv::v_store(average + j, cv::v_muladd(b - m, a, m));
+        }
+#endif
+        for (; j < n; ++j) {
+            diff[j] = std::abs(average[j] - blur[j]);
+            average[j] += alpha * (blur[j] - average[j]);
+        }
+    }
+
+    auto region(cv::Size size) const -> cv::Rect
+    {
+        if (m_mask && m_mask->keep().size() == size && m_mask->region().area() > 0) {
+            return m_mask->region();
+        }
+        return cv::Rect(cv::Point(0, 0), size);
+    }
+
+    std::vector<cv::Rect> m_boxes;
+    double m_area;
+    // The running average rounded to bytes, which the fused mode leaves
+    // behind (see m_avg_stale), and the float one it is rounded from
     cv::Mat m_avg;
     cv::Mat m_avg_float;
     cv::Size m_blur_ksize;
+    const privacy_mask* m_mask;
     bool m_mark;
     bool m_debug;
+    bool m_fused;
+    bool m_avg_stale;
 };
 
 } // namespace gh
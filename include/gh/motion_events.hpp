@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_MOTION_EVENTS_HPP
+#define GH_MOTION_EVENTS_HPP
+
+#include "gh/channel.hpp"
+#include "gh/motion_detector.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace gh {
+
+struct motion_event
+{
+    // False for the first frame without motion after some
+    bool motion;
+    std::uint64_t seq;
+    std::chrono::system_clock::time_point timestamp;
+    double area;
+    std::vector<cv::Rect> boxes;
+
+    auto to_json() const -> std::string
+    {
+        std::ostringstream out;
+        out << "{\"motion\":" << (motion ? "true" : "false")
+            << ",\"seq\":" << seq
+            << ",\"timestamp\":" << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   timestamp.time_since_epoch()).count()
+            << ",\"area\":" << area
+            << ",\"boxes\":[";
+        for (std::size_t i = 0; i < boxes.size(); ++i) {
+            auto const& b = boxes[i];
+            out << (i ? "," : "") << '[' << b.x << ',' << b.y << ','
+                << b.width << ',' << b.height << ']';
+        }
+        out << "]}";
+        return out.str();
+    }
+};
+
+using motion_event_ptr = std::shared_ptr<const motion_event>;
+using event_channel = channel<motion_event_ptr>;
+
+// Turns what a motion detector found into events, one for every frame
+// with motion and one when it stops. Install it on the webcam after the
+// detector; it runs on the capture thread right after the detector looked
+// at the same frame. A null event means the webcam failed.
+class motion_events : public frame_sink
+{
+public:
+    explicit motion_events(const motion_detector& detector)
+    : m_detector(detector)
+    , m_channel(std::make_shared<event_channel>())
+    , m_moving(false)
+    { }
+
+    motion_events(const motion_events&) = delete;
+    motion_events& operator=(const motion_events&) = delete;
+
+    auto channel() const -> const std::shared_ptr<event_channel>&
+    { return m_channel; }
+
+    auto publish(const frame_ptr& f) -> void override
+    {
+        if (!f->motion && !m_moving) {
+            return;
+        }
+        m_moving = f->motion;
+
+        auto e = std::make_shared<motion_event>();
+        e->motion = f->motion;
+        e->seq = f->seq;
+        e->timestamp = f->timestamp;
+        if (f->motion) {
+            e->area = m_detector.area();
+            e->boxes = m_detector.detections();
+        } else {
+            e->area = 0;
+        }
+        m_channel->publish(e);
+    }
+
+    auto end() -> void override
+    {
+        m_moving = false;
+        m_channel->publish(nullptr);
+    }
+
+private:
+    const motion_detector& m_detector;
+    std::shared_ptr<event_channel> m_channel;
+    bool m_moving;
+};
+
+} // namespace gh
+
+#endif // GH_MOTION_EVENTS_HPP
@@ -0,0 +1,170 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_OVERLAY_HPP
+#define GH_OVERLAY_HPP
+
+#include "gh/webcam.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <string>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace gh {
+
+// Burns a label and the wall-clock time into the bottom left corner of
+// every frame.
+//
+// Glyphs are rendered with putText once, into an atlas of equally wide
+// cells, when the capture size is known. The text line is kept as a small
+// image of its own; per frame only the cells whose character changed are
+// copied in from the atlas, which is usually the last digit or two of the
+// time, and the line is then copied into the frame.
+class overlay : public webcam_extension
+{
+public:
+    explicit overlay(std::string label)
+    : m_label(std::move(label))
+    , m_cell(0, 0)
+    { m_index.fill(-1); }
+
+    overlay(const overlay&) = delete;
+    overlay& operator=(const overlay&) = delete;
+
+    auto init(cv::InputArray frame) -> void override
+    {
+        build(frame.size(), frame.type());
+    }
+
+    auto update(cv::InputOutputArray frame) -> bool override
+    {
+        if (frame.size() != m_size || frame.type() != m_atlas.type()) {
+            build(frame.size(), frame.type());
+        }
+        render(text(std::chrono::system_clock::now()));
+
+        auto image = frame.getMat();
+        auto const r = line_rect();
+        if (r.area() > 0) {
+            m_line(cv::Rect(0, 0, r.width, r.height)).copyTo(image(r));
+        }
+        return false;
+    }
+
+    // Keeps the line white on black in YUV captures
+    auto update_chroma(cv::InputOutputArray chroma) -> void override
+    {
+        auto planes = chroma.getMat();
+        auto const half = planes.cols / 2;
+        auto const r = line_rect();
+        auto const x = r.x / 2;
+        auto const c = cv::Rect(x, r.y, (r.x + r.width + 1) / 2 - x, r.height) &
+                       cv::Rect(0, 0, half, planes.rows);
+        if (c.area() > 0) {
+            planes(c).setTo(cv::Scalar::all(128));
+            planes(c + cv::Point(half, 0)).setTo(cv::Scalar::all(128));
+        }
+    }
+
+    // The line drawn at time `t`.
+    auto text(std::chrono::system_clock::time_point t) const -> std::string
+    {
+        auto const seconds = std::chrono::system_clock::to_time_t(t);
+        std::tm tm;
+#ifdef _WIN32
+        localtime_s(&tm, &seconds);
+#else
+        localtime_r(&seconds, &tm);
+#endif
+        char buffer[32];
+        auto const n = std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &tm);
+        return m_label.empty() ? std::string(buffer, n) : m_label + "  " + std::string(buffer, n);
+    }
+
+private:
+    static auto charset(const std::string& label) -> std::string
+    {
+        std::string s = " 0123456789-:" + label;
+        std::sort(s.begin(), s.end());
+        s.erase(std::unique(s.begin(), s.end()), s.end());
+        return s;
+    }
+
+    auto build(cv::Size size, int type) -> void
+    {
+        m_size = size;
+        m_text.clear();
+        m_index.fill(-1);
+
+        // About 1/30 of the frame height per line
+        auto const face = cv::FONT_HERSHEY_SIMPLEX;
+        auto const scale = std::max(0.4, size.height / 30.0 / 22.0);
+        auto const thickness = std::max(1, cvRound(scale * 2));
+        auto const chars = charset(m_label);
+
+        int baseline = 0;
+        cv::Size cell(0, 0);
+        for (auto c : chars) {
+            auto const s = cv::getTextSize(std::string(1, c), face, scale, thickness, &baseline);
+            cell.width = std::max(cell.width, s.width);
+            cell.height = std::max(cell.height, s.height + baseline);
+        }
+        cell.width += thickness * 2;
+        cell.height += thickness * 2;
+        m_cell = cell;
+
+        m_atlas.create(cell.height, cell.width * static_cast<int>(chars.size()), type);
+        m_atlas.setTo(cv::Scalar::all(0));
+        for (std::size_t i = 0; i < chars.size(); ++i) {
+            auto const c = static_cast<unsigned char>(chars[i]);
+            m_index[c] = static_cast<int>(i);
+            cv::putText(m_atlas, std::string(1, chars[i]),
+                cv::Point(static_cast<int>(i) * cell.width + thickness, cell.height - baseline - thickness),
+                face, scale, cv::Scalar::all(255), thickness, cv::LINE_AA);
+        }
+        m_line.release();
+    }
+
+    auto line_rect() const -> cv::Rect
+    {
+        auto const margin = m_cell.height / 2;
+        return cv::Rect(margin, m_size.height - margin - m_line.rows, m_line.cols, m_line.rows) &
+               cv::Rect(cv::Point(0, 0), m_size);
+    }
+
+    auto render(const std::string& text) -> void
+    {
+        if (m_line.cols != static_cast<int>(text.size()) * m_cell.width) {
+            m_line.create(m_cell.height, static_cast<int>(text.size()) * m_cell.width, m_atlas.type());
+            m_text.assign(text.size(), '\0');
+        }
+        for (std::size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == m_text[i]) {
+                continue;
+            }
+            auto const at = m_index[static_cast<unsigned char>(text[i])];
+            auto const source = at < 0 ? m_index[' '] : at;
+            m_atlas(cv::Rect(source * m_cell.width, 0, m_cell.width, m_cell.height)).copyTo(
+                m_line(cv::Rect(static_cast<int>(i) * m_cell.width, 0, m_cell.width, m_cell.height)));
+            m_text[i] = text[i];
+        }
+    }
+
+    std::string m_label;
+    cv::Size m_size;
+    cv::Size m_cell;
+    cv::Mat m_atlas;
+    std::array<int, 256> m_index;
+    cv::Mat m_line;
+    std::string m_text;
+};
+
+} // namespace gh
+
+#endif // GH_OVERLAY_HPP
@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_PRIVACY_MASK_HPP
+#define GH_PRIVACY_MASK_HPP
+
+#include "gh/webcam.hpp"
+
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace gh {
+
+// Blacks out polygons of every captured frame, before anything else sees
+// it, change detection included. Install it first, ahead of the other
+// extensions.
+//
+// Polygons are given in coordinates relative to the frame, from 0 to 1,
+// and rasterized once into a mask at the capture resolution. Each frame
+// then only costs a vectorized bitwise AND over the bounding rectangles of
+// the polygons; the rest of the image is not touched.
+class privacy_mask : public webcam_extension
+{
+public:
+    using polygon = std::vector<cv::Point2f>;
+
+    explicit privacy_mask(std::vector<polygon> polygons)
+    : m_polygons(std::move(polygons))
+    { }
+
+    privacy_mask(const privacy_mask&) = delete;
+    privacy_mask& operator=(const privacy_mask&) = delete;
+
+    auto init(cv::InputArray frame) -> void override
+    {
+        rasterize(frame.size(), frame.type());
+    }
+
+    auto preprocess() const -> bool override
+    { return true; }
+
+    auto update(cv::InputOutputArray frame) -> bool override
+    {
+        if (frame.size() != m_keep.size() || frame.type() != m_keep_image.type()) {
+            rasterize(frame.size(), frame.type());
+        }
+        auto image = frame.getMat();
+        for (auto const& r : m_rects) {
+            auto roi = image(r);
+            cv::bitwise_and(roi, m_keep_image(r), roi);
+        }
+        return false;
+    }
+
+    // Greys out the masked parts of the chroma planes, which are half as
+    // wide as the image.
+    auto update_chroma(cv::InputOutputArray chroma) -> void override
+    {
+        auto planes = chroma.getMat();
+        auto const half = planes.cols / 2;
+        if (m_masked_chroma.rows != planes.rows || m_masked_chroma.cols != half) {
+            if (m_keep.size() != cv::Size(2 * half, planes.rows)) {
+                return;
+            }
+            cv::resize(m_keep, m_masked_chroma, cv::Size(half, planes.rows), 0, 0, cv::INTER_NEAREST);
+            cv::bitwise_not(m_masked_chroma, m_masked_chroma);
+        }
+        for (auto const& r : m_rects) {
+            auto const x = r.x / 2;
+            auto const c = cv::Rect(x, r.y, (r.x + r.width + 1) / 2 - x, r.height) &
+                           cv::Rect(0, 0, half, planes.rows);
+            for (auto offset : {0, half}) {
+                planes(c + cv::Point(offset, 0)).setTo(cv::Scalar::all(128), m_masked_chroma(c));
+            }
+        }
+    }
+
+    // 255 where the image is kept, 0 where it is masked.
+    auto keep() const -> const cv::Mat&
+    { return m_keep; }
+
+    // Smallest rectangle holding every pixel that is kept.
+    auto region() const -> const cv::Rect&
+    { return m_region; }
+
+private:
+    auto rasterize(cv::Size size, int type) -> void
+    {
+        m_keep.create(size, CV_8UC1);
+        m_keep.setTo(cv::Scalar::all(255));
+        m_rects.clear();
+
+        auto const frame = cv::Rect(cv::Point(0, 0), size);
+        std::vector<std::vector<cv::Point>> points;
+        for (auto const& p : m_polygons) {
+            std::vector<cv::Point> v;
+            for (auto const& q : p) {
+                v.push_back(cv::Point(cvRound(q.x * size.width), cvRound(q.y * size.height)));
+            }
+            auto const r = cv::boundingRect(v) & frame;
+            if (r.area() > 0) {
+                points.push_back(std::move(v));
+                m_rects.push_back(r);
+            }
+        }
+        if (!points.empty()) {
+            cv::fillPoly(m_keep, points, cv::Scalar::all(0));
+        }
+
+        // Same layout as the frame, so the AND runs over plain bytes
+        std::vector<cv::Mat> planes(CV_MAT_CN(type), m_keep);
+        cv::merge(planes, m_keep_image);
+
+        m_masked_chroma.release();
+
+        m_region = frame.area() > 0 && cv::countNonZero(m_keep) > 0
+            ? cv::boundingRect(m_keep) : cv::Rect();
+    }
+
+    std::vector<polygon> m_polygons;
+    std::vector<cv::Rect> m_rects;
+    cv::Mat m_keep;
+    cv::Mat m_keep_image;
+    // 255 where masked, at the width of a chroma plane
+    cv::Mat m_masked_chroma;
+    cv::Rect m_region;
+};
+
+} // namespace gh
+
+#endif // GH_PRIVACY_MASK_HPP
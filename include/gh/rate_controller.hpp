@@ -0,0 +1,100 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_RATE_CONTROLLER_HPP
+#define GH_RATE_CONTROLLER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace gh {
+
+// Chooses a rung of a quality ladder (0 being the cheapest) for one
+// client from how fast its writes complete.
+//
+// Every completed write gives a throughput sample, smoothed into an
+// estimate. The controller steps down as soon as the estimate has been
+// short of what the current rung needs at the target frame rate for a few
+// frames in a row, and steps up only after the next rung would have fit
+// with a safety margin for a while. The asymmetry keeps a client from
+// flapping between two rungs.
+class rate_controller
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    rate_controller(std::size_t rungs, std::size_t rung, int target_fps)
+    : m_sizes(rungs, 0.0)
+    , m_rung(rung < rungs ? rung : rungs - 1)
+    , m_target_fps(target_fps > 0 ? target_fps : 1)
+    , m_throughput(0)
+    , m_short(0)
+    , m_last_switch(clock::now())
+    , m_down_after(3)
+    , m_up_hold(std::chrono::seconds(5))
+    , m_up_margin(1.5)
+    { }
+
+    auto rung() const -> std::size_t
+    { return m_rung; }
+
+    // Bytes per second the client is estimated to take.
+    auto throughput() const -> double
+    { return m_throughput; }
+
+    // Records a write of `bytes` from the current rung that took `took`
+    // and returns the rung to use from now on.
+    auto on_write(std::size_t bytes, clock::duration took) -> std::size_t
+    {
+        auto const seconds = std::max(
+            std::chrono::duration<double>(took).count(), 1e-4);
+        auto const sample = bytes / seconds;
+        m_throughput = m_throughput == 0 ? sample : 0.7 * m_throughput + 0.3 * sample;
+
+        auto& size = m_sizes[m_rung];
+        size = size == 0 ? bytes : 0.8 * size + 0.2 * bytes;
+
+        auto const now = clock::now();
+        if (m_throughput < size * m_target_fps) {
+            if (++m_short >= m_down_after && m_rung > 0) {
+                switch_to(m_rung - 1, now);
+            }
+            return m_rung;
+        }
+        m_short = 0;
+
+        if (m_rung + 1 < m_sizes.size() && now - m_last_switch >= m_up_hold) {
+            // Assume the next rung costs twice as much until we know
+            auto const next = m_sizes[m_rung + 1] > 0 ? m_sizes[m_rung + 1] : 2 * size;
+            if (m_throughput > next * m_target_fps * m_up_margin) {
+                switch_to(m_rung + 1, now);
+            }
+        }
+        return m_rung;
+    }
+
+private:
+    auto switch_to(std::size_t rung, clock::time_point now) -> void
+    {
+        m_rung = rung;
+        m_short = 0;
+        m_last_switch = now;
+    }
+
+    std::vector<double> m_sizes;
+    std::size_t m_rung;
+    int m_target_fps;
+    double m_throughput;
+    int m_short;
+    clock::time_point m_last_switch;
+    int m_down_after;
+    clock::duration m_up_hold;
+    double m_up_margin;
+};
+
+} // namespace gh
+
+#endif // GH_RATE_CONTROLLER_HPP
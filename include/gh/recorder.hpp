@@ -0,0 +1,283 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_RECORDER_HPP
+#define GH_RECORDER_HPP
+
+#include "gh/frame_channel.hpp"
+#include "gh/yuv.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <opencv2/core/utils/filesystem.hpp>
+#include <opencv2/videoio.hpp>
+
+namespace gh {
+
+// Records frames of a channel into video files, as many at once as are
+// requested.
+//
+// Every recording is a job with an id and a file of its own. Jobs run on
+// a small pool of writer threads, each on a strand, so the I/O threads
+// only start them and ask for their state. Frames are written at a fixed
+// rate by their capture time, repeating or skipping frames as needed, so
+// a video lasts as long as what it shows whatever the camera delivered.
+// The files of the oldest finished jobs are removed beyond a limit.
+class recorder
+{
+public:
+    enum class state
+    {
+        recording,
+        done,
+        failed
+    };
+
+    struct status
+    {
+        std::uint64_t id;
+        recorder::state state;
+        int seconds;
+        std::uint64_t frames;
+        std::string path;
+    };
+
+    recorder(std::string directory, unsigned threads = 2, double fps = 20.0)
+    : m_directory(std::move(directory))
+    , m_pool(threads)
+    , m_fps(fps)
+    , m_next_id(0)
+    , m_keep(16)
+    {
+        cv::utils::fs::createDirectories(m_directory);
+    }
+
+    recorder(const recorder&) = delete;
+    recorder& operator=(const recorder&) = delete;
+
+    // Unfinished recordings are cut short.
+    ~recorder()
+    {
+        m_pool.stop();
+        m_pool.join();
+    }
+
+    static auto name(state s) -> const char*
+    {
+        switch (s) {
+        case state::recording: return "recording";
+        case state::done: return "done";
+        case state::failed: return "failed";
+        }
+        return "unknown";
+    }
+
+    // Records `seconds` of `channel` and returns the id of the job. The
+    // guard is held until the recording ends.
+    auto start(std::shared_ptr<frame_channel> channel, int seconds,
+               std::shared_ptr<void> guard = nullptr) -> std::uint64_t
+    {
+        std::shared_ptr<job> j;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto const id = ++m_next_id;
+            j = std::make_shared<job>(m_pool.get_executor(), id, seconds, m_fps,
+                m_directory + "/record-" + std::to_string(id) + ".avi");
+            m_jobs[id] = j;
+            m_order.push_back(id);
+            prune();
+        }
+        j->guard = std::move(guard);
+        boost::asio::post(j->strand, [j, channel]() {
+            j->start(channel);
+        });
+        return j->id;
+    }
+
+    // False if there is no such job, or no longer.
+    auto find(std::uint64_t id, status& out) const -> bool
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto const it = m_jobs.find(id);
+        if (it == m_jobs.end()) {
+            return false;
+        }
+        auto const& j = *it->second;
+        out = status{j.id, j.current.load(), j.seconds, j.frames.load(), j.path};
+        return true;
+    }
+
+    auto active() const -> std::size_t
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::size_t n = 0;
+        for (auto const& j : m_jobs) {
+            if (j.second->current == state::recording) {
+                ++n;
+            }
+        }
+        return n;
+    }
+
+private:
+    using strand_type = boost::asio::strand<boost::asio::thread_pool::executor_type>;
+
+    struct job : std::enable_shared_from_this<job>
+    {
+        job(const boost::asio::thread_pool::executor_type& executor, std::uint64_t i,
+            int s, double f, std::string p)
+        : strand(executor)
+        , timer(strand)
+        , id(i)
+        , seconds(s)
+        , fps(f)
+        , path(std::move(p))
+        , written(0)
+        , current(state::recording)
+        , frames(0)
+        { }
+
+        // Everything below runs on the strand.
+        auto start(const std::shared_ptr<frame_channel>& channel) -> void
+        {
+            std::weak_ptr<job> weak = shared_from_this();
+            subscription = channel->subscribe(strand, [weak](const frame_ptr& f) {
+                auto self = weak.lock();
+                if (self) {
+                    self->write(f);
+                }
+            });
+            source = channel;
+            auto self = shared_from_this();
+            timer.expires_after(std::chrono::seconds(seconds));
+            timer.async_wait([self](boost::system::error_code ec) {
+                if (!ec) {
+                    self->finish();
+                }
+            });
+        }
+
+        auto write(const frame_ptr& f) -> void
+        {
+            if (current != state::recording) {
+                return;
+            }
+            // The webcam failed, keep what was recorded so far
+            if (!f) {
+                return finish();
+            }
+            if (f->image.empty()) {
+                return;
+            }
+            auto const& image = to_bgr(*f, bgr);
+            if (!writer.isOpened()) {
+                writer.open(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps,
+                            image.size(), image.type() == CV_8UC3);
+                if (!writer.isOpened()) {
+                    return fail();
+                }
+                begin = f->timestamp;
+            }
+            // Frames due by the capture time of this one
+            auto const elapsed = std::chrono::duration<double>(f->timestamp - begin).count();
+            auto const due = std::min(static_cast<std::uint64_t>(elapsed * fps),
+                                      static_cast<std::uint64_t>(seconds * fps)) + 1;
+            for (; written < due; ++written) {
+                writer.write(image);
+            }
+            ++frames;
+        }
+
+        auto finish() -> void
+        {
+            if (!writer.isOpened()) {
+                return fail();
+            }
+            stop();
+            current = state::done;
+        }
+
+        auto fail() -> void
+        {
+            stop();
+            std::remove(path.c_str());
+            current = state::failed;
+        }
+
+        auto stop() -> void
+        {
+            subscription.reset();
+            source.reset();
+            timer.cancel();
+            writer.release();
+            guard.reset();
+        }
+
+        strand_type strand;
+        boost::asio::steady_timer timer;
+        std::uint64_t const id;
+        int const seconds;
+        double const fps;
+        std::string const path;
+        std::shared_ptr<void> guard;
+        std::shared_ptr<frame_channel> source;
+        frame_channel::subscription subscription;
+        cv::VideoWriter writer;
+        cv::Mat bgr;
+        std::chrono::system_clock::time_point begin;
+        std::uint64_t written;
+        std::atomic<state> current;
+        std::atomic<std::uint64_t> frames;
+    };
+
+    // Forgets the oldest finished jobs beyond the limit, with their files.
+    auto prune() -> void
+    {
+        std::size_t finished = 0;
+        for (auto const& j : m_jobs) {
+            if (j.second->current != state::recording) {
+                ++finished;
+            }
+        }
+        for (auto it = m_order.begin(); finished > m_keep && it != m_order.end(); ) {
+            auto const j = m_jobs.find(*it);
+            if (j->second->current == state::recording) {
+                ++it;
+                continue;
+            }
+            std::remove(j->second->path.c_str());
+            m_jobs.erase(j);
+            it = m_order.erase(it);
+            --finished;
+        }
+    }
+
+    std::string m_directory;
+    boost::asio::thread_pool m_pool;
+    double m_fps;
+    std::uint64_t m_next_id;
+    std::size_t m_keep;
+    std::map<std::uint64_t, std::shared_ptr<job>> m_jobs;
+    std::deque<std::uint64_t> m_order;
+    mutable std::mutex m_mutex;
+};
+
+} // namespace gh
+
+#endif // GH_RECORDER_HPP
@@ -0,0 +1,106 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_REPLAY_HPP
+#define GH_REPLAY_HPP
+
+#include "gh/journal.hpp"
+
+#include <chrono>
+#include <memory>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+namespace gh {
+
+// Publishes frames read from a journal to a channel of its own, paced by
+// their capture times scaled by `speed`. Once it catches up with the
+// journal it keeps following it, so a replay ends where live begins.
+//
+// Reading runs on the journal's threads and leaves the capture pipeline
+// alone. The replay stops when the last reference to it goes away.
+class replay : public std::enable_shared_from_this<replay>
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    replay(journal& j, journal::clock::time_point from, double speed)
+    : m_strand(j.get_executor())
+    , m_timer(m_strand)
+    , m_reader(j.open(from))
+    , m_channel(std::make_shared<frame_channel>())
+    , m_speed(speed > 0 ? speed : 1.0)
+    { }
+
+    replay(const replay&) = delete;
+    replay& operator=(const replay&) = delete;
+
+    auto channel() const -> const std::shared_ptr<frame_channel>&
+    { return m_channel; }
+
+    auto start() -> void
+    {
+        std::weak_ptr<replay> weak = shared_from_this();
+        boost::asio::post(m_strand, [weak]() {
+            auto self = weak.lock();
+            if (self) {
+                self->step();
+            }
+        });
+    }
+
+private:
+    auto step() -> void
+    {
+        auto const now = clock::now();
+        while (true) {
+            if (!m_next) {
+                m_next = m_reader.next();
+                if (!m_next) {
+                    // Caught up, wait for the journal and start the clock
+                    // over from whatever comes next
+                    m_origin = nullptr;
+                    return wait(now + std::chrono::milliseconds(100));
+                }
+            }
+            if (!m_origin) {
+                m_origin = m_next;
+                m_start = now;
+            }
+            auto const offset = std::chrono::duration_cast<clock::duration>(
+                (m_next->timestamp - m_origin->timestamp) / m_speed);
+            if (m_start + offset > now) {
+                return wait(m_start + offset);
+            }
+            m_channel->publish(m_next);
+            m_next.reset();
+        }
+    }
+
+    auto wait(clock::time_point at) -> void
+    {
+        std::weak_ptr<replay> weak = shared_from_this();
+        m_timer.expires_at(at);
+        m_timer.async_wait([weak](boost::system::error_code ec) {
+            auto self = weak.lock();
+            if (self && !ec) {
+                self->step();
+            }
+        });
+    }
+
+    boost::asio::strand<boost::asio::thread_pool::executor_type> m_strand;
+    boost::asio::steady_timer m_timer;
+    journal::reader m_reader;
+    std::shared_ptr<frame_channel> m_channel;
+    double m_speed;
+    frame_ptr m_next;
+    frame_ptr m_origin;
+    clock::time_point m_start;
+};
+
+} // namespace gh
+
+#endif // GH_REPLAY_HPP
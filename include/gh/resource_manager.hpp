@@ -5,132 +5,395 @@
 #ifndef GH_RESOURCE_MANAGER
 #define GH_RESOURCE_MANAGER
 
-#include "gh/owner_ptr.hpp"
-
-#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 namespace gh {
 
+// Shares one expensive object (e.g. a webcam) between its users. Every
+// user holds a lease; the object is created by the first lease and
+// dropped by the manager when the last lease goes away. The object itself
+// is reference counted, so it is only destroyed once nobody still reads
+// through a pointer obtained from a lease or from current().
+//
+// Objects are destroyed on a thread of the manager's, never by whoever
+// let go of them last, which may be a thread of the object itself. A new
+// object is only made once the previous one is gone, so the two never
+// hold the same device at once. Leases and pointers must not outlive the
+// manager.
+//
+// An object the failure check reports as failed is not handed out again:
+// the next lease gets a new one, while the leases held keep the old one
+// until they are given back. A failed object must have let go of its
+// device already, as the new one is made without waiting for it.
+//
+// With a linger, the last lease going away only drops the object once
+// that much time passed without a new lease, so a user coming straight
+// back (e.g. reloading a page) does not reopen the device.
 template<class T>
 class resource_manager
 {
 public:
-    using pointer = T*;
+    using pointer = std::shared_ptr<T>;
+
+    class lease
+    {
+    public:
+        lease() noexcept
+        : m_manager(nullptr)
+        , m_created(false)
+        , m_owner(false)
+        { }
+
+        lease(const lease&) = delete;
+        lease& operator=(const lease&) = delete;
+
+        lease(lease&& other) noexcept
+        : m_manager(other.m_manager)
+        , m_ptr(std::move(other.m_ptr))
+        , m_created(other.m_created)
+        , m_owner(other.m_owner)
+        {
+            other.m_manager = nullptr;
+            other.m_owner = false;
+        }
+
+        lease& operator=(lease&& other)
+        {
+            if (this != &other) {
+                reset();
+                m_manager = other.m_manager;
+                m_ptr = std::move(other.m_ptr);
+                m_created = other.m_created;
+                m_owner = other.m_owner;
+                other.m_manager = nullptr;
+                other.m_owner = false;
+            }
+            return *this;
+        }
+
+        ~lease()
+        { reset(); }
+
+        explicit operator bool() const noexcept
+        { return static_cast<bool>(m_ptr); }
+
+        T& operator*() const noexcept
+        { return *m_ptr; }
+
+        auto operator->() const noexcept -> T*
+        { return m_ptr.get(); }
+
+        auto get() const noexcept -> const pointer&
+        { return m_ptr; }
+
+        // True if this lease made the resource instead of reusing it.
+        auto created() const noexcept -> bool
+        { return m_created; }
+
+        auto owner() const noexcept -> bool
+        { return m_owner; }
+
+        // Only one lease at a time drives T::update(). Whoever calls this
+        // first after the previous owner left takes over.
+        auto update() -> bool
+        {
+            if (!m_owner) {
+                m_owner = m_manager->try_own();
+            }
+            if (m_owner) {
+                m_ptr->update();
+            }
+            return m_owner;
+        }
+
+        auto last() const noexcept -> bool
+        { return m_manager && m_manager->use_count() == 1; }
+
+        // Give the lease back. Returns true if it was the last one, which
+        // drops the resource, right away or after the linger.
+        auto reset() -> bool
+        {
+            if (!m_manager) {
+                return false;
+            }
+            auto manager = m_manager;
+            bool owner = m_owner;
+            m_manager = nullptr;
+            m_owner = false;
+            m_ptr.reset();
+            return manager->release(owner);
+        }
+
+    private:
+        friend class resource_manager;
+
+        lease(resource_manager* manager, pointer p, bool created) noexcept
+        : m_manager(manager)
+        , m_ptr(std::move(p))
+        , m_created(created)
+        , m_owner(false)
+        { }
+
+        resource_manager* m_manager;
+        pointer m_ptr;
+        bool m_created;
+        bool m_owner;
+    };
 
     resource_manager()
     : m_max_shared{-1}
+    , m_shared{0}
+    , m_owned{false}
+    , m_alive{0}
+    , m_linger{}
+    , m_lingering{false}
+    , m_stopping{false}
     { }
 
     resource_manager(const resource_manager&) = delete;
     resource_manager& operator=(const resource_manager&) = delete;
 
-    explicit operator bool() const noexcept
+    ~resource_manager()
     {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        return static_cast<bool>(m_ptr);
+        std::atomic_store(&m_ptr, pointer{});
+        {
+            std::lock_guard<std::mutex> lock(m_retire_mutex);
+            m_stopping = true;
+        }
+        m_retire_ready.notify_one();
+        if (m_reaper.joinable()) {
+            m_reaper.join();
+        }
     }
 
-    typename std::add_lvalue_reference<T>::type
-    operator*() const noexcept(noexcept(*std::declval<pointer>()))
-    {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        return *m_ptr;
-    }
+    explicit operator bool() const noexcept
+    { return static_cast<bool>(current()); }
 
-    auto operator->() const noexcept -> pointer
-    {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        return m_ptr.operator->();
-    }
+    // The live resource, if any. This does not take the manager's mutex.
+    auto current() const noexcept -> pointer
+    { return std::atomic_load(&m_ptr); }
 
     auto set_max_shared(int n) -> void
     { m_max_shared = n; }
 
+    auto set_linger(std::chrono::steady_clock::duration linger) -> void
+    { m_linger = linger; }
+
     template <class Callable>
     auto set_post_make_action(Callable&& callback) -> void
     { m_callback = std::move(callback); }
 
+    template <class Callable>
+    auto set_failure_check(Callable&& callback) -> void
+    { m_failed = std::move(callback); }
+
+    // Whether `resource` must not be handed out again.
+    auto failed(const T& resource) const -> bool
+    { return m_failed && m_failed(resource); }
+
+    auto use_count() const noexcept -> int
+    { return m_shared.load(); }
+
+    // Returns an empty lease if the limit of shared users is reached.
+    // Making the resource may block, until the previous one is destroyed
+    // and while the new one is set up, and throws what T's constructor
+    // throws.
     template<class... Args>
-    auto make_without_lock(Args&&... args) -> void
+    auto make_or_reuse(Args&&... args) -> lease
     {
-        m_ptr = gh::make_owner<T, Args...>(std::forward<Args...>(args)...);
-        m_ptr.set_max_shared(m_max_shared);
-        if (m_callback) {
-            m_callback(m_ptr);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        wait_for_teardown(lock);
+        if (m_max_shared > 0 && m_shared.load() >= m_max_shared) {
+            return lease{};
+        }
+        bool created = false;
+        pointer p = reusable();
+        if (!p) {
+            p = make_without_lock(std::forward<Args>(args)...);
+            created = true;
         }
+        ++m_shared;
+        return lease{this, std::move(p), created};
     }
 
+    // Makes the resource and holds a lease on it for the lifetime of the
+    // manager. The caller is expected to drive update() itself.
     template<class... Args>
-    auto make(Args&&... args) -> void {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        make_without_lock(args...);
+    auto make_and_keep(Args&&... args) -> void
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        wait_for_teardown(lock);
+        if (!reusable()) {
+            make_without_lock(std::forward<Args>(args)...);
+        }
+        ++m_shared;
+        m_owned = true;
     }
 
-    template<class... Args>
-    auto make_or_reuse(bool& me_owner, Args&&... args) -> int {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        if (m_ptr) {
-            m_ptr.use();
-        } else {
-            make_without_lock(args...);
-            me_owner = true;
-        }
-        return m_ptr.reached() ? 0 : (me_owner ? 1 : 2);
+    auto update() -> void
+    {
+        auto p = current();
+        if (p) {
+            p->update();
+        }
     }
 
-    template<class... Args>
-    auto make_and_keep(Args&&... args) -> void {
-        ++m_max_shared;
-        make(args...);
-        --m_max_shared;
+private:
+    // Until there is a live resource to reuse, or none left to destroy
+    auto wait_for_teardown(std::unique_lock<std::mutex>& lock) -> void
+    {
+        m_torn_down.wait(lock, [this]() { return std::atomic_load(&m_ptr) || m_alive == 0; });
     }
 
-    auto update(bool& me_owner) -> void {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        if (m_ptr.try_own()) {
-            me_owner = true;
+    // The live resource, unless it failed, in which case it is let go of
+    auto reusable() -> pointer
+    {
+        pointer p = std::atomic_load(&m_ptr);
+        if (p && failed(*p)) {
+            std::atomic_store(&m_ptr, pointer{});
+            p.reset();
         }
-        if (me_owner) {
-            m_ptr->update();
+        return p;
+    }
+
+    template<class... Args>
+    auto make_without_lock(Args&&... args) -> pointer
+    {
+        pointer p{new T(std::forward<Args>(args)...), [this](T* dead) { retire(dead); }};
+        ++m_alive;
+        if (m_callback) {
+            m_callback(*p);
         }
+        std::atomic_store(&m_ptr, p);
+        return p;
     }
 
-    auto update() -> void
+    auto try_own() noexcept -> bool
     {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        m_ptr->update();
+        bool expected = false;
+        return m_owned.compare_exchange_strong(expected, true);
     }
 
-    auto last() const -> bool {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        return m_ptr.last();
+    auto release(bool owner) -> bool
+    {
+        if (owner) {
+            m_owned = false;
+        }
+        if (--m_shared > 0) {
+            return false;
+        }
+        if (m_linger <= std::chrono::steady_clock::duration::zero()) {
+            return drop();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_retire_mutex);
+            m_release_at = std::chrono::steady_clock::now() + m_linger;
+            m_lingering = true;
+            start_reaper();
+        }
+        m_retire_ready.notify_one();
+        return true;
     }
 
-    auto release(bool& me_owner) -> int {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        if (me_owner) {
-            m_ptr.reset();
+    auto drop() -> bool
+    {
+        pointer dead;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            // Someone may have taken a new lease in the meantime.
+            if (m_shared.load() == 0) {
+                dead = std::atomic_exchange(&m_ptr, pointer{});
+            }
         }
-        auto p = m_ptr.release();
-        if (p) {
-            delete p;
-            return 1;
+        // Handed to the reaper here unless another thread still holds a
+        // pointer, in which case the last of them does it.
+        return static_cast<bool>(dead);
+    }
+
+    auto start_reaper() -> void
+    {
+        if (!m_reaper.joinable()) {
+            m_reaper = std::thread(&resource_manager::reap, this);
         }
-        return 0;
     }
 
-    auto release() -> pointer {
-        boost::lock_guard<boost::mutex> lock(m_mutex);
-        return m_ptr.release();
+    auto retire(T* dead) -> void
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_retire_mutex);
+            m_retired.push_back(dead);
+            start_reaper();
+        }
+        m_retire_ready.notify_one();
+    }
+
+    // Destroys retired objects outside of any lock, since destroying one
+    // may wait for its own threads, which may be releasing leases, and
+    // drops the resource once it lingered long enough.
+    auto reap() -> void
+    {
+        std::unique_lock<std::mutex> lock(m_retire_mutex);
+        for (;;) {
+            if (m_retired.empty()) {
+                if (m_stopping) {
+                    return;
+                }
+                if (!m_lingering) {
+                    m_retire_ready.wait(lock);
+                    continue;
+                }
+                if (std::chrono::steady_clock::now() < m_release_at) {
+                    m_retire_ready.wait_until(lock, m_release_at);
+                    continue;
+                }
+                m_lingering = false;
+                lock.unlock();
+                drop();
+                lock.lock();
+                continue;
+            }
+            auto const dead = m_retired.front();
+            m_retired.pop_front();
+            lock.unlock();
+            delete dead;
+            {
+                std::lock_guard<std::mutex> alive(m_mutex);
+                --m_alive;
+            }
+            m_torn_down.notify_all();
+            lock.lock();
+        }
     }
 
-private:
     int m_max_shared;
-    owner_ptr<T> m_ptr;
-    mutable boost::mutex m_mutex;
-    std::function<void(owner_ptr<T>&)> m_callback;
+    std::atomic<int> m_shared;
+    std::atomic<bool> m_owned;
+    pointer m_ptr;
+    std::mutex m_mutex;
+    std::function<void(T&)> m_callback;
+    std::function<bool(const T&)> m_failed;
+    // Objects made and not destroyed yet, at most one outside teardown
+    // but for failed ones
+    int m_alive;
+    std::condition_variable m_torn_down;
+    std::deque<T*> m_retired;
+    std::chrono::steady_clock::duration m_linger;
+    std::chrono::steady_clock::time_point m_release_at;
+    bool m_lingering;
+    bool m_stopping;
+    std::thread m_reaper;
+    std::mutex m_retire_mutex;
+    std::condition_variable m_retire_ready;
 };
 
 } // namespace gh
 
-#endif // GH_RESOURCE_MANAGER
\ No newline at end of file
+#endif // GH_RESOURCE_MANAGER
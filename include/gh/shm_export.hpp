@@ -0,0 +1,146 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_SHM_EXPORT_HPP
+#define GH_SHM_EXPORT_HPP
+
+#include "gh/frame.hpp"
+#include "gh/shm_frames.hpp"
+#include "gh/yuv.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+namespace gh {
+
+// Publishes frames into shared memory for gh::shm::reader in other
+// processes on this host, see shm_frames.hpp. Raw images, encoded frames
+// or both are exported; what does not fit in a slot is left out of it.
+//
+// publish() runs on the capture thread and only copies the frame into its
+// slot, it takes no lock and never waits for readers.
+class shm_export : public frame_sink
+{
+public:
+    enum what
+    {
+        raw = 1,
+        jpeg = 2
+    };
+
+    // The memory is created anew, replacing an earlier export of the same
+    // name, and removed again on destruction.
+    shm_export(std::string name, int exported = raw | jpeg,
+               std::uint32_t slots = 8, std::uint32_t slot_bytes = 8u << 20)
+    : m_name(std::move(name))
+    , m_what(exported)
+    , m_next(0)
+    , m_dropped(0)
+    {
+        namespace ipc = boost::interprocess;
+        ipc::shared_memory_object::remove(m_name.c_str());
+        m_memory = ipc::shared_memory_object(ipc::create_only, m_name.c_str(), ipc::read_write);
+        m_memory.truncate(static_cast<ipc::offset_t>(shm::total_bytes(slots, slot_bytes)));
+        m_region = ipc::mapped_region(m_memory, ipc::read_write);
+
+        auto const base = static_cast<unsigned char*>(m_region.get_address());
+        m_header = new (base) shm::header;
+        m_header->slots = slots;
+        m_header->slot_bytes = slot_bytes;
+        m_header->head.store(0, std::memory_order_relaxed);
+        for (std::uint32_t i = 0; i < slots; ++i) {
+            auto const s = new (base + shm::header_bytes() + i * shm::slot_stride(slot_bytes)) shm::slot;
+            s->lock.store(0, std::memory_order_relaxed);
+            s->seq = 0;
+        }
+        m_header->version = shm::version;
+        std::atomic_thread_fence(std::memory_order_release);
+        m_header->magic = shm::magic;
+    }
+
+    shm_export(const shm_export&) = delete;
+    shm_export& operator=(const shm_export&) = delete;
+
+    ~shm_export()
+    {
+        boost::interprocess::shared_memory_object::remove(m_name.c_str());
+    }
+
+    auto publish(const frame_ptr& f) -> void override
+    {
+        // Readers expect BGR whatever the capture format
+        auto const& image = (m_what & raw) ? to_bgr(*f, m_bgr) : f->image;
+        std::size_t raw_size = (m_what & raw) && !image.empty() && image.isContinuous()
+            ? image.total() * image.elemSize() : 0;
+        std::size_t jpeg_size = (m_what & jpeg) && f->jpeg ? f->jpeg->size() : 0;
+        if (raw_size + jpeg_size > m_header->slot_bytes) {
+            ++m_dropped;
+            raw_size = 0;
+            if (jpeg_size > m_header->slot_bytes) {
+                return;
+            }
+        }
+
+        auto const seq = ++m_next;
+        auto const s = at(seq);
+        auto const lock = s->lock.load(std::memory_order_relaxed);
+        s->lock.store(lock + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        s->seq = seq;
+        s->timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+            f->timestamp.time_since_epoch()).count();
+        s->motion = f->motion ? 1 : 0;
+        s->width = image.cols;
+        s->height = image.rows;
+        s->type = image.type();
+        s->step = image.empty() ? 0 : image.step[0];
+        s->raw_size = raw_size;
+        s->jpeg_size = jpeg_size;
+        auto const data = reinterpret_cast<unsigned char*>(s + 1);
+        if (raw_size) {
+            std::memcpy(data, image.data, raw_size);
+        }
+        if (jpeg_size) {
+            std::memcpy(data + raw_size, f->jpeg->data(), jpeg_size);
+        }
+
+        s->lock.store(lock + 2, std::memory_order_release);
+        m_header->head.store(seq, std::memory_order_release);
+    }
+
+    auto name() const -> const std::string&
+    { return m_name; }
+
+    // Frames whose raw image did not fit in a slot.
+    auto dropped() const -> std::uint64_t
+    { return m_dropped; }
+
+private:
+    auto at(std::uint64_t seq) -> shm::slot*
+    {
+        auto const base = static_cast<unsigned char*>(m_region.get_address());
+        return reinterpret_cast<shm::slot*>(base + shm::header_bytes() +
+            (seq % m_header->slots) * shm::slot_stride(m_header->slot_bytes));
+    }
+
+    std::string m_name;
+    int m_what;
+    boost::interprocess::shared_memory_object m_memory;
+    boost::interprocess::mapped_region m_region;
+    shm::header* m_header;
+    std::uint64_t m_next;
+    std::atomic<std::uint64_t> m_dropped;
+    cv::Mat m_bgr;
+};
+
+} // namespace gh
+
+#endif // GH_SHM_EXPORT_HPP
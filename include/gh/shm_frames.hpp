@@ -0,0 +1,160 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_SHM_FRAMES_HPP
+#define GH_SHM_FRAMES_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+// Frames exported through shared memory, and the reader for processes on
+// the same host. This header needs neither OpenCV nor the rest of gh.
+//
+// The memory holds a header followed by a ring of slots. Frames are
+// numbered from 1 by the export, independently of the camera, and frame
+// `seq` lives in slot `seq % slots`. Every slot is guarded by a sequence lock:
+// the writer makes its counter odd, writes, then makes it even again, and
+// a reader accepts what it read only if the counter was even and the same
+// before and after. Neither side ever waits for the other.
+
+namespace gh {
+namespace shm {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory needs lock-free 64-bit atomics");
+
+std::uint32_t const magic = 0x47484652; // "GHFR"
+std::uint32_t const version = 1;
+
+struct header
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t slots;
+    std::uint32_t slot_bytes;
+    // Sequence number of the last complete frame, 0 before the first
+    std::atomic<std::uint64_t> head;
+};
+
+struct slot
+{
+    std::atomic<std::uint64_t> lock;
+    std::uint64_t seq;
+    std::int64_t timestamp;     // milliseconds since the epoch
+    std::uint32_t motion;
+    std::int32_t width;
+    std::int32_t height;
+    std::int32_t type;          // OpenCV type of the raw image, e.g. CV_8UC3
+    std::uint64_t step;         // bytes per row of the raw image
+    std::uint64_t raw_size;     // 0 if raw images are not exported
+    std::uint64_t jpeg_size;    // 0 if encoded frames are not exported
+    // raw_size bytes of image, then jpeg_size bytes of JPEG
+};
+
+inline auto header_bytes() -> std::size_t
+{ return (sizeof(header) + 63) / 64 * 64; }
+
+inline auto slot_stride(std::uint32_t slot_bytes) -> std::size_t
+{ return (sizeof(slot) + slot_bytes + 63) / 64 * 64; }
+
+inline auto total_bytes(std::uint32_t slots, std::uint32_t slot_bytes) -> std::size_t
+{ return header_bytes() + slots * slot_stride(slot_bytes); }
+
+// A frame as seen in shared memory, valid until the reader says otherwise.
+struct frame_view
+{
+    std::uint64_t seq;
+    std::int64_t timestamp;
+    bool motion;
+    int width;
+    int height;
+    int type;
+    std::size_t step;
+    const unsigned char* raw;
+    std::size_t raw_size;
+    const unsigned char* jpeg;
+    std::size_t jpeg_size;
+};
+
+// Reads frames exported under `name` by another process.
+//
+//     gh::shm::reader r{"gh_cam0"};
+//     r.read(r.head(), [&](const gh::shm::frame_view& f) {
+//         cv::Mat image(f.height, f.width, f.type, (void*)f.raw, f.step);
+//         ... // use image, copy it if it must outlive the call
+//     });
+//
+// The view points into shared memory, nothing is copied. The writer may
+// overwrite the slot while `f` runs; read() then returns false and
+// whatever `f` computed has to be thrown away.
+class reader
+{
+public:
+    explicit reader(const char* name)
+    : m_memory(boost::interprocess::open_only, name, boost::interprocess::read_only)
+    , m_region(m_memory, boost::interprocess::read_only)
+    , m_header(static_cast<const header*>(m_region.get_address()))
+    {
+        if (m_region.get_size() < sizeof(header) || m_header->magic != magic ||
+                m_header->version != version || m_header->slots == 0 ||
+                m_region.get_size() < total_bytes(m_header->slots, m_header->slot_bytes)) {
+            throw std::runtime_error("not a gh frame export");
+        }
+    }
+
+    // Sequence number of the newest frame, 0 if there is none yet.
+    auto head() const -> std::uint64_t
+    { return m_header->head.load(std::memory_order_acquire); }
+
+    // How many frames back from head() can still be read.
+    auto slots() const -> std::uint32_t
+    { return m_header->slots; }
+
+    // Calls `f` with frame `seq` if it is still in the ring. True if it
+    // was, and was not overwritten before `f` returned.
+    template<class Function>
+    auto read(std::uint64_t seq, Function&& f) const -> bool
+    {
+        if (seq == 0) {
+            return false;
+        }
+        auto const s = at(seq);
+        auto const before = s->lock.load(std::memory_order_acquire);
+        if ((before & 1) != 0 || s->seq != seq) {
+            return false;
+        }
+        auto const data = reinterpret_cast<const unsigned char*>(s + 1);
+        frame_view view{s->seq, s->timestamp, s->motion != 0,
+            s->width, s->height, s->type, static_cast<std::size_t>(s->step),
+            s->raw_size ? data : nullptr, static_cast<std::size_t>(s->raw_size),
+            s->jpeg_size ? data + s->raw_size : nullptr, static_cast<std::size_t>(s->jpeg_size)};
+        if (view.raw_size + view.jpeg_size > m_header->slot_bytes) {
+            return false;
+        }
+        f(static_cast<const frame_view&>(view));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s->lock.load(std::memory_order_relaxed) == before;
+    }
+
+private:
+    auto at(std::uint64_t seq) const -> const slot*
+    {
+        auto const base = static_cast<const unsigned char*>(m_region.get_address());
+        return reinterpret_cast<const slot*>(base + header_bytes() +
+            (seq % m_header->slots) * slot_stride(m_header->slot_bytes));
+    }
+
+    boost::interprocess::shared_memory_object m_memory;
+    boost::interprocess::mapped_region m_region;
+    const header* m_header;
+};
+
+} // namespace shm
+} // namespace gh
+
+#endif // GH_SHM_FRAMES_HPP
@@ -0,0 +1,399 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_VARIANT_CACHE_HPP
+#define GH_VARIANT_CACHE_HPP
+
+#include "gh/frame_channel.hpp"
+#include "gh/yuv.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace gh {
+
+// Width 0 is the capture width, or that of the crop. A crop is given in
+// cells of a grid of variant_cache::crop_grid by crop_grid over the frame,
+// an empty one being the whole frame.
+struct variant_key
+{
+    int width;
+    int quality;
+    cv::Rect crop;
+
+    friend auto operator<(const variant_key& a, const variant_key& b) -> bool
+    {
+        return std::make_tuple(a.width, a.quality, a.crop.x, a.crop.y, a.crop.width, a.crop.height) <
+               std::make_tuple(b.width, b.quality, b.crop.x, b.crop.y, b.crop.width, b.crop.height);
+    }
+
+    friend auto operator==(const variant_key& a, const variant_key& b) -> bool
+    { return a.width == b.width && a.quality == b.quality && a.crop == b.crop; }
+
+    friend auto operator!=(const variant_key& a, const variant_key& b) -> bool
+    { return !(a == b); }
+};
+
+// Serves frames at several resolutions and JPEG qualities.
+//
+// Requested sizes and qualities are rounded down to a small ladder, and
+// each resulting variant is scaled and encoded once per captured frame on
+// the capture thread, whatever the number of its subscribers. A variant
+// lives as long as someone holds its channel; the first frame published
+// after the last holder is gone tears it down. The variant matching the
+// capture width and quality passes captured frames through unchanged.
+//
+// A variant may also show only a region of the frame, e.g. a doorway in a
+// wide view. Regions are snapped to a coarse grid, so viewers asking for
+// nearly the same one share its encoding. The region is cut out of the
+// captured frame as a view; only scaling, if asked for, copies pixels.
+class variant_cache : public frame_sink
+{
+public:
+    static constexpr int crop_grid = 64;
+
+    struct stats_type
+    {
+        std::size_t variants;
+        std::uint64_t encodes;
+        std::uint64_t frames;
+        // Time spent scaling and encoding, in seconds
+        double encode_seconds;
+    };
+
+    // What serving a variant costs per captured frame.
+    struct cost_type
+    {
+        double frame_bytes;
+        double encode_seconds;
+        // Whether the variant is already being encoded for someone
+        bool active;
+    };
+
+    explicit variant_cache(int base_quality = 95)
+    : m_widths{320, 480, 640, 960, 1280, 1920}
+    , m_qualities{30, 50, 70, 85, 95}
+    , m_base_quality(base_quality)
+    , m_native_width(0)
+    , m_native_height(0)
+    , m_native_bytes(0)
+    , m_encodes(0)
+    , m_frames(0)
+    , m_encode_ns(0)
+    , m_encoded_pixels(0)
+    { }
+
+    variant_cache(const variant_cache&) = delete;
+    variant_cache& operator=(const variant_cache&) = delete;
+
+    // Quality the capture itself encodes at.
+    auto set_base_quality(int quality) -> void
+    { m_base_quality = quality; }
+
+    // Rounds a request down to the ladder. A width or quality of 0, or
+    // one at least as large as what the capture (or crop) produces, means
+    // the capture's own.
+    auto quantize(int width, int quality, const cv::Rect& crop = cv::Rect()) const -> variant_key
+    {
+        variant_key key{0, m_base_quality, crop};
+        auto const native = m_native_width.load() * (crop.area() > 0 ? crop.width : crop_grid) / crop_grid;
+        if (width > 0 && (native == 0 || width < native)) {
+            key.width = m_widths.front();
+            for (auto w : m_widths) {
+                if (w <= width) {
+                    key.width = w;
+                }
+            }
+        }
+        if (quality > 0 && quality < m_base_quality) {
+            key.quality = m_qualities.front();
+            for (auto q : m_qualities) {
+                if (q <= quality) {
+                    key.quality = q;
+                }
+            }
+        }
+        return key;
+    }
+
+    // The cells of the grid covering `region` of a frame of `size`, in
+    // pixels, or an empty crop if that is the whole frame.
+    static auto crop_of(const cv::Rect& region, cv::Size size) -> cv::Rect
+    {
+        auto const r = region & cv::Rect(cv::Point(0, 0), size);
+        if (r.area() == 0) {
+            return cv::Rect();
+        }
+        auto const x = r.x * crop_grid / size.width;
+        auto const y = r.y * crop_grid / size.height;
+        auto const right = ((r.x + r.width) * crop_grid + size.width - 1) / size.width;
+        auto const bottom = ((r.y + r.height) * crop_grid + size.height - 1) / size.height;
+        auto const crop = cv::Rect(x, y, right - x, bottom - y);
+        return crop == cv::Rect(0, 0, crop_grid, crop_grid) ? cv::Rect() : crop;
+    }
+
+    // The pixels `crop` covers in a frame of `size`. The left edge and
+    // the width are even, for the chroma of YUV captures, and the width
+    // a multiple of 16 where there is room, which the JPEG encoder takes
+    // without copying.
+    static auto crop_rect(const cv::Rect& crop, cv::Size size) -> cv::Rect
+    {
+        if (crop.area() == 0) {
+            return cv::Rect(cv::Point(0, 0), size);
+        }
+        auto const x = crop.x * size.width / crop_grid & ~1;
+        auto const y = crop.y * size.height / crop_grid;
+        auto const right = std::min(size.width, (crop.x + crop.width) * size.width / crop_grid);
+        auto const bottom = std::min(size.height, (crop.y + crop.height) * size.height / crop_grid);
+        auto width = right - x;
+        width = width >= 16 ? width & ~15 : std::max(2, width & ~1);
+        return cv::Rect(x, y, width, std::max(1, bottom - y)) & cv::Rect(cv::Point(0, 0), size);
+    }
+
+    // Widths on the ladder, smallest first, 0 being the capture width.
+    auto widths() const -> std::vector<int>
+    {
+        std::vector<int> v;
+        auto const native = m_native_width.load();
+        for (auto w : m_widths) {
+            if (native == 0 || w < native) {
+                v.push_back(w);
+            }
+        }
+        v.push_back(0);
+        return v;
+    }
+
+    auto qualities() const -> const std::vector<int>&
+    { return m_qualities; }
+
+    // Variants for a client to move between as its bandwidth allows, the
+    // cheapest first and the capture's own last. Below the capture width,
+    // quality stays at 70 except on the smallest rung, where lowering it
+    // is all that is left to do.
+    auto ladder() const -> std::vector<variant_key>
+    {
+        std::vector<variant_key> v;
+        auto const add = [&v, this](int width, int quality) {
+            auto const key = quantize(width, quality);
+            if (v.empty() || v.back() != key) {
+                v.push_back(key);
+            }
+        };
+        auto const w = widths();
+        for (auto q : m_qualities) {
+            if (q < 70) {
+                add(w.front(), q);
+            }
+        }
+        for (auto width : w) {
+            if (width != 0) {
+                add(width, 70);
+            }
+        }
+        add(0, 85);
+        add(0, 0);
+        return v;
+    }
+
+    // The channel for `key`, created on demand. Hold on to it for as long
+    // as the variant is needed.
+    auto channel(const variant_key& key) -> std::shared_ptr<frame_channel>
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& v = m_variants[key];
+        if (!v) {
+            v = std::make_shared<variant>(key);
+        }
+        return v->channel;
+    }
+
+    // Estimates what `key` costs, from its last frame if it is being
+    // encoded, or else from the capture's own frames and the average
+    // encoding speed so far. All zero before the first frame.
+    auto cost(const variant_key& key) const -> cost_type
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto const it = m_variants.find(key);
+            if (it != m_variants.end() && it->second->jpeg_bytes.load() > 0) {
+                return cost_type{static_cast<double>(it->second->jpeg_bytes.load()), 0, true};
+            }
+        }
+        auto const width = m_native_width.load();
+        auto const height = m_native_height.load();
+        if (width == 0) {
+            return cost_type{0, 0, false};
+        }
+        auto const area = key.crop.area() > 0
+            ? static_cast<double>(key.crop.area()) / (crop_grid * crop_grid) : 1.0;
+        auto const source = key.crop.area() > 0 ? width * key.crop.width / crop_grid : width;
+        auto const scale = key.width == 0 || key.width >= source
+            ? 1.0 : static_cast<double>(key.width) / source;
+        auto const pixels = scale * scale * area * width * height;
+        // JPEG sizes shrink far slower than the quality setting
+        auto const quality = 0.3 + 0.7 * std::min(1.0, static_cast<double>(key.quality) / m_base_quality);
+
+        auto const encoded = m_encoded_pixels.load();
+        auto const seconds_per_pixel = encoded > 0 ? m_encode_ns.load() * 1e-9 / encoded : 0.0;
+        auto const passthrough = key.quality == m_base_quality && scale == 1.0 && area == 1.0;
+        return cost_type{
+            m_native_bytes.load() * scale * scale * area * quality,
+            passthrough ? 0.0 : seconds_per_pixel * pixels,
+            false};
+    }
+
+    auto publish(const frame_ptr& f) -> void override
+    {
+        m_native_width = f->image.cols;
+        m_native_height = f->image.rows;
+        if (f->jpeg) {
+            m_native_bytes = f->jpeg->size();
+        }
+        ++m_frames;
+
+        std::vector<std::shared_ptr<variant>> active;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_variants.begin(); it != m_variants.end(); ) {
+                if (it->second->channel.use_count() == 1) {
+                    it = m_variants.erase(it);
+                } else {
+                    active.push_back(it->second);
+                    ++it;
+                }
+            }
+        }
+
+        for (auto const& v : active) {
+            if (v->key.quality == m_base_quality && v->key.crop.area() == 0 &&
+                    (v->key.width == 0 || v->key.width >= f->image.cols)) {
+                v->channel->publish(f);
+            } else {
+                v->channel->publish(encode(*v, f));
+            }
+        }
+    }
+
+    auto end() -> void override
+    {
+        std::vector<std::shared_ptr<variant>> active;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto const& v : m_variants) {
+                active.push_back(v.second);
+            }
+        }
+        for (auto const& v : active) {
+            v->channel->end();
+        }
+    }
+
+    auto stats() const -> stats_type
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return stats_type{m_variants.size(), m_encodes.load(), m_frames.load(),
+                          m_encode_ns.load() * 1e-9};
+    }
+
+private:
+    struct variant
+    {
+        explicit variant(const variant_key& k)
+        : key(k)
+        , channel(std::make_shared<frame_channel>())
+        , params{cv::IMWRITE_JPEG_QUALITY, k.quality}
+        , image_bytes(0)
+        , jpeg_bytes(0)
+        { }
+
+        variant_key key;
+        std::shared_ptr<frame_channel> channel;
+        std::vector<int> params;
+        frame_pool frames;
+        buffer_pool buffers;
+        std::size_t image_bytes;
+        // Size of the last frame, read by cost() from other threads
+        std::atomic<std::size_t> jpeg_bytes;
+    };
+
+    auto encode(variant& v, const frame_ptr& f) -> frame_ptr
+    {
+        auto const start = std::chrono::steady_clock::now();
+        auto out = v.frames.acquire(v.image_bytes);
+        out->seq = f->seq;
+        out->timestamp = f->timestamp;
+        out->motion = f->motion;
+        out->changed = f->changed;
+
+        // Views of the crop, and for YUV captures of its planes, which are
+        // scaled plane by plane and encoded as they are
+        auto const r = crop_rect(v.key.crop, f->image.size());
+        cv::Mat image = f->image(r);
+        cv::Mat cb;
+        cv::Mat cr;
+        if (!f->chroma.empty()) {
+            crop_yuv(f->image, f->chroma, r, image, cb, cr);
+        }
+        auto jpeg = v.buffers.acquire(v.jpeg_bytes.load());
+        auto pixels = image.total();
+        if (v.key.width == 0 || v.key.width >= r.width) {
+            out->image.release();
+            out->chroma.release();
+            if (cb.empty()) {
+                cv::imencode(".jpg", image, *jpeg, v.params);
+            } else {
+                m_encoder.encode(image, cb, cr, v.key.quality, *jpeg);
+            }
+        } else {
+            auto const size = cv::Size(v.key.width, std::max(2,
+                (r.height * v.key.width / r.width) & ~1));
+            if (cb.empty()) {
+                cv::resize(image, out->image, size, 0, 0, cv::INTER_AREA);
+                out->chroma.release();
+                cv::imencode(".jpg", out->image, *jpeg, v.params);
+            } else {
+                resize_yuv(image, cb, cr, size, out->image, out->chroma);
+                m_encoder.encode(out->image, out->chroma, v.key.quality, *jpeg);
+            }
+            v.image_bytes = frame_pool::size_class(out->image) + frame_pool::size_class(out->chroma);
+            pixels = out->image.total();
+        }
+        v.jpeg_bytes = jpeg->size();
+        out->jpeg = std::move(jpeg);
+        ++m_encodes;
+        m_encode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        m_encoded_pixels += pixels;
+        return out;
+    }
+
+    std::vector<int> m_widths;
+    std::vector<int> m_qualities;
+    int m_base_quality;
+    std::atomic<int> m_native_width;
+    std::atomic<int> m_native_height;
+    std::atomic<std::size_t> m_native_bytes;
+    std::atomic<std::uint64_t> m_encodes;
+    std::atomic<std::uint64_t> m_frames;
+    std::atomic<std::uint64_t> m_encode_ns;
+    std::atomic<std::uint64_t> m_encoded_pixels;
+    std::map<variant_key, std::shared_ptr<variant>> m_variants;
+    // Used on the capture thread only
+    yuv_encoder m_encoder;
+    mutable std::mutex m_mutex;
+};
+
+} // namespace gh
+
+#endif // GH_VARIANT_CACHE_HPP
@@ -5,7 +5,18 @@
 #ifndef GH_WEBCAM_HPP
 #define GH_WEBCAM_HPP
 
+#include "gh/change_detector.hpp"
+#include "gh/frame.hpp"
+#include "gh/yuv.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
 #include <exception>
+#include <iostream>
+#include <thread>
 
 #include <boost/thread/locks.hpp>
 #include <boost/thread/shared_mutex.hpp>
@@ -20,18 +31,101 @@ class webcam_extension
 public:
     virtual auto init(cv::InputArray frame) -> void = 0;
     virtual auto update(cv::InputOutputArray frame) -> bool = 0;
+
+    // For YUV captures, after update(), with the chroma planes of the
+    // frame (see yuv.hpp). An extension covering parts of the image
+    // greys them out here, or their colour would show through.
+    virtual auto update_chroma(cv::InputOutputArray /*chroma*/) -> void
+    { }
+
+    // Extensions answering true change the frame before anything looks at
+    // it, change detection included, e.g. to hide parts of it.
+    virtual auto preprocess() const -> bool
+    { return false; }
+};
+
+// How frames come from the camera. With yuyv the camera's own YUV 4:2:2 is
+// kept, and neither the capture nor the encoder converts colours; the
+// extensions see the luma plane. Cameras that cannot deliver YUYV are
+// captured as BGR.
+enum class capture_format
+{
+    bgr,
+    yuyv,
+};
+
+// CPU time the capture thread spent on the frames so far, by stage.
+struct capture_timings
+{
+    std::uint64_t frames;
+    // Reading the frame from the camera, including OpenCV's conversion
+    double capture_seconds;
+    // Splitting YUYV into planes
+    double convert_seconds;
+    // Change detection and extensions
+    double analysis_seconds;
+    double encode_seconds;
 };
 
+// Whether the capture has slowed down for lack of motion, see
+// webcam::set_idle().
+struct activity_stats
+{
+    bool idle;
+    // Transitions from full rate to the idle rate, and back
+    std::uint64_t to_idle;
+    std::uint64_t to_active;
+    double idle_seconds;
+};
 class webcam
 {
 public:
     webcam()
     : m_cap{}
+    , m_params{cv::IMWRITE_JPEG_QUALITY, 95}
+    , m_format(capture_format::bgr)
+    , m_fps(30)
+    , m_running(false)
+    , m_failed(false)
+    , m_seq(0)
+    , m_unchanged(0)
+    , m_image_bytes(0)
+    , m_jpeg_bytes(0)
+    , m_timed(0)
+    , m_capture_ns(0)
+    , m_convert_ns(0)
+    , m_analysis_ns(0)
+    , m_encode_ns(0)
+    , m_idle_fps(0)
+    , m_idle_after(std::chrono::seconds(30))
+    , m_idle(false)
+    , m_to_idle(0)
+    , m_to_active(0)
+    , m_idle_ns(0)
     { }
 
     explicit webcam(int index)
     : m_cap{index}
-    , m_quality(95)
+    , m_params{cv::IMWRITE_JPEG_QUALITY, 95}
+    , m_format(capture_format::bgr)
+    , m_fps(30)
+    , m_running(false)
+    , m_failed(false)
+    , m_seq(0)
+    , m_unchanged(0)
+    , m_image_bytes(0)
+    , m_jpeg_bytes(0)
+    , m_timed(0)
+    , m_capture_ns(0)
+    , m_convert_ns(0)
+    , m_analysis_ns(0)
+    , m_encode_ns(0)
+    , m_idle_fps(0)
+    , m_idle_after(std::chrono::seconds(30))
+    , m_idle(false)
+    , m_to_idle(0)
+    , m_to_active(0)
+    , m_idle_ns(0)
     {
         if (!m_cap.isOpened()) {
             throw std::system_error(EBUSY, std::generic_category(), "cannot open webcam");
@@ -43,6 +137,9 @@ public:
     webcam(const webcam&) = delete;
     webcam& operator=(const webcam&) = delete;
 
+    ~webcam()
+    { stop(); }
+
     auto open(int index) -> void
     {
         m_cap.open(index);
@@ -50,9 +147,10 @@ public:
             throw std::system_error(EBUSY, std::generic_category(), "cannot open webcam");
         }
         set_fps(30);
+        apply_format();
         update();
         for (auto ext : m_extensions) {
-            ext->init(m_frame);
+            ext->init(latest()->image);
         }
     }
 
@@ -60,18 +158,115 @@ public:
     {
         m_extensions.push_back(&extension);
         if (m_cap.isOpened()) {
-            extension.init(m_frame);
+            extension.init(latest()->image);
         }
     }
 
+    // Sinks get every frame from update(), on the thread calling it.
+    auto install(frame_sink& sink) -> void
+    {
+        m_sinks.push_back(&sink);
+    }
+
+    // Takes a frame in the new format if the camera is open. Call it
+    // before start().
+    auto set_capture_format(capture_format format) -> void
+    {
+        m_format = format;
+        if (m_cap.isOpened()) {
+            apply_format();
+            update();
+        }
+    }
+
+    auto format() const -> capture_format
+    { return m_format; }
+
     auto set_fps(int fps) -> void
     {
         m_cap.set(cv::CAP_PROP_FPS, fps);
+        m_fps = fps;
+    }
+
+    // Once no frame has had motion for `after`, only `fps` frames per
+    // second are decoded, analysed, encoded and published; the first one
+    // with motion brings back the full rate from the next frame on. The
+    // camera keeps running at full rate meanwhile and the frames in
+    // between are dropped undecoded, so the slow ones are never stale.
+    // Motion is what the extensions report, so one of them must detect
+    // it. An `fps` of 0 keeps the full rate. Call it before start().
+    auto set_idle(int fps, std::chrono::steady_clock::duration after) -> void
+    {
+        m_idle_fps = fps;
+        m_idle_after = after;
+    }
+
+    // Capture on a thread of its own at the configured frame rate until
+    // stop() or destruction, or until the camera fails, which closes it
+    // and ends every sink, see failed().
+    auto start() -> void
+    {
+        if (m_thread.joinable()) {
+            return;
+        }
+        m_running = true;
+        m_last_motion = std::chrono::steady_clock::now();
+        m_thread = std::thread([this]() {
+            auto next = std::chrono::steady_clock::now();
+            auto last = next;
+            while (m_running) {
+                auto const now = std::chrono::steady_clock::now();
+                if (m_idle) {
+                    m_idle_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+                }
+                last = now;
+                try {
+                    if (!m_idle || now >= m_idle_next) {
+                        update();
+                    } else if (!m_cap.grab()) {
+                        throw std::system_error(EIO, std::generic_category(), "webcam lost");
+                    }
+                } catch (const std::exception& e) {
+                    std::cerr << "capture: " << e.what() << '\n';
+                    fail();
+                    break;
+                }
+                next += std::chrono::microseconds(1000000 / std::max(1, m_fps.load()));
+                auto const after = std::chrono::steady_clock::now();
+                if (next < after) {
+                    next = after;
+                } else {
+                    std::this_thread::sleep_until(next);
+                }
+            }
+        });
+    }
+
+    auto stop() -> void
+    {
+        m_running = false;
+        // Not on the capture thread: even when a sink there drops the last
+        // lease, resource_manager destroys the webcam on a thread of its own
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+    // The capture stopped on an error. The camera is closed already, so
+    // another webcam may open it while this one is still around.
+    auto failed() const -> bool
+    { return m_failed; }
+
+    // Largest difference, in gray levels of a thumbnail cell, that still
+    // counts as an unchanged frame.
+    auto set_change_threshold(int threshold) -> void
+    {
+        m_change.set_threshold(threshold);
     }
 
     auto set_quality(int quality) -> void
     {
-        m_quality = quality;
+        m_params[1] = quality;
     }
 
     auto update() -> void
@@ -79,46 +274,110 @@ public:
         if (!m_cap.isOpened()) {
             throw std::system_error(EBUSY, std::generic_category(), "webcam closed");
         }
-        m_cap >> m_frame;
+        // Both the image and the encoded bytes are taken from pools, so
+        // once the readers of older frames are done with them the
+        // capture runs without touching the heap.
+        auto const start = cpu_time_ns();
+        auto f = m_frames.acquire(m_image_bytes);
+        if (m_format == capture_format::yuyv) {
+            m_cap >> m_raw;
+        } else {
+            m_cap >> f->image;
+            f->chroma.release();
+        }
+        auto const captured = cpu_time_ns();
+        if (m_format == capture_format::yuyv) {
+            to_planes(*f);
+        }
+        auto const converted = cpu_time_ns();
+
+        // After what hides parts of the image, so nothing there counts as
+        // a change, and before the other extensions draw anything into it
+        f->motion = false;
         for (auto ext : m_extensions) {
-            ext->update(m_frame);
+            if (ext->preprocess() && ext->update(f->image)) {
+                f->motion = true;
+            }
         }
-        std::vector<uchar> buf;
-        cv::imencode(".jpg", m_frame, buf, std::vector<int>{cv::IMWRITE_JPEG_QUALITY, m_quality});
-        if (m_writer.isOpened()) {
-            m_writer.write(m_frame);
+        f->changed = m_change.update(f->image);
+        for (auto ext : m_extensions) {
+            if (!ext->preprocess() && ext->update(f->image)) {
+                f->motion = true;
+            }
+        }
+        if (!f->chroma.empty()) {
+            for (auto ext : m_extensions) {
+                ext->update_chroma(f->chroma);
+            }
+        }
+        if (f->motion) {
+            f->changed = true;
+        }
+        if (!f->changed) {
+            ++m_unchanged;
+        }
+        track_activity(f->motion);
+        auto const analysed = cpu_time_ns();
+
+        auto jpeg = m_buffers.acquire(m_jpeg_bytes);
+        if (f->chroma.empty()) {
+            cv::imencode(".jpg", f->image, *jpeg, m_params);
+        } else {
+            m_encoder.encode(f->image, f->chroma, m_params[1], *jpeg);
+        }
+        auto const encoded = cpu_time_ns();
+        m_capture_ns += captured - start;
+        m_convert_ns += converted - captured;
+        m_analysis_ns += analysed - converted;
+        m_encode_ns += encoded - analysed;
+        ++m_timed;
+
+        m_image_bytes = frame_pool::size_class(f->image) + frame_pool::size_class(f->chroma);
+        m_jpeg_bytes = jpeg->size();
+        f->jpeg = std::move(jpeg);
+        f->seq = ++m_seq;
+        f->timestamp = std::chrono::system_clock::now();
+        frame_ptr published{std::move(f)};
+        {
+            boost::unique_lock<boost::shared_mutex> lock(m_mutex);
+            m_current = published;
+        }
+        for (auto sink : m_sinks) {
+            sink->publish(published);
         }
-        boost::unique_lock<boost::shared_mutex> lock(m_mutex);
-        m_buffer = std::move(buf);
     }
 
-    auto get() -> std::vector<uchar>
+    // Encoded bytes of the latest frame, shared with every other reader.
+    auto get() const -> buffer_ptr
     {
         boost::shared_lock<boost::shared_mutex> lock(m_mutex);
-        return m_buffer;
+        return m_current ? m_current->jpeg : buffer_ptr{};
     }
 
-    void record_video(const char* path, double fps = 20.0)
+    auto latest() const -> frame_ptr
     {
-        int codec = cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
-        if (!m_writer.isOpened()) {
-            m_writer.open(path, codec, fps, m_frame.size(), m_frame.type() == CV_8UC3);
-        }
-        if (!m_writer.isOpened()) {
-            throw std::system_error(EBUSY, std::generic_category(), "Cannot open live.avi");
-        }
+        boost::shared_lock<boost::shared_mutex> lock(m_mutex);
+        return m_current;
     }
 
-    void stop_record()
+    auto frame_stats() const -> pool_stats
+    { return m_frames.stats(); }
+
+    auto buffer_stats() const -> pool_stats
+    { return m_buffers.stats(); }
+
+    auto unchanged_frames() const -> std::uint64_t
+    { return m_unchanged; }
+
+    auto activity() const -> activity_stats
     {
-        if (m_writer.isOpened()) {
-            m_writer.release();
-        }
+        return activity_stats{m_idle.load(), m_to_idle.load(), m_to_active.load(), m_idle_ns.load() * 1e-9};
     }
 
-    void take_picture(const char* path)
+    auto timings() const -> capture_timings
     {
-        cv::imwrite(path, m_frame);
+        return capture_timings{m_timed.load(), m_capture_ns.load() * 1e-9, m_convert_ns.load() * 1e-9,
+                               m_analysis_ns.load() * 1e-9, m_encode_ns.load() * 1e-9};
     }
 
     void run()
@@ -127,14 +386,11 @@ public:
 
         cv::namedWindow(window_name, cv::WINDOW_NORMAL);
 
+        cv::Mat image;
         while (true) {
-            m_cap >> m_frame;
-
-            cv::imshow(window_name, m_frame);
+            m_cap >> image;
 
-            if (m_writer.isOpened()) {
-                m_writer.write(m_frame);
-            }
+            cv::imshow(window_name, image);
 
             if (cv::waitKey(5) == 'q') {
                 break;
@@ -149,13 +405,125 @@ public:
     }
 
 private:
+    // CPU time of the calling thread, or wall time where there is no
+    // such clock
+    static auto cpu_time_ns() -> std::uint64_t
+    {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+        timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+            return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+        }
+#endif
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // On the capture thread, which ends right after
+    auto fail() -> void
+    {
+        m_running = false;
+        m_failed = true;
+        m_cap.release();
+        for (auto sink : m_sinks) {
+            sink->end();
+        }
+    }
+
+    // Switches between the full and the idle rate, on the capture thread
+    auto track_activity(bool motion) -> void
+    {
+        auto const now = std::chrono::steady_clock::now();
+        if (motion) {
+            m_last_motion = now;
+            if (m_idle) {
+                m_idle = false;
+                ++m_to_active;
+            }
+            return;
+        }
+        if (!m_idle && m_idle_fps > 0 && now - m_last_motion >= m_idle_after) {
+            m_idle = true;
+            ++m_to_idle;
+        }
+        if (m_idle) {
+            m_idle_next = now + std::chrono::microseconds(1000000 / std::max(1, m_idle_fps.load()));
+        }
+    }
+
+    auto apply_format() -> void
+    {
+        auto const yuyv = cv::VideoWriter::fourcc('Y', 'U', 'Y', 'V');
+        if (m_format == capture_format::yuyv) {
+            m_cap.set(cv::CAP_PROP_FOURCC, yuyv);
+            if (static_cast<int>(m_cap.get(cv::CAP_PROP_FOURCC)) != yuyv) {
+                std::cerr << "capture: the camera does not deliver YUYV, capturing BGR\n";
+                m_format = capture_format::bgr;
+            }
+        }
+        m_cap.set(cv::CAP_PROP_CONVERT_RGB, m_format == capture_format::bgr ? 1 : 0);
+    }
+
+    // Backends hand over unconverted YUYV either as two channels or as
+    // the bare bytes in a single row.
+    auto to_planes(frame& f) -> void
+    {
+        cv::Mat yuyv = m_raw;
+        if (yuyv.type() == CV_8UC1 && yuyv.rows == 1) {
+            auto const width = static_cast<int>(m_cap.get(cv::CAP_PROP_FRAME_WIDTH));
+            auto const height = static_cast<int>(m_cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+            if (width > 0 && height > 0 && yuyv.total() == static_cast<std::size_t>(width) * height * 2) {
+                yuyv = yuyv.reshape(2, height);
+            }
+        }
+        if (yuyv.type() == CV_8UC2 && yuyv.cols % 2 == 0) {
+            split_yuyv(yuyv, f.image, f.chroma);
+            return;
+        }
+        std::cerr << "capture: unexpected YUYV layout, capturing BGR\n";
+        m_format = capture_format::bgr;
+        apply_format();
+        if (m_raw.type() == CV_8UC3) {
+            m_raw.copyTo(f.image);
+        } else {
+            m_cap >> f.image;
+        }
+        f.chroma.release();
+    }
+
     cv::VideoCapture m_cap;
-    int m_quality;
-    cv::VideoWriter m_writer;
-    cv::Mat m_frame;
-    std::vector<uchar> m_buffer;
+    std::vector<int> m_params;
+    std::atomic<capture_format> m_format;
+    std::atomic<int> m_fps;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_failed;
+    std::thread m_thread;
+    frame_pool m_frames;
+    buffer_pool m_buffers;
+    frame_ptr m_current;
+    std::uint64_t m_seq;
+    std::atomic<std::uint64_t> m_unchanged;
+    change_detector m_change;
+    std::size_t m_image_bytes;
+    std::size_t m_jpeg_bytes;
+    cv::Mat m_raw;
+    yuv_encoder m_encoder;
+    std::atomic<std::uint64_t> m_timed;
+    std::atomic<std::uint64_t> m_capture_ns;
+    std::atomic<std::uint64_t> m_convert_ns;
+    std::atomic<std::uint64_t> m_analysis_ns;
+    std::atomic<std::uint64_t> m_encode_ns;
+    std::atomic<int> m_idle_fps;
+    std::chrono::steady_clock::duration m_idle_after;
+    std::atomic<bool> m_idle;
+    std::chrono::steady_clock::time_point m_last_motion;
+    std::chrono::steady_clock::time_point m_idle_next;
+    std::atomic<std::uint64_t> m_to_idle;
+    std::atomic<std::uint64_t> m_to_active;
+    std::atomic<std::uint64_t> m_idle_ns;
     std::vector<webcam_extension*> m_extensions;
-    boost::shared_mutex m_mutex;
+    std::vector<frame_sink*> m_sinks;
+    mutable boost::shared_mutex m_mutex;
 };
 
 } // namespace gh
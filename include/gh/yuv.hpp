@@ -0,0 +1,285 @@
+//
+// Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
+//
+
+#ifndef GH_YUV_HPP
+#define GH_YUV_HPP
+
+#include "gh/frame.hpp"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstddef>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#ifdef GH_HAVE_LIBJPEG
+extern "C" {
+#include <jpeglib.h>
+}
+#endif
+
+namespace gh {
+
+// Frames captured as YUV 4:2:2 are kept in the planes JPEG itself uses:
+// the luma plane as frame::image, and frame::chroma of the same size with
+// Cb in its left half and Cr in its right half. Nothing on the way from
+// the camera to the encoder converts colours.
+
+// Splits packed YUYV, as cameras deliver it, into those planes, in one
+// pass over the bytes.
+inline auto split_yuyv(const cv::Mat& yuyv, cv::Mat& luma, cv::Mat& chroma) -> void
+{
+    CV_Assert(yuyv.type() == CV_8UC2 && yuyv.cols % 2 == 0);
+    luma.create(yuyv.size(), CV_8UC1);
+    chroma.create(yuyv.size(), CV_8UC1);
+    auto const half = yuyv.cols / 2;
+    for (auto y = 0; y < yuyv.rows; ++y) {
+        auto const s = yuyv.ptr<unsigned char>(y);
+        auto const l = luma.ptr<unsigned char>(y);
+        auto const cb = chroma.ptr<unsigned char>(y);
+        auto const cr = cb + half;
+        for (auto x = 0; x < half; ++x) {
+            l[2 * x] = s[4 * x];
+            cb[x] = s[4 * x + 1];
+            l[2 * x + 1] = s[4 * x + 2];
+            cr[x] = s[4 * x + 3];
+        }
+    }
+}
+
+// Views of the Cb and Cr halves of `chroma`.
+inline auto split_chroma(const cv::Mat& chroma, cv::Mat& cb, cv::Mat& cr) -> void
+{
+    auto const half = chroma.cols / 2;
+    cb = chroma.colRange(0, half);
+    cr = chroma.colRange(half, 2 * half);
+}
+
+// Views of the part of each plane under `r` of the image, whose x and
+// width must be even. Nothing is copied.
+inline auto crop_yuv(const cv::Mat& luma, const cv::Mat& chroma, const cv::Rect& r,
+                     cv::Mat& y, cv::Mat& cb, cv::Mat& cr) -> void
+{
+    auto const c = cv::Rect(r.x / 2, r.y, r.width / 2, r.height);
+    y = luma(r);
+    cb = chroma(c);
+    cr = chroma(c + cv::Point(chroma.cols / 2, 0));
+}
+
+// Packs planes back into YUYV.
+inline auto pack_yuyv(const cv::Mat& luma, const cv::Mat& cb, const cv::Mat& cr, cv::Mat& yuyv) -> void
+{
+    yuyv.create(luma.size(), CV_8UC2);
+    for (auto y = 0; y < luma.rows; ++y) {
+        auto const d = yuyv.ptr<unsigned char>(y);
+        auto const l = luma.ptr<unsigned char>(y);
+        auto const u = cb.ptr<unsigned char>(y);
+        auto const v = cr.ptr<unsigned char>(y);
+        for (auto x = 0; x < luma.cols / 2; ++x) {
+            d[4 * x] = l[2 * x];
+            d[4 * x + 1] = u[x];
+            d[4 * x + 2] = l[2 * x + 1];
+            d[4 * x + 3] = v[x];
+        }
+    }
+}
+
+inline auto yuv_to_bgr(const cv::Mat& luma, const cv::Mat& cb, const cv::Mat& cr, cv::Mat& bgr) -> void
+{
+    static thread_local cv::Mat yuyv;
+    pack_yuyv(luma, cb, cr, yuyv);
+    cv::cvtColor(yuyv, bgr, cv::COLOR_YUV2BGR_YUYV);
+}
+
+// The image of `f` as BGR, converted into `scratch` if it was captured as
+// YUV. For the consumers that need colour pixels, e.g. video files.
+inline auto to_bgr(const frame& f, cv::Mat& scratch) -> const cv::Mat&
+{
+    if (f.chroma.empty()) {
+        return f.image;
+    }
+    cv::Mat cb;
+    cv::Mat cr;
+    split_chroma(f.chroma, cb, cr);
+    yuv_to_bgr(f.image, cb, cr, scratch);
+    return scratch;
+}
+
+// Scales the planes to `size`, whose width must be even, into a luma
+// plane and a chroma plane laid out as frame::chroma.
+inline auto resize_yuv(const cv::Mat& luma, const cv::Mat& cb, const cv::Mat& cr, cv::Size size,
+                       cv::Mat& luma_out, cv::Mat& chroma_out) -> void
+{
+    cv::resize(luma, luma_out, size, 0, 0, cv::INTER_AREA);
+    chroma_out.create(size, CV_8UC1);
+    cv::Mat cb_out;
+    cv::Mat cr_out;
+    split_chroma(chroma_out, cb_out, cr_out);
+    cv::resize(cb, cb_out, cb_out.size(), 0, 0, cv::INTER_AREA);
+    cv::resize(cr, cr_out, cr_out.size(), 0, 0, cv::INTER_AREA);
+}
+
+// Encodes YUV 4:2:2 planes to JPEG. With libjpeg (GH_USE_LIBJPEG) the
+// planes are handed to it as raw data, which skips both the colour
+// conversion and the downsampling a BGR image would go through; frames
+// whose width is not a multiple of 16, or builds without libjpeg, go
+// through BGR and cv::imencode instead. One encoder per thread.
+class yuv_encoder
+{
+public:
+    yuv_encoder()
+    {
+#ifdef GH_HAVE_LIBJPEG
+        m_cinfo.err = jpeg_std_error(&m_error.pub);
+        m_error.pub.error_exit = &yuv_encoder::error_exit;
+        jpeg_create_compress(&m_cinfo);
+        m_dest.pub.init_destination = &yuv_encoder::init_destination;
+        m_dest.pub.empty_output_buffer = &yuv_encoder::empty_output_buffer;
+        m_dest.pub.term_destination = &yuv_encoder::term_destination;
+        m_dest.out = nullptr;
+        m_cinfo.dest = &m_dest.pub;
+#endif
+    }
+
+    yuv_encoder(const yuv_encoder&) = delete;
+    yuv_encoder& operator=(const yuv_encoder&) = delete;
+
+    ~yuv_encoder()
+    {
+#ifdef GH_HAVE_LIBJPEG
+        jpeg_destroy_compress(&m_cinfo);
+#endif
+    }
+
+    // Whether frames of `width` are encoded without going through BGR.
+    static auto direct(int width) -> bool
+    {
+#ifdef GH_HAVE_LIBJPEG
+        return width > 0 && width % 16 == 0;
+#else
+        return (void)width, false;
+#endif
+    }
+
+    auto encode(const cv::Mat& luma, const cv::Mat& chroma, int quality, buffer& out) -> void
+    {
+        cv::Mat cb;
+        cv::Mat cr;
+        split_chroma(chroma, cb, cr);
+        encode(luma, cb, cr, quality, out);
+    }
+
+    // The planes may be views into larger ones, e.g. from crop_yuv().
+    auto encode(const cv::Mat& luma, const cv::Mat& cb, const cv::Mat& cr, int quality, buffer& out) -> void
+    {
+        if (!direct(luma.cols)) {
+            yuv_to_bgr(luma, cb, cr, m_bgr);
+            cv::imencode(".jpg", m_bgr, out, {cv::IMWRITE_JPEG_QUALITY, quality});
+            return;
+        }
+#ifdef GH_HAVE_LIBJPEG
+        m_dest.out = &out;
+        if (setjmp(m_error.jump)) {
+            jpeg_abort_compress(&m_cinfo);
+            throw std::runtime_error(std::string("jpeg: ") + m_error.message);
+        }
+
+        m_cinfo.image_width = static_cast<JDIMENSION>(luma.cols);
+        m_cinfo.image_height = static_cast<JDIMENSION>(luma.rows);
+        m_cinfo.input_components = 3;
+        m_cinfo.in_color_space = JCS_YCbCr;
+        jpeg_set_defaults(&m_cinfo);
+        jpeg_set_colorspace(&m_cinfo, JCS_YCbCr);
+        jpeg_set_quality(&m_cinfo, quality, TRUE);
+        m_cinfo.raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+        m_cinfo.do_fancy_downsampling = FALSE;
+#endif
+        m_cinfo.comp_info[0].h_samp_factor = 2;
+        m_cinfo.comp_info[0].v_samp_factor = 1;
+        for (auto c = 1; c < 3; ++c) {
+            m_cinfo.comp_info[c].h_samp_factor = 1;
+            m_cinfo.comp_info[c].v_samp_factor = 1;
+        }
+        jpeg_start_compress(&m_cinfo, TRUE);
+
+        // An MCU row is 8 lines; past the bottom the last line repeats
+        JSAMPARRAY planes[3] = {m_rows[0], m_rows[1], m_rows[2]};
+        while (m_cinfo.next_scanline < m_cinfo.image_height) {
+            for (auto i = 0; i < DCTSIZE; ++i) {
+                auto const y = std::min(static_cast<int>(m_cinfo.next_scanline) + i, luma.rows - 1);
+                m_rows[0][i] = const_cast<JSAMPROW>(luma.ptr<unsigned char>(y));
+                m_rows[1][i] = const_cast<JSAMPROW>(cb.ptr<unsigned char>(y));
+                m_rows[2][i] = const_cast<JSAMPROW>(cr.ptr<unsigned char>(y));
+            }
+            jpeg_write_raw_data(&m_cinfo, planes, DCTSIZE);
+        }
+        jpeg_finish_compress(&m_cinfo);
+#endif
+    }
+
+private:
+#ifdef GH_HAVE_LIBJPEG
+    struct error_manager
+    {
+        jpeg_error_mgr pub;
+        std::jmp_buf jump;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    // Writes straight into the (pooled) output buffer, growing it as needed
+    struct destination
+    {
+        jpeg_destination_mgr pub;
+        buffer* out;
+    };
+
+    static auto error_exit(j_common_ptr cinfo) -> void
+    {
+        auto const error = reinterpret_cast<error_manager*>(cinfo->err);
+        (*cinfo->err->format_message)(cinfo, error->message);
+        std::longjmp(error->jump, 1);
+    }
+
+    static auto init_destination(j_compress_ptr cinfo) -> void
+    {
+        auto const dest = reinterpret_cast<destination*>(cinfo->dest);
+        dest->out->resize(std::max<std::size_t>(dest->out->capacity(), 64 * 1024));
+        dest->pub.next_output_byte = dest->out->data();
+        dest->pub.free_in_buffer = dest->out->size();
+    }
+
+    static auto empty_output_buffer(j_compress_ptr cinfo) -> boolean
+    {
+        auto const dest = reinterpret_cast<destination*>(cinfo->dest);
+        auto const used = dest->out->size();
+        dest->out->resize(used * 2);
+        dest->pub.next_output_byte = dest->out->data() + used;
+        dest->pub.free_in_buffer = dest->out->size() - used;
+        return TRUE;
+    }
+
+    static auto term_destination(j_compress_ptr cinfo) -> void
+    {
+        auto const dest = reinterpret_cast<destination*>(cinfo->dest);
+        dest->out->resize(dest->out->size() - dest->pub.free_in_buffer);
+    }
+
+    jpeg_compress_struct m_cinfo;
+    error_manager m_error;
+    destination m_dest;
+    JSAMPROW m_rows[3][DCTSIZE];
+#endif
+    cv::Mat m_bgr;
+};
+
+} // namespace gh
+
+#endif // GH_YUV_HPP
@@ -2,19 +2,38 @@
 // Copyright (c) 2023 Gary Huang (ghuang dot nctu at gmail dot com)
 //
 
+#include "gh/admission.hpp"
+#include "gh/journal.hpp"
 #include "gh/motion_detector.hpp"
+#include "gh/motion_events.hpp"
+#include "gh/overlay.hpp"
+#include "gh/privacy_mask.hpp"
+#include "gh/recorder.hpp"
+#include "gh/replay.hpp"
+#include "gh/shm_export.hpp"
+#include "gh/variant_cache.hpp"
 #include "gh/webcam.hpp"
+#include "gh/lease_holder.hpp"
+#include "gh/http/event_stream.hpp"
+#include "gh/http/frame_poll.hpp"
+#include "gh/http/mjpeg_stream.hpp"
 #include "gh/http/server.hpp"
+#include "gh/http/ws_stream.hpp"
+#include "gh/http/shared_buffer_body.hpp"
 #include "gh/resource_manager.hpp"
 
+#include <functional>
 #include <iostream>
+#include <sstream>
 #include <thread>
 #include <chrono>
-#include <future>
 #include <utility>
 
 #include <cstdio>
+#include <cstdlib>
 
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core/ostream.hpp>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/dynamic_body.hpp>
@@ -22,6 +41,7 @@
 #include <boost/beast/http/file_body.hpp>
 #include <boost/beast/http/write.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/beast/websocket/rfc6455.hpp>
 
 auto main(/*int argc, char* argv[]*/) -> int
 {
@@ -36,151 +56,735 @@ auto main(/*int argc, char* argv[]*/) -> int
     auto const threads = 4;
     auto const cam_index = 0;
     auto const cam_keep_on = false;
+    // The camera stays open this long after its last viewer leaves, so
+    // reloading a page does not reopen it
+    auto const cam_linger = std::chrono::milliseconds(500);
+    // yuyv keeps the camera's YUV and encodes it without converting to
+    // BGR and back, which saves CPU for cameras delivering YUYV
+    auto const capture = gh::capture_format::bgr;
+    auto const sharded = false;
+    // Without motion for idle_after, the camera is only read at idle_fps
+    // frames per second; motion brings back the full rate at once
+    auto const idle_fps = 2;
+    auto const idle_after = std::chrono::seconds(30);
+    // Unchanged frames of a static scene are only sent this often
+    auto const idle_keepalive = std::chrono::seconds(1);
+    // Streams without an explicit width or quality adapt to keep this rate
+    auto const adaptive_fps = 15;
+    auto const recordings_dir = "../recordings";
+    // Frames captured while the camera is open are kept here for replay,
+    // going back journal_rewind at the rate frames are expected to come
+    // in at: 720p at quality 95 and 30 fps is about 4.5 MB/s, so an hour
+    // takes about 16 GB. Past that the oldest frames go first.
+    auto const journal_dir = "../journal/cam0";
+    auto const journal_rate = 4.5e6;
+    auto const journal_rewind = std::chrono::hours(1);
+    // Name of the shared memory frames are exported to for local
+    // consumers (see gh/shm_frames.hpp), empty for none
+    auto const shm_name = "";
+    // Regions blacked out in every output, in coordinates relative to
+    // the frame, e.g. {{0.0f, 0.0f}, {0.3f, 0.0f}, {0.3f, 0.2f}, {0.0f, 0.2f}}
+    std::vector<gh::privacy_mask::polygon> const privacy = {};
+    // Burned into every frame along with the wall-clock time
+    auto const camera_name = "cam0";
+    // New viewers are downgraded, or turned away, rather than push the
+    // outbound traffic past this many bytes per second or make the
+    // capture thread spend more than this share of its time encoding
+    auto const uplink_budget = 100e6 / 8;
+    auto const encode_budget = 0.6;
+    // Pollers keep the camera open for this long after their last request
+    auto const poll_linger = std::chrono::seconds(10);
+    // Threads for routes that block, such as opening the camera or a
+    // file, and how many of their requests may wait before getting 503
+    auto const workers = 2;
+    auto const workers_queue = 64;
 
     server app{BOOST_BEAST_VERSION_STRING, threads};
     app.set_doc_root(doc_root);
+    app.set_sharded(sharded);
+    app.workers().configure(workers, workers_queue);
 
+    gh::privacy_mask mask{privacy};
     gh::motion_detector d;
     d.mark();
+    d.fuse();
+    d.ignore(mask);
+    gh::motion_events events{d};
+    gh::overlay stamp{camera_name};
+    gh::variant_cache variants;
+    gh::admission admitted{variants, uplink_budget, encode_budget};
+    gh::journal journal{journal_dir, gh::journal::budget_for(journal_rate, journal_rewind)};
+    journal.start(variants.channel(variants.quantize(0, 0)));
+    std::unique_ptr<gh::shm_export> exported;
+    if (*shm_name) {
+        exported.reset(new gh::shm_export(shm_name));
+    }
     gh::resource_manager<gh::webcam> cam;
-    cam.set_max_shared(threads);
-    cam.set_post_make_action([&d](gh::owner_ptr<gh::webcam>& cam){
-        cam->install(d);
+    cam.set_linger(cam_linger);
+    // An unplugged camera is opened again by the next viewer
+    cam.set_failure_check([](const gh::webcam& webcam) { return webcam.failed(); });
+    cam.set_post_make_action([&mask,&privacy,&d,&events,&stamp,&variants,&exported,capture,idle_fps,idle_after](gh::webcam& webcam){
+        webcam.set_capture_format(capture);
+        webcam.set_idle(idle_fps, idle_after);
+        if (!privacy.empty()) {
+            webcam.install(mask);
+        }
+        webcam.install(d);
+        webcam.install(events);
+        // After the detector, so the ticking clock is not taken for motion
+        webcam.install(stamp);
+        webcam.install(variants);
+        if (exported) {
+            webcam.install(*exported);
+        }
+        webcam.start();
     });
     if (cam_keep_on) {
         cam.make_and_keep(cam_index);
-        std::thread([&cam](){
-            while (true) {
-                cam.update();
-                std::this_thread::sleep_for(std::chrono::milliseconds(30));
-            }
-        }).detach();
     }
+    // A lease on the camera, or none if it is shared by too many already
+    // or cannot be opened, e.g. because it is unplugged or still busy
+    using lease = gh::resource_manager<gh::webcam>::lease;
+    auto const open_camera = [&cam,cam_index]() -> lease {
+        try {
+            return cam.make_or_reuse(cam_index);
+        } catch (const std::exception& e) {
+            std::cerr << "open webcam: " << e.what() << '\n';
+            return lease{};
+        }
+    };
+    // Runs `work`, which must not throw, on the workers, since opening the
+    // camera may block for a while, then `next` on the strand of `socket`,
+    // told whether `work` ran: it does not when the workers are too far
+    // behind.
+    auto const on_workers = [&app](router::Socket& socket, std::function<void()> work,
+                                   std::function<void(bool)> next) {
+        auto const executor = socket.get_executor();
+        auto const then = std::make_shared<std::function<void(bool)>>(std::move(next));
+        auto const posted = app.workers().post([work,executor,then]() {
+            work();
+            boost::asio::post(executor, [then]() {
+                // Let go of the request here, not on the worker, before the
+                // session reads the next one
+                std::function<void(bool)> next;
+                next.swap(*then);
+                next(true);
+            });
+        });
+        if (!posted) {
+            (*then)(false);
+        }
+    };
+    // A lease from open_camera() made on the workers, for `next`
+    auto const with_camera = [&on_workers,&open_camera](router::Socket& socket,
+                                                        std::function<void(lease&&)> next) {
+        auto const webcam = std::make_shared<lease>();
+        on_workers(socket, [&open_camera,webcam]() { *webcam = open_camera(); },
+            [webcam,next](bool) { next(std::move(*webcam)); });
+    };
+    // Jobs hold leases, so the recorder must go before the manager
+    gh::recorder recordings{recordings_dir};
 
-    app.get("/", [&app](
+    // What a viewer turned away gets: for an <img> an image saying so,
+    // since browsers show nothing for text there
+    auto const busy = std::make_shared<gh::buffer>();
+    {
+        cv::Mat image(240, 320, CV_8UC3, cv::Scalar::all(48));
+        cv::putText(image, "Busy, retrying soon", cv::Point(40, 126),
+                    cv::FONT_HERSHEY_SIMPLEX, 0.7, cv::Scalar::all(220), 2, cv::LINE_AA);
+        cv::imencode(".jpg", image, *busy);
+    }
+    auto const unavailable = [&app,&admitted,busy](const router::Request& request)
+        -> boost::beast::http::message_generator
+    {
+        auto const accept = request[http::field::accept];
+        auto const image = accept.find("image/") != boost::core::string_view::npos &&
+                           accept.find("text/html") == boost::core::string_view::npos;
+        auto const retry = std::to_string(admitted.retry_after());
+        if (image) {
+            http::response<gh::http::shared_buffer_body> response{http::status::service_unavailable, request.version()};
+            response.set(http::field::server, app.name());
+            response.set(http::field::content_type, "image/jpeg");
+            response.set(http::field::cache_control, "no-cache");
+            response.set(http::field::retry_after, retry);
+            response.keep_alive(request.keep_alive());
+            response.body() = busy;
+            response.prepare_payload();
+            return response;
+        }
+        http::response<http::string_body> response{http::status::service_unavailable, request.version()};
+        response.set(http::field::server, app.name());
+        response.set(http::field::content_type, "text/plain");
+        response.set(http::field::retry_after, retry);
+        response.keep_alive(request.keep_alive());
+        response.body() = "Too many viewers, try again later.";
+        response.prepare_payload();
+        return response;
+    };
+
+    app.get_blocking("/", [&app](
             router::Matches&& /*matches*/,
             router::Request&& request,
             router::Socket& /*socket*/) {
         return app.view(request, "index");
     });
 
-    app.get("/cam", [&app,&cam,cam_index](
-            router::Matches&& matches,
+    // Optional parameters: width, quality and fps, e.g. /cam?width=640&fps=10
+    // Without width and quality the stream follows the client's bandwidth.
+    // Over budget, viewers get a cheaper variant than they asked for, or
+    // none at all.
+    app.get_async("/cam", [&app,&with_camera,&variants,&admitted,&unavailable,cam_index,idle_keepalive,adaptive_fps](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& socket,
+            router::Responder respond)
+    {
+        auto const width = std::atoi(router::query(request, "width").c_str());
+        auto const quality = std::atoi(router::query(request, "quality").c_str());
+        auto const fps = std::atoi(router::query(request, "fps").c_str());
+        auto const adaptive = width == 0 && quality == 0;
+
+        // Best first, so the index admitted counts rungs down from the top
+        auto ladder = variants.ladder();
+        std::vector<gh::variant_key> choices(ladder.rbegin(), ladder.rend());
+        if (!adaptive) {
+            choices.insert(choices.begin(), variants.quantize(width, quality));
+        }
+        std::uint64_t ticket = 0;
+        auto const choice = admitted.admit(choices, adaptive && fps <= 0 ? adaptive_fps : fps, &ticket);
+        if (choice < 0) {
+            return respond(unavailable(request));
+        }
+
+        auto const req = std::make_shared<router::Request>(std::move(request));
+        with_camera(socket, [&app,&variants,&admitted,&unavailable,&socket,cam_index,idle_keepalive,adaptive_fps,
+                             adaptive,fps,choices,choice,ticket,ladder,req,respond](lease&& webcam) mutable {
+            auto const& request = *req;
+            if (!webcam) {
+                // Nothing is streamed, so nothing should be held for it
+                admitted.release(ticket);
+                return respond(unavailable(request));
+            }
+            if (webcam.created()) {
+                printf("open webcam: %d\n", cam_index);
+            }
+
+            puts("send_stream start");
+
+            // The stream takes over the socket, so the session will not send
+            // the response given below.
+            std::shared_ptr<void> guard{new lease(std::move(webcam)), [](lease* l) {
+                puts("send_stream stop");
+                // Give back the lease, the last one releases the real webcam
+                if (l->reset()) {
+                    puts("release webcam");
+                }
+                delete l;
+            }};
+            auto stream = std::make_shared<mjpeg_stream>(std::move(socket), app.name());
+            stream->set_keepalive(idle_keepalive);
+            stream->set_counter(admitted.sent());
+            std::shared_ptr<gh::frame_channel> channel;
+            if (adaptive) {
+                // A downgraded viewer stays at or below the rung admitted
+                ladder.resize(ladder.size() - choice);
+                stream->set_adaptive(ladder.size(), ladder.size() - 1,
+                    fps > 0 ? fps : adaptive_fps,
+                    [&variants,ladder](std::size_t rung) -> std::shared_ptr<gh::frame_channel> {
+                        if (rung >= ladder.size()) {
+                            return nullptr;
+                        }
+                        return variants.channel(ladder[rung]);
+                    });
+            } else {
+                stream->set_max_fps(fps);
+                channel = variants.channel(choices[choice]);
+            }
+            stream->start(request.version(), std::move(channel), std::move(guard));
+
+            http::response<http::empty_body> response{http::status::ok, request.version()};
+            respond(std::move(response));
+        });
+    });
+
+    // Only a region of the frame, for watching one spot of a wide view
+    // without receiving all of it, in capture pixels:
+    // /cam/crop?x=1920&y=400&w=960&h=540, or zoomed in around a point:
+    // /cam/crop?zoom=4&cx=2400&cy=700 (the centre of the frame by default).
+    // Also takes width, quality and fps as /cam does. Viewers of about the
+    // same region share one encoding of it.
+    app.get_async("/cam/crop", [&app,&with_camera,&variants,&admitted,&unavailable,idle_keepalive](
+            router::Matches&& /*matches*/,
             router::Request&& request,
-            router::Socket& socket) -> boost::beast::http::message_generator
+            router::Socket& socket,
+            router::Responder respond)
     {
-        bool me_owner = false;
-        int status = cam.make_or_reuse(me_owner, cam_index);
+        // The region is relative to the frame, whose size is only known
+        // once the camera is open
+        auto const req = std::make_shared<router::Request>(std::move(request));
+        with_camera(socket, [&app,&variants,&admitted,&unavailable,&socket,idle_keepalive,req,respond](lease&& webcam) {
+            auto const& request = *req;
+            if (!webcam) {
+                return respond(unavailable(request));
+            }
+            auto const size = webcam->latest()->image.size();
+            auto const number = [&request](boost::core::string_view key, const char* fallback) {
+                return std::atof(router::query(request, key, fallback).c_str());
+            };
+            cv::Rect region;
+            auto const zoom = number("zoom", "0");
+            if (zoom >= 1) {
+                auto const w = static_cast<int>(size.width / zoom);
+                auto const h = static_cast<int>(size.height / zoom);
+                auto const cx = static_cast<int>(number("cx", std::to_string(size.width / 2).c_str()));
+                auto const cy = static_cast<int>(number("cy", std::to_string(size.height / 2).c_str()));
+                region = cv::Rect(std::min(std::max(0, cx - w / 2), size.width - w),
+                                  std::min(std::max(0, cy - h / 2), size.height - h), w, h);
+            } else {
+                region = cv::Rect(static_cast<int>(number("x", "0")), static_cast<int>(number("y", "0")),
+                                  static_cast<int>(number("w", "0")), static_cast<int>(number("h", "0")));
+            }
+            region &= cv::Rect(cv::Point(0, 0), size);
+            if (region.area() == 0) {
+                http::response<http::string_body> response{http::status::bad_request, request.version()};
+                response.set(http::field::server, app.name());
+                response.set(http::field::content_type, "text/plain");
+                response.keep_alive(request.keep_alive());
+                response.body() = "Expected a region within the frame, x, y, w and h, or a zoom of at least 1.";
+                response.prepare_payload();
+                return respond(std::move(response));
+            }
 
-        if (status == 0) {
-            cam.release();
-            // FIXME(gh): send image with message should be better for <img>
+            auto const width = std::atoi(router::query(request, "width").c_str());
+            auto const quality = std::atoi(router::query(request, "quality").c_str());
+            auto const fps = std::atoi(router::query(request, "fps").c_str());
+            auto const crop = gh::variant_cache::crop_of(region, size);
+            std::vector<gh::variant_key> const choices{
+                variants.quantize(width, quality, crop),
+                variants.quantize(width, 50, crop),
+                variants.quantize(width, 30, crop)};
+            auto const choice = admitted.admit(choices, fps);
+            if (choice < 0) {
+                return respond(unavailable(request));
+            }
+
+            std::shared_ptr<void> guard{new lease(std::move(webcam)), [](lease* l) {
+                if (l->reset()) {
+                    puts("release webcam");
+                }
+                delete l;
+            }};
+            // The stream takes over the socket, nothing below is sent
+            auto stream = std::make_shared<mjpeg_stream>(std::move(socket), app.name());
+            stream->set_keepalive(idle_keepalive);
+            stream->set_counter(admitted.sent());
+            stream->set_max_fps(fps);
+            stream->start(request.version(), variants.channel(choices[choice]), std::move(guard));
+
+            http::response<http::empty_body> response{http::status::ok, request.version()};
+            respond(std::move(response));
+        });
+    });
+
+    // The same frames over a WebSocket, with a header per frame and
+    // acknowledgments from the client: /cam/ws?width=640&window=2
+    app.get_async("/cam/ws", [&app,&with_camera,&variants,&admitted,&unavailable](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& socket,
+            router::Responder respond)
+    {
+        if (!boost::beast::websocket::is_upgrade(request)) {
             http::response<http::string_body> response{http::status::bad_request, request.version()};
             response.set(http::field::server, app.name());
-            response.set(http::field::content_type, "text/html");
+            response.set(http::field::content_type, "text/plain");
             response.keep_alive(request.keep_alive());
-            response.body() = "The maximum access to the responseource was reached.";
+            response.body() = "Expected a WebSocket upgrade.";
             response.prepare_payload();
-            return response;
+            return respond(std::move(response));
         }
-        if (status == 1) {
-            printf("open webcam: %d\n", cam_index);
+        auto const width = std::atoi(router::query(request, "width").c_str());
+        auto const quality = std::atoi(router::query(request, "quality").c_str());
+        auto const window = std::atoi(router::query(request, "window", "2").c_str());
+
+        auto const ladder = variants.ladder();
+        std::vector<gh::variant_key> choices(ladder.rbegin(), ladder.rend());
+        choices.insert(choices.begin(), variants.quantize(width, quality));
+        std::uint64_t ticket = 0;
+        auto const choice = admitted.admit(choices, 0, &ticket);
+        if (choice < 0) {
+            return respond(unavailable(request));
         }
+        auto const req = std::make_shared<router::Request>(std::move(request));
+        with_camera(socket, [&app,&variants,&admitted,&unavailable,&socket,window,choices,choice,ticket,req,respond](lease&& webcam) {
+            auto const& request = *req;
+            if (!webcam) {
+                admitted.release(ticket);
+                return respond(unavailable(request));
+            }
 
-        puts("send_stream start");
+            std::shared_ptr<void> guard{new lease(std::move(webcam)), [](lease* l) {
+                if (l->reset()) {
+                    puts("release webcam");
+                }
+                delete l;
+            }};
+            // The stream takes over the socket, nothing below is sent
+            auto stream = std::make_shared<ws_stream>(std::move(socket), app.name());
+            stream->set_window(window);
+            stream->set_counter(admitted.sent());
+            stream->start(request, variants.channel(choices[choice]), std::move(guard));
 
-        // Source: https://github.com/boostorg/beast/issues/1740#issuecomment-922143751
-        http::response<http::empty_body> response{http::status::ok, request.version()};
-        response.set(http::field::server, app.name());
-        response.set(http::field::cache_control, "no-cache");
-        response.set(http::field::content_type, "multipart/x-mixed-replace; boundary=frame");
-        response.set(http::field::expires, "0");
-        response.set(http::field::pragma, "no-cache");
-        response.keep_alive();
-        http::response_serializer<http::empty_body> sr{response};
-        http::write(socket, sr);
-
-        boost::system::error_code ec;
-        while (app.running()) {
-            bool prev = me_owner;
-            cam.update(me_owner);
-            if (me_owner != prev) {
-                puts("change owner");
+            http::response<http::empty_body> response{http::status::switching_protocols, request.version()};
+            respond(std::move(response));
+        });
+    });
+
+    // Motion as it is detected, as Server-Sent Events
+    app.get_async("/cam/events", [&app,&with_camera,&events](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& socket,
+            router::Responder respond)
+    {
+        auto const req = std::make_shared<router::Request>(std::move(request));
+        with_camera(socket, [&app,&events,&socket,req,respond](lease&& webcam) {
+            auto const& request = *req;
+            if (!webcam) {
+                http::response<http::string_body> response{http::status::service_unavailable, request.version()};
+                response.set(http::field::server, app.name());
+                response.set(http::field::content_type, "text/plain");
+                response.set(http::field::retry_after, "1");
+                response.keep_alive(request.keep_alive());
+                response.body() = "The maximum access to the resource was reached.";
+                response.prepare_payload();
+                return respond(std::move(response));
             }
 
-            auto const buffer = cam->get();
-            auto const size = buffer.size();
+            std::shared_ptr<void> guard{new lease(std::move(webcam)), [](lease* l) {
+                if (l->reset()) {
+                    puts("release webcam");
+                }
+                delete l;
+            }};
+            // The stream takes over the socket, nothing below is sent
+            std::make_shared<event_stream>(std::move(socket), app.name())->start(
+                request.version(), events.channel(), std::move(guard));
 
-            std::string message { "\r\n--frame\r\nContent-Type: image/jpeg" };
-            message += "\r\n\r\n";
-            auto bytesSent = socket.send(boost::asio::buffer(message), 0, ec);
-            if (!bytesSent )
-                break;
-            bytesSent = socket.send(boost::asio::buffer(buffer), 0, ec);
-            if (!bytesSent )
-                break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            http::response<http::empty_body> response{http::status::ok, request.version()};
+            respond(std::move(response));
+        });
+    });
+
+    // What the camera saw earlier: /cam/replay?from=<ms since epoch>&speed=2
+    // A negative `from` counts seconds back from now, e.g. from=-3600.
+    app.get_async("/cam/replay", [&app,&on_workers,&journal,&admitted,&unavailable,idle_keepalive](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& socket,
+            router::Responder respond)
+    {
+        auto const from = std::strtoll(router::query(request, "from", "-60").c_str(), nullptr, 10);
+        auto speed = std::atof(router::query(request, "speed", "1").c_str());
+        if (speed < 0.1) { speed = 0.1; }
+        if (speed > 16) { speed = 16; }
+        auto const start = from < 0
+            ? gh::journal::clock::now() + std::chrono::seconds(from)
+            : gh::journal::clock::time_point(std::chrono::milliseconds(from));
+
+        // Opening the replay maps the journal, which is file I/O
+        auto const source = std::make_shared<std::shared_ptr<gh::replay>>();
+        auto const req = std::make_shared<router::Request>(std::move(request));
+        on_workers(socket, [&journal,source,start,speed]() {
+            *source = std::make_shared<gh::replay>(journal, start, speed);
+        }, [&app,&admitted,&unavailable,&socket,idle_keepalive,source,req,respond](bool ran) {
+            auto const& request = *req;
+            if (!ran) {
+                return respond(unavailable(request));
+            }
+
+            auto stream = std::make_shared<mjpeg_stream>(std::move(socket), app.name());
+            stream->set_keepalive(idle_keepalive);
+            stream->set_counter(admitted.sent());
+            stream->start(request.version(), (*source)->channel(), *source);
+            (*source)->start();
+
+            http::response<http::empty_body> response{http::status::ok, request.version()};
+            respond(std::move(response));
+        });
+    });
+
+    app.get("/metrics", [&app,&cam,&variants,&admitted,&recordings,&journal](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& /*socket*/) {
+        std::ostringstream out;
+        auto const webcam = cam.current();
+        if (webcam) {
+            auto const frames = webcam->frame_stats();
+            auto const buffers = webcam->buffer_stats();
+            out << "frame_pool_hits " << frames.hits << '\n'
+                << "frame_pool_misses " << frames.misses << '\n'
+                << "frame_pool_objects " << frames.objects << '\n'
+                << "buffer_pool_hits " << buffers.hits << '\n'
+                << "buffer_pool_misses " << buffers.misses << '\n'
+                << "buffer_pool_objects " << buffers.objects << '\n'
+                << "unchanged_frames " << webcam->unchanged_frames() << '\n';
+            // Per frame CPU time is each of these over capture_frames
+            auto const timings = webcam->timings();
+            out << "capture_yuv " << (webcam->format() == gh::capture_format::yuyv) << '\n'
+                << "capture_frames " << timings.frames << '\n'
+                << "capture_cpu_seconds{stage=\"capture\"} " << timings.capture_seconds << '\n'
+                << "capture_cpu_seconds{stage=\"convert\"} " << timings.convert_seconds << '\n'
+                << "capture_cpu_seconds{stage=\"analysis\"} " << timings.analysis_seconds << '\n'
+                << "capture_cpu_seconds{stage=\"encode\"} " << timings.encode_seconds << '\n';
+            auto const activity = webcam->activity();
+            out << "capture_idle " << activity.idle << '\n'
+                << "capture_idle_seconds " << activity.idle_seconds << '\n'
+                << "capture_transitions{to=\"idle\"} " << activity.to_idle << '\n'
+                << "capture_transitions{to=\"active\"} " << activity.to_active << '\n';
         }
-        socket.close();
+        auto const variant = variants.stats();
+        out << "variants " << variant.variants << '\n'
+            << "variant_encodes " << variant.encodes << '\n'
+            << "variant_encode_seconds " << variant.encode_seconds << '\n'
+            << "recordings_active " << recordings.active() << '\n';
+        auto const admission = admitted.stats();
+        out << "outbound_bytes " << admitted.sent().load() << '\n'
+            << "outbound_bytes_per_second " << admission.bytes_per_second << '\n'
+            << "encode_load " << admission.encode_load << '\n'
+            << "viewers_admitted " << admission.admitted << '\n'
+            << "viewers_downgraded " << admission.downgraded << '\n'
+            << "viewers_rejected " << admission.rejected << '\n';
+        auto const journaled = journal.stats();
+        out << "journal_segments " << journaled.segments << '\n'
+            << "journal_bytes " << journaled.bytes << '\n'
+            << "journal_frames " << journaled.frames << '\n';
+        auto const blocking = app.workers().stats();
+        out << "blocking_queue_depth " << blocking.queued << '\n'
+            << "blocking_queue_peak " << blocking.peak << '\n'
+            << "blocking_running " << blocking.running << '\n'
+            << "blocking_completed " << blocking.completed << '\n'
+            << "blocking_rejected " << blocking.rejected << '\n'
+            << "blocking_wait_seconds " << blocking.wait_seconds << '\n'
+            << "blocking_max_wait_seconds " << blocking.max_wait_seconds << '\n';
+        http::response<http::string_body> response{http::status::ok, request.version()};
+        response.set(http::field::server, app.name());
+        response.set(http::field::content_type, "text/plain");
+        response.keep_alive(request.keep_alive());
+        response.body() = out.str();
+        response.prepare_payload();
+        return response;
+    });
 
-        puts("send_stream stop");
+    // The latest frame as encoded for streaming, straight from memory.
+    // With quality=full the raw frame is encoded again at full quality,
+    // once per frame, on a thread of its own. The ETag is the frame
+    // sequence number, so pollers get 304 until the next frame.
+    // Jobs use the cached frame, so the encoder must go before it
+    std::pair<gh::frame_ptr, gh::buffer_ptr> full_quality;
+    boost::asio::thread_pool encoder{1};
+    app.get_async("/cam/snapshot\\.jpg", [&app,&cam,&encoder,&full_quality](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& /*socket*/,
+            router::Responder respond) {
+        auto const webcam = cam.current();
+        auto const f = webcam ? webcam->latest() : gh::frame_ptr{};
+        if (!f) {
+            http::response<http::string_body> response{http::status::service_unavailable, request.version()};
+            response.set(http::field::server, app.name());
+            response.set(http::field::content_type, "text/plain");
+            response.set(http::field::retry_after, "1");
+            response.keep_alive(request.keep_alive());
+            response.body() = "The camera is not streaming.";
+            response.prepare_payload();
+            return respond(std::move(response));
+        }
+
+        auto const full = router::query(request, "quality") == "full";
+        auto const etag = "\"" + std::to_string(f->seq) + (full ? "-full\"" : "\"");
+        auto const version = request.version();
+        auto const keep_alive = request.keep_alive();
+        auto const reply = [&app,etag,version,keep_alive](gh::buffer_ptr jpeg) {
+            http::response<gh::http::shared_buffer_body> response{http::status::ok, version};
+            response.set(http::field::server, app.name());
+            response.set(http::field::content_type, "image/jpeg");
+            response.set(http::field::cache_control, "no-cache");
+            response.set(http::field::etag, etag);
+            response.keep_alive(keep_alive);
+            response.body() = std::move(jpeg);
+            response.prepare_payload();
+            return response;
+        };
 
-        // Deferred releasing the real webcam
-        if (cam.last()) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        if (request[http::field::if_none_match].find(etag) != boost::core::string_view::npos) {
+            http::response<http::empty_body> response{http::status::not_modified, version};
+            response.set(http::field::server, app.name());
+            response.set(http::field::etag, etag);
+            response.keep_alive(keep_alive);
+            return respond(std::move(response));
         }
-        // Decrease reference count or release the real webcam
-        if (cam.release(me_owner)) {
-            puts("release webcam");
+        if (!full) {
+            return respond(reply(f->jpeg));
         }
+        boost::asio::post(encoder, [f,reply,respond,&full_quality]() {
+            if (full_quality.first != f) {
+                auto jpeg = std::make_shared<gh::buffer>();
+                cv::Mat bgr;
+                cv::imencode(".jpg", gh::to_bgr(*f, bgr), *jpeg, {cv::IMWRITE_JPEG_QUALITY, 100});
+                full_quality = std::make_pair(f, std::move(jpeg));
+            }
+            respond(reply(full_quality.second));
+        });
+    });
 
-        return response;
+    // The next frame after the one a client already has, for consumers
+    // pulling frames one at a time: /cam/frame?after=<seq>&timeout=<s>
+    // Waits up to `timeout` seconds (25 by default, at most 60) and then
+    // answers 204. The camera is opened as needed and kept open while
+    // requests keep coming.
+    gh::lease_holder<gh::webcam> pollers{cam, poll_linger};
+    app.get_async("/cam/frame", [&app,&on_workers,&variants,&pollers,cam_index](
+            router::Matches&& /*matches*/,
+            router::Request&& request,
+            router::Socket& socket,
+            router::Responder respond) {
+        auto const executor = socket.get_executor();
+        auto const touched = std::make_shared<bool>(false);
+        auto const req = std::make_shared<router::Request>(std::move(request));
+        on_workers(socket, [&pollers,executor,touched,cam_index]() {
+            try {
+                *touched = pollers.touch(executor, cam_index);
+            } catch (const std::exception& e) {
+                std::cerr << "open webcam: " << e.what() << '\n';
+            }
+        }, [&app,&variants,executor,touched,req,respond](bool) {
+            auto const& request = *req;
+            if (!*touched) {
+                http::response<http::string_body> response{http::status::service_unavailable, request.version()};
+                response.set(http::field::server, app.name());
+                response.set(http::field::content_type, "text/plain");
+                response.set(http::field::retry_after, "1");
+                response.keep_alive(request.keep_alive());
+                response.body() = "The maximum access to the resource was reached.";
+                response.prepare_payload();
+                return respond(std::move(response));
+            }
+            auto const after = std::strtoull(router::query(request, "after", "0").c_str(), nullptr, 10);
+            auto timeout = std::atoi(router::query(request, "timeout", "25").c_str());
+            if (timeout < 0) { timeout = 0; }
+            if (timeout > 60) { timeout = 60; }
+
+            auto poll = std::make_shared<frame_poll>(executor, app.name(), respond);
+            poll->start(request, variants.channel(variants.quantize(0, 0)), after,
+                        std::chrono::seconds(timeout));
+        });
     });
 
-    app.get("/cam/take/picture", [&app,&cam](
+    // Recordings run as jobs: /cam/record/<seconds> starts one and
+    // answers with its id, /cam/recordings/<id> tells how it is going and
+    // /cam/recordings/<id>.avi downloads it once done. Starting one may
+    // open the camera, and downloading opens the file, so both run on
+    // the workers.
+    app.get_blocking("/cam/record/(\\d+)", [&app,&open_camera,&variants,&recordings](
             router::Matches&& matches,
             router::Request&& request,
             router::Socket& /*socket*/) {
-        // FIXME(gh): If one download the image and another one is taking
-        // picture, the former will get wrong image.
-        if (cam) {
-            puts("take picture");
-            cam->take_picture((app.doc_root() + "/output.jpg").c_str());
+        int seconds = std::atoi(matches[1].c_str());
+        if (seconds > 30) { seconds = 30; }
+        auto webcam = seconds > 0 ? open_camera() : gh::resource_manager<gh::webcam>::lease{};
+        if (!webcam) {
+            http::response<http::string_body> response{http::status::service_unavailable, request.version()};
+            response.set(http::field::server, app.name());
+            response.set(http::field::content_type, "text/plain");
+            response.keep_alive(request.keep_alive());
+            response.body() = "Cannot record now.";
+            response.prepare_payload();
+            return response;
         }
-        http::response<http::empty_body> response{http::status::ok, request.version()};
+
+        using lease = gh::resource_manager<gh::webcam>::lease;
+        std::shared_ptr<void> guard{new lease(std::move(webcam)), [](lease* l) {
+            if (l->reset()) {
+                puts("release webcam");
+            }
+            delete l;
+        }};
+        auto const id = recordings.start(variants.channel(variants.quantize(0, 0)),
+                                         seconds, std::move(guard));
+        std::cout << "record video " << id << " for " << seconds << " seconds" << '\n';
+
+        http::response<http::string_body> response{http::status::accepted, request.version()};
         response.set(http::field::server, app.name());
-        response.set(http::field::connection, "close");
+        response.set(http::field::content_type, "application/json");
+        response.set(http::field::location, "/cam/recordings/" + std::to_string(id));
+        response.keep_alive(request.keep_alive());
+        response.body() = "{\"id\":" + std::to_string(id) + ",\"state\":\"recording\"}";
+        response.prepare_payload();
         return response;
     });
 
-    // FIXME(gh): Only support 1 download at a time is not applicable.
-    boost::mutex mutex;
-    std::future<void> f;
-    app.get("/cam/record/(\\d+)", [&app,&cam,&mutex,&f](
+    app.get("/cam/recordings/(\\d+)", [&app,&recordings](
             router::Matches&& matches,
             router::Request&& request,
             router::Socket& /*socket*/) {
-        int seconds = std::atoi(matches[1].c_str());
-        if (seconds > 30) { seconds = 30; }
-        if (seconds > 0 && cam) {
-            if (mutex.try_lock()) {
-                cam->record_video((app.doc_root() + "/live001.avi").c_str());
-                /*f = */std::async(std::launch::async, [&app,&cam,&mutex,seconds](){
-                    std::cout << "record video for " << seconds << " seconds" << '\n';
-                    std::this_thread::sleep_for(std::chrono::seconds{seconds});
-                    cam->stop_record();
-                    // FIXME(gh): If live.avi is opened for downloading, this 
-                    // moving file will fail.
-                    ::rename((app.doc_root() + "/live001.avi").c_str(),
-                             (app.doc_root() + "/live.avi").c_str());
-                    puts("recording is done");
-                    mutex.unlock();
-                });
-            }
+        gh::recorder::status status;
+        http::response<http::string_body> response{http::status::ok, request.version()};
+        response.set(http::field::server, app.name());
+        response.set(http::field::content_type, "application/json");
+        response.keep_alive(request.keep_alive());
+        if (!recordings.find(std::strtoull(matches[1].c_str(), nullptr, 10), status)) {
+            response.result(http::status::not_found);
+            response.body() = "{}";
+        } else {
+            std::ostringstream out;
+            out << "{\"id\":" << status.id
+                << ",\"state\":\"" << gh::recorder::name(status.state) << '"'
+                << ",\"seconds\":" << status.seconds
+                << ",\"frames\":" << status.frames
+                << ",\"video\":\"/cam/recordings/" << status.id << ".avi\"}";
+            response.body() = out.str();
+        }
+        response.prepare_payload();
+        return response;
+    });
+
+    app.get_blocking("/cam/recordings/(\\d+)\\.avi", [&app,&recordings](
+            router::Matches&& matches,
+            router::Request&& request,
+            router::Socket& /*socket*/) -> boost::beast::http::message_generator
+    {
+        gh::recorder::status status;
+        auto const found = recordings.find(std::strtoull(matches[1].c_str(), nullptr, 10), status);
+        http::file_body::value_type body;
+        boost::beast::error_code ec;
+        if (found && status.state == gh::recorder::state::done) {
+            body.open(status.path.c_str(), boost::beast::file_mode::scan, ec);
+        }
+        if (!found || status.state != gh::recorder::state::done || ec) {
+            http::response<http::string_body> response{
+                found && status.state == gh::recorder::state::recording
+                    ? http::status::conflict : http::status::not_found,
+                request.version()};
+            response.set(http::field::server, app.name());
+            response.set(http::field::content_type, "text/plain");
+            response.keep_alive(request.keep_alive());
+            response.body() = found ? gh::recorder::name(status.state) : "no such recording";
+            response.prepare_payload();
+            return response;
         }
-        http::response<http::empty_body> response{http::status::ok, request.version()};
+        auto const size = body.size();
+        http::response<http::file_body> response{
+            std::piecewise_construct,
+            std::make_tuple(std::move(body)),
+            std::make_tuple(http::status::ok, request.version())};
         response.set(http::field::server, app.name());
-        response.set(http::field::connection, "close");
+        response.set(http::field::content_type, "video/x-msvideo");
+        response.set(http::field::content_disposition,
+                     "attachment; filename=\"record-" + std::to_string(status.id) + ".avi\"");
+        response.content_length(size);
+        response.keep_alive(request.keep_alive());
         return response;
     });
 
@@ -18,15 +18,22 @@
 //------------------------------------------------------------------------------
 
 #include "gh/http/server.hpp"
+#include "gh/http/arena.hpp"
+#include "gh/http/precompressed.hpp"
+#include "gh/http/shared_buffer_body.hpp"
+#include "gh/buffer_pool.hpp"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/dispatch.hpp>
+#ifdef BOOST_ASIO_HAS_FILE
+#include <boost/asio/stream_file.hpp>
+#endif
 #include <boost/asio/strand.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/bind/bind.hpp>
-#include <boost/regex.hpp>
 #include <boost/config.hpp>
+#include <boost/optional.hpp>
 #include <algorithm>
 #include <cstdlib>
 #include <functional>
@@ -36,6 +43,11 @@
 #include <thread>
 #include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace gh {
 namespace http {
 
@@ -80,16 +92,20 @@ mime_type(beast::string_view path)
     return "application/text";
 }
 
-// Append an HTTP rel-path to a local filesystem path.
-// The returned path is normalized for the platform.
-std::string
+// Append an HTTP rel-path to a local filesystem path, into `result`.
+// The path is normalized for the platform.
+void
 path_cat(
+    std::string& result,
     beast::string_view base,
     beast::string_view path)
 {
     if (base.empty())
-        return std::string(path);
-    std::string result(base);
+    {
+        result.assign(path.data(), path.size());
+        return;
+    }
+    result.assign(base.data(), base.size());
 #ifdef BOOST_MSVC
     char constexpr path_separator = '\\';
     if(result.back() == path_separator)
@@ -104,26 +120,86 @@ path_cat(
         result.resize(result.size() - 1);
     result.append(path.data(), path.size());
 #endif
-    return result;
+}
+
+// Whether a file of this type gains from being sent compressed
+bool
+is_compressible(beast::string_view type)
+{
+    return type.starts_with("text/") ||
+        type == "application/javascript" ||
+        type == "application/json" ||
+        type == "application/xml" ||
+        type == "image/svg+xml";
+}
+
+// Headers of a response carrying a static file or a view. The response
+// depends on Accept-Encoding whenever the type could be compressed, so
+// caches are told so even when it was not.
+template <class Response>
+void
+set_file_headers(
+    Response& res,
+    router& router,
+    beast::string_view type,
+    bool compressible,
+    char const* encoding,
+    std::uint64_t size,
+    bool keep_alive)
+{
+    res.set(http::field::server, router.name());
+    res.set(http::field::content_type, type);
+    if (compressible)
+        res.set(http::field::vary, "Accept-Encoding");
+    if (encoding)
+        res.set(http::field::content_encoding, encoding);
+    res.content_length(size);
+    res.keep_alive(keep_alive);
+}
+
+// An empty response whose fields use the allocator of the request's.
+template <class ResponseBody, class Body, class Fields, class... BodyArgs>
+http::response<ResponseBody, Fields>
+make_response(
+    http::status status,
+    const http::request<Body, Fields>& req,
+    BodyArgs&&... body_args)
+{
+    http::response<ResponseBody, Fields> res{
+        std::piecewise_construct,
+        std::forward_as_tuple(std::forward<BodyArgs>(body_args)...),
+        std::make_tuple(req.get_allocator())};
+    res.result(status);
+    res.version(req.version());
+    return res;
 }
 
 // Return a response for the given request.
 //
 // The concrete type of the response message (which depends on the
-// request), is type-erased in message_generator.
+// request), is type-erased in message_generator. The header fields of
+// responses built here come from the request's allocator.
+//
+// `matches` and `path` are scratch space the session keeps from one
+// request to the next. If `file_path` is given, a GET for a static file
+// only produces the header and stores the path of the file for the caller
+// to send.
 template <class Body, class Allocator>
 http::message_generator
 handle_request(
     router& router,
     beast::tcp_stream& stream,
     beast::string_view doc_root,
-    http::request<Body, http::basic_fields<Allocator>>&& req)
+    http::request<Body, http::basic_fields<Allocator>>&& req,
+    router::Matches& matches,
+    std::string& path,
+    std::string* file_path = nullptr)
 {
     // Returns a bad request response
     auto const bad_request =
     [&req,&router](beast::string_view why)
     {
-        http::response<http::string_body> res{http::status::bad_request, req.version()};
+        auto res = make_response<http::string_body>(http::status::bad_request, req);
         res.set(http::field::server, router.name());
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -136,7 +212,7 @@ handle_request(
     auto const not_found =
     [&req,&router](beast::string_view target)
     {
-        http::response<http::string_body> res{http::status::not_found, req.version()};
+        auto res = make_response<http::string_body>(http::status::not_found, req);
         res.set(http::field::server, router.name());
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -149,7 +225,7 @@ handle_request(
     auto const server_error =
     [&req,&router](beast::string_view what)
     {
-        http::response<http::string_body> res{http::status::internal_server_error, req.version()};
+        auto res = make_response<http::string_body>(http::status::internal_server_error, req);
         res.set(http::field::server, router.name());
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -160,14 +236,12 @@ handle_request(
 
     if (req.method() == http::verb::get)
     {
-        const router::Table& table = router.get_table();
-        for (const auto& rule : table) {
-            boost::regex pattern(std::string("^") + rule.first + "$");
-            boost::smatch matches;
-            if (boost::regex_search(std::string(req.target()), matches, pattern)) {
-                return rule.second(router::Matches{matches.begin(), matches.end()}, std::move(req), stream.socket());
-            }
-        }
+        // Routes match the path only, the query string is left to them
+        auto const target = req.target();
+        auto const route = router::match(
+            router.get_table(), target.substr(0, target.find('?')), matches);
+        if (route)
+            return route->callback(std::move(matches), std::move(req), stream.socket());
     }
 
     // Make sure we can handle the method
@@ -182,7 +256,7 @@ handle_request(
         return bad_request("Illegal request-target");
 
     // Build the path to the requested file
-    std::string path = path_cat(doc_root, req.target());
+    path_cat(path, doc_root, req.target());
     if (req.target().back() == '/')
         path.append("index.html");
 
@@ -200,28 +274,62 @@ handle_request(
         return server_error(ec.message());
 
     // Cache the size since we need it after the move
-    auto const size = body.size();
+    auto size = body.size();
+
+    // Text goes compressed to clients taking it, without compressing
+    // anything here, see precompressed.hpp
+    auto const type = mime_type(path);
+    auto const compressible = is_compressible(type);
+    precompressed::variant encoded;
+    bool stale = false;
+    auto const compressed = compressible &&
+        router.assets().select(path, req[http::field::accept_encoding], encoded, &stale);
+    if (stale)
+        router.refresh_asset(path);
+    auto const encoding = compressed ? encoded.encoding : nullptr;
+    if (compressed)
+    {
+        size = encoded.size;
+        if (!encoded.path.empty())
+            path.assign(encoded.path);
+    }
 
     // Respond to HEAD request
     if (req.method() == http::verb::head)
     {
-        http::response<http::empty_body> res{http::status::ok, req.version()};
-        res.set(http::field::server, router.name());
-        res.set(http::field::content_type, mime_type(path));
-        res.content_length(size);
-        res.keep_alive(req.keep_alive());
+        auto res = make_response<http::empty_body>(http::status::ok, req);
+        set_file_headers(res, router, type, compressible, encoding, size, req.keep_alive());
+        return res;
+    }
+
+    // Respond to GET request with a compressed form kept in memory
+    if (compressed && encoded.data)
+    {
+        auto res = make_response<shared_buffer_body>(http::status::ok, req, std::move(encoded.data));
+        set_file_headers(res, router, type, compressible, encoding, size, req.keep_alive());
+        return res;
+    }
+
+    // Respond to GET request with the body read asynchronously by the caller
+    if (file_path)
+    {
+        body.close();
+        auto res = make_response<http::empty_body>(http::status::ok, req);
+        set_file_headers(res, router, type, compressible, encoding, size, req.keep_alive());
+        // Both strings are the session's, this keeps their capacity
+        file_path->swap(path);
         return res;
     }
 
     // Respond to GET request
-    http::response<http::file_body> res{
-        std::piecewise_construct,
-        std::make_tuple(std::move(body)),
-        std::make_tuple(http::status::ok, req.version())};
-    res.set(http::field::server, router.name());
-    res.set(http::field::content_type, mime_type(path));
-    res.content_length(size);
-    res.keep_alive(req.keep_alive());
+    if (compressed)
+    {
+        body.open(path.c_str(), beast::file_mode::scan, ec);
+        if (ec)
+            return server_error(ec.message());
+    }
+    auto res = make_response<http::file_body>(http::status::ok, req, std::move(body));
+    set_file_headers(res, router, type, compressible, encoding, size, req.keep_alive());
     return res;
 }
 
@@ -234,25 +342,87 @@ fail(beast::error_code ec, char const* what)
     std::cerr << what << ": " << ec.message() << "\n";
 }
 
+// Pin the calling thread to a core, where the platform supports it
+void
+pin_to_core(unsigned core)
+{
+#ifdef __linux__
+    auto const cores = std::thread::hardware_concurrency();
+    if (cores == 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    boost::ignore_unused(core);
+#endif
+}
+
+// What a session allocates once and keeps across requests. It goes
+// back to the listener's pool when the session ends, for the next
+// connection to pick up with its capacity intact.
+struct session_buffers
+{
+    beast::flat_buffer buffer;
+    std::shared_ptr<arena> fields = std::make_shared<arena>();
+    handler_memory handlers;
+    router::Matches matches;
+    std::string path;
+    std::string file_path;
+#ifdef BOOST_ASIO_HAS_FILE
+    std::vector<char> file_buffer;
+#endif
+
+    // Ready for a new connection
+    void
+    clear()
+    {
+        buffer.consume(buffer.size());
+        file_path.clear();
+    }
+};
+
+using session_pool = object_pool<session_buffers>;
+
 // Handles an HTTP server connection
 class session : public std::enable_shared_from_this<session>
 {
     beast::tcp_stream stream_;
-    beast::flat_buffer buffer_;
+    std::shared_ptr<session_buffers> buffers_;
     router& router_;
     std::shared_ptr<std::string const> doc_root_;
-    http::request<http::string_body> req_;
+    boost::optional<router::Request> req_;
+    // The response being written. Held here rather than by a write
+    // operation, so that it is gone before the next request is read: its
+    // fields may be in the arena, which a request only gets back once
+    // nobody else holds it.
+    boost::optional<http::message_generator> res_;
+    bool async_files_;
+#ifdef BOOST_ASIO_HAS_FILE
+    // Only made for async file reads, since making one sets up io_uring
+    std::unique_ptr<net::stream_file> file_;
+#endif
 
 public:
     // Take ownership of the stream
     session(
         tcp::socket&& socket,
+        std::shared_ptr<session_buffers> buffers,
         router& router,
-        std::shared_ptr<std::string const> const& doc_root)
+        std::shared_ptr<std::string const> const& doc_root,
+        bool async_files = false)
         : stream_(std::move(socket))
+        , buffers_(std::move(buffers))
         , router_(router)
         , doc_root_(doc_root)
+        , async_files_(async_files)
     {
+        buffers_->clear();
+#ifdef BOOST_ASIO_HAS_FILE
+        if (async_files_)
+            file_.reset(new net::stream_file(stream_.get_executor()));
+#endif
     }
 
     // Start the asynchronous operation
@@ -272,18 +442,26 @@ public:
     void
     do_read()
     {
-        // Make the request empty before reading,
-        // otherwise the operation behavior is undefined.
-        req_ = {};
+        // Make the request empty before reading, otherwise the operation
+        // behavior is undefined. Once the last one is gone its arena is
+        // free again, unless a route kept the request.
+        req_.reset();
+        if (buffers_->fields.use_count() > 1)
+            buffers_->fields = std::make_shared<arena>();
+        req_.emplace(
+            std::piecewise_construct,
+            std::make_tuple(),
+            std::make_tuple(arena_allocator<char>(buffers_->fields)));
 
         // Set the timeout.
         stream_.expires_after(std::chrono::seconds(30));
 
         // Read a request
-        http::async_read(stream_, buffer_, req_,
-            beast::bind_front_handler(
-                &session::on_read,
-                shared_from_this()));
+        http::async_read(stream_, buffers_->buffer, *req_,
+            recycle(buffers_->handlers,
+                beast::bind_front_handler(
+                    &session::on_read,
+                    shared_from_this())));
     }
 
     void
@@ -300,23 +478,90 @@ public:
         if (ec)
             return fail(ec, "read");
 
-        http::message_generator&& request = handle_request(router_, stream_, *doc_root_, std::move(req_));
+        if (dispatch_async())
+            return;
+
+        buffers_->file_path.clear();
+        http::message_generator&& request = handle_request(
+            router_, stream_, *doc_root_, std::move(*req_),
+            buffers_->matches, buffers_->path,
+            async_files_ ? &buffers_->file_path : nullptr);
 
         // Send the response
         if (stream_.socket().is_open())
             send_response(std::move(request));
     }
 
+    // Hand the request to an asynchronous route if one matches. Its
+    // response is sent on this session's strand whenever it is ready,
+    // unless the route took the socket over in the meantime.
+    bool
+    dispatch_async()
+    {
+        if (req_->method() != http::verb::get)
+            return false;
+
+        auto const target = req_->target();
+        auto const route = router::match(router_.get_async_table(),
+            target.substr(0, target.find('?')), buffers_->matches);
+        if (!route)
+            return false;
+
+        // The route may take a while, the read deadline is over
+        stream_.expires_never();
+        auto self = shared_from_this();
+        route->callback(std::move(buffers_->matches), std::move(*req_),
+            stream_.socket(), [self](http::message_generator&& msg) {
+                auto m = std::make_shared<http::message_generator>(std::move(msg));
+                net::post(self->stream_.get_executor(), [self, m]() {
+                    if (self->stream_.socket().is_open())
+                        self->send_response(std::move(*m));
+                });
+            });
+        return true;
+    }
+
     void
     send_response(http::message_generator&& msg)
     {
         bool keep_alive = msg.keep_alive();
-        // Write the response
-        beast::async_write(
-            stream_,
-            std::move(msg),
-            beast::bind_front_handler(
-                &session::on_write, shared_from_this(), keep_alive));
+        stream_.expires_after(std::chrono::seconds(30));
+        res_.emplace(std::move(msg));
+        do_write(keep_alive);
+    }
+
+    // Write the response, as much of it as the stream takes at a time
+    void
+    do_write(bool keep_alive)
+    {
+        beast::error_code ec;
+        auto const buffers = res_->prepare(ec);
+        if (ec)
+        {
+            res_.reset();
+            return on_write(keep_alive, ec, 0);
+        }
+        stream_.async_write_some(
+            buffers,
+            recycle(buffers_->handlers,
+                beast::bind_front_handler(
+                    &session::on_write_some, shared_from_this(), keep_alive)));
+    }
+
+    void
+    on_write_some(
+        bool keep_alive,
+        beast::error_code ec,
+        std::size_t bytes_transferred)
+    {
+        if (!ec)
+        {
+            res_->consume(bytes_transferred);
+            if (!res_->is_done())
+                return do_write(keep_alive);
+        }
+        res_.reset();
+        on_write(keep_alive, ec, bytes_transferred);
     }
 
     void
@@ -330,6 +575,10 @@ public:
         if (ec)
             return fail(ec, "write");
 
+        // The header of a static file went out, now send its content
+        if (!buffers_->file_path.empty())
+            return send_file(keep_alive);
+
         if (!keep_alive)
         {
             // This means we should close the connection, usually because
@@ -341,6 +590,88 @@ public:
         do_read();
     }
 
+    void
+    send_file(bool keep_alive)
+    {
+#ifdef BOOST_ASIO_HAS_FILE
+        beast::error_code ec;
+        file_->open(buffers_->file_path, net::file_base::read_only, ec);
+        buffers_->file_path.clear();
+
+        // The header promised a body we can no longer send
+        if (ec)
+        {
+            fail(ec, "open");
+            return do_close();
+        }
+
+        buffers_->file_buffer.resize(64 * 1024);
+        do_file_read(keep_alive);
+#else
+        boost::ignore_unused(keep_alive);
+        buffers_->file_path.clear();
+        do_close();
+#endif
+    }
+
+#ifdef BOOST_ASIO_HAS_FILE
+    void
+    do_file_read(bool keep_alive)
+    {
+        file_->async_read_some(
+            net::buffer(buffers_->file_buffer),
+            recycle(buffers_->handlers,
+                beast::bind_front_handler(
+                    &session::on_file_read, shared_from_this(), keep_alive)));
+    }
+
+    void
+    on_file_read(
+        bool keep_alive,
+        beast::error_code ec,
+        std::size_t bytes_transferred)
+    {
+        if (ec == net::error::eof)
+        {
+            file_->close(ec);
+            if (!keep_alive)
+                return do_close();
+            return do_read();
+        }
+
+        if (ec)
+        {
+            fail(ec, "file read");
+            file_->close(ec);
+            return do_close();
+        }
+
+        net::async_write(
+            stream_,
+            net::buffer(buffers_->file_buffer.data(), bytes_transferred),
+            recycle(buffers_->handlers,
+                beast::bind_front_handler(
+                    &session::on_file_write, shared_from_this(), keep_alive)));
+    }
+
+    void
+    on_file_write(
+        bool keep_alive,
+        beast::error_code ec,
+        std::size_t bytes_transferred)
+    {
+        boost::ignore_unused(bytes_transferred);
+
+        if (ec)
+        {
+            file_->close(ec);
+            return fail(ec, "write");
+        }
+
+        do_file_read(keep_alive);
+    }
+#endif
+
     void
     do_close()
     {
@@ -361,17 +692,31 @@ class listener : public std::enable_shared_from_this<listener>
     tcp::acceptor acceptor_;
     std::shared_ptr<std::string const> doc_root_;
     router& router_;
+    std::vector<net::io_context*> targets_;
+    std::size_t next_;
+    bool async_files_;
+    session_pool sessions_;
 
 public:
+    // Accepted connections are spread over `targets` round-robin. A
+    // listener with `reuse_port` set shares its port with the listeners
+    // of the other shards and lets the kernel balance between them.
     listener(
         net::io_context& ioc,
+        std::vector<net::io_context*> targets,
         tcp::endpoint endpoint,
         router& router,
-        std::shared_ptr<std::string const> const& doc_root)
+        std::shared_ptr<std::string const> const& doc_root,
+        bool async_files,
+        bool reuse_port = false)
         : ioc_(ioc)
         , acceptor_(net::make_strand(ioc))
         , router_(router)
         , doc_root_(doc_root)
+        , targets_(std::move(targets))
+        , next_(0)
+        , async_files_(async_files)
+        , sessions_(256)
     {
         beast::error_code ec;
 
@@ -391,6 +736,23 @@ public:
             return;
         }
 
+#ifdef SO_REUSEPORT
+        // Allow several acceptors on the same port
+        if (reuse_port)
+        {
+            using reuse_port_option = net::detail::socket_option::boolean<
+                SOL_SOCKET, SO_REUSEPORT>;
+            acceptor_.set_option(reuse_port_option(true), ec);
+            if (ec)
+            {
+                fail(ec, "set_option");
+                return;
+            }
+        }
+#else
+        boost::ignore_unused(reuse_port);
+#endif
+
         // Bind to the server address
         acceptor_.bind(endpoint, ec);
         if (ec)
@@ -421,8 +783,9 @@ private:
     do_accept()
     {
         // The new connection gets its own strand
+        auto& target = *targets_[next_++ % targets_.size()];
         acceptor_.async_accept(
-            net::make_strand(ioc_),
+            net::make_strand(target),
             beast::bind_front_handler(
                 &listener::on_accept,
                 shared_from_this()));
@@ -441,8 +804,10 @@ private:
             // Create the session and run it
             std::make_shared<session>(
                 std::move(socket),
+                sessions_.acquire(0),
                 router_,
-                doc_root_)->run();
+                doc_root_,
+                async_files_)->run();
         }
 
         // Accept another connection
@@ -452,62 +817,287 @@ private:
 
 //------------------------------------------------------------------------------
 
+auto router::query(const Request& request, boost::core::string_view key,
+                   boost::core::string_view fallback) -> std::string
+{
+    auto const target = request.target();
+    auto const pos = target.find('?');
+    if (pos == beast::string_view::npos)
+        return std::string(fallback);
+    auto rest = target.substr(pos + 1);
+    while (!rest.empty()) {
+        auto const end = rest.find('&');
+        auto const param = rest.substr(0, end);
+        auto const eq = param.find('=');
+        if (param.substr(0, eq) == beast::string_view(key.data(), key.size()))
+            return eq == beast::string_view::npos
+                ? std::string()
+                : std::string(param.substr(eq + 1));
+        if (end == beast::string_view::npos)
+            break;
+        rest = rest.substr(end + 1);
+    }
+    return std::string(fallback);
+}
+
 auto router::view(Request &request, boost::string_view view)
     -> boost::beast::http::message_generator
 {
+    std::string path = m_view_dir + std::string(view) + ".html";
+    precompressed::variant encoded;
+    bool stale = false;
+    auto const compressed = m_assets.select(
+        path, request[http::field::accept_encoding], encoded, &stale);
+    if (stale) {
+        refresh_asset(path);
+    }
+    if (compressed && encoded.data) {
+        http::response<shared_buffer_body> response{http::status::ok, request.version()};
+        set_file_headers(response, *this, "text/html", true, encoded.encoding,
+                         encoded.size, request.keep_alive());
+        response.body() = std::move(encoded.data);
+        return response;
+    }
+
     boost::beast::error_code ec;
     http::response<http::file_body> response;
     response.result(http::status::ok);
     response.version(request.version());
-    response.set(http::field::server, name());
-    response.set(http::field::content_type, "text/html");
-    response.keep_alive(request.keep_alive());
-    std::string path = m_view_dir + std::string(view) + ".html";
+    if (compressed) {
+        path = encoded.path;
+    }
     response.body().open(path.c_str(), boost::beast::file_mode::scan, ec);
-    response.prepare_payload();
+    set_file_headers(response, *this, "text/html", true,
+                     compressed ? encoded.encoding : nullptr,
+                     response.body().size(), request.keep_alive());
     return response;
+}
+
+// What a blocking route needs on the worker. Responses made there use
+// the heap, the request's arena belongs to the session's strand.
+struct blocking_call
+{
+    router::Matches matches;
+    std::unique_ptr<router::Request> req;
+    router::Responder respond;
 };
 
+http::message_generator
+plain_response(
+    router const& router,
+    http::status status,
+    unsigned version,
+    bool keep_alive,
+    std::string body)
+{
+    http::response<http::string_body> res{status, version};
+    res.set(http::field::server, router.name());
+    res.set(http::field::content_type, "text/plain");
+    if (status == http::status::service_unavailable)
+        res.set(http::field::retry_after, "1");
+    res.keep_alive(keep_alive);
+    res.body() = std::move(body);
+    res.prepare_payload();
+    return res;
+}
+
+auto router::add_blocking(const char* path, Callback callback) -> void
+{
+    add(async_table, path, [this, callback](
+            Matches&& matches, Request&& req, Socket& socket, Responder respond) {
+        auto const version = req.version();
+        auto const keep_alive = req.keep_alive();
+        auto const call = std::make_shared<blocking_call>();
+        call->matches = std::move(matches);
+        call->req.reset(new Request(std::move(req)));
+        call->respond = respond;
+
+        auto const posted = m_workers.post([this, callback, call, &socket, version, keep_alive]() {
+            std::unique_ptr<http::message_generator> msg;
+            try {
+                msg.reset(new http::message_generator(
+                    callback(std::move(call->matches), std::move(*call->req), socket)));
+            } catch (const std::exception& e) {
+                msg.reset(new http::message_generator(plain_response(
+                    *this, http::status::internal_server_error, version, keep_alive, e.what())));
+            }
+            // Before the session may read the next request into the arena
+            call->req.reset();
+            call->respond(std::move(*msg));
+        });
+        if (!posted) {
+            call->req.reset();
+            respond(plain_response(*this, http::status::service_unavailable, version,
+                                   keep_alive, "The server is busy, try again later."));
+        }
+    });
+}
+
+auto router::prepare_assets(const std::string& doc_root) -> void
+{
+    auto const compressible = [](const std::string& path) {
+        return is_compressible(mime_type(path));
+    };
+    m_assets.prepare(doc_root, compressible);
+    m_assets.prepare(m_view_dir, compressible);
+}
+
+auto router::refresh_asset(const std::string& path) -> void
+{
+    auto const posted = m_workers.post([this, path]() { m_assets.refresh(path); });
+    if (!posted) {
+        m_assets.abandon(path);
+    }
+}
+
+// Check whether files can be read asynchronously here. With io_uring the
+// service is set up by the first file object, which fails on kernels
+// without support.
+bool
+probe_async_files()
+{
+#ifdef BOOST_ASIO_HAS_FILE
+    try
+    {
+        net::io_context ioc;
+        net::stream_file file(ioc);
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "async file I/O unavailable, using blocking reads: "
+                  << e.what() << "\n";
+    }
+#endif
+    return false;
+}
+
+auto server::io_backend() -> const char*
+{
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+    return "io_uring";
+#elif defined(BOOST_ASIO_HAS_IO_URING)
+    return "epoll+io_uring";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+    return "iocp";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+    return "epoll";
+#else
+    return "select";
+#endif
+}
+
 auto server::run(const char* address_, unsigned short port) -> int
 {
     auto const address = net::ip::make_address(address_);
     auto const doc_root = std::make_shared<std::string>(m_doc_root);
+    auto const endpoint = tcp::endpoint{address, port};
+    m_async_files = probe_async_files();
 
-    // The io_context is required for all I/O
-    net::io_context ioc{m_threads};
+    // Requests only look the compressed forms up
+    prepare_assets(m_doc_root);
 
+    // The io_context is required for all I/O. In sharded mode every
+    // thread gets one of its own.
+    auto const shards = m_sharded ? m_threads : 1;
+    std::vector<std::unique_ptr<net::io_context>> contexts;
+    std::vector<net::io_context*> targets;
+    for (auto i = 0; i < shards; ++i) {
+        contexts.emplace_back(new net::io_context{m_sharded ? 1 : m_threads});
+        targets.push_back(contexts.back().get());
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_contexts = targets;
+    }
+    if (m_stop) {
+        stop();
+    }
+
+    auto& ioc = *contexts.front();
     net::signal_set signals(ioc, SIGINT, SIGTERM);
-    signals.async_wait([&ioc,this](
+    signals.async_wait([this](
             const boost::system::error_code& ec,
             int signal_number){
         this->stop();
-        ioc.stop();
     });
 
     // Create and launch a listening port
-    std::make_shared<listener>(
-        ioc,
-        tcp::endpoint{address, port},
-        *this,
-        doc_root)->run();
+    if (!m_sharded) {
+        std::make_shared<listener>(
+            ioc,
+            targets,
+            endpoint,
+            *this,
+            doc_root,
+            m_async_files)->run();
+    } else {
+#ifdef SO_REUSEPORT
+        for (auto target : targets) {
+            std::make_shared<listener>(
+                *target,
+                std::vector<net::io_context*>{target},
+                endpoint,
+                *this,
+                doc_root,
+                m_async_files,
+                true)->run();
+        }
+#else
+        // Without SO_REUSEPORT one acceptor hands connections to the
+        // shards in turn.
+        std::make_shared<listener>(
+            ioc,
+            targets,
+            endpoint,
+            *this,
+            doc_root,
+            m_async_files)->run();
+#endif
+    }
 
     // Run the I/O service on the requested number of threads
     std::vector<std::thread> v;
     v.reserve(m_threads - 1);
     for (auto i = m_threads - 1; i > 0; --i) {
+        auto& shard = *contexts[m_sharded ? i : 0];
+        auto const sharded = m_sharded;
         v.emplace_back(
-        [&ioc]{
-            ioc.run();
+        [&shard,sharded,i]{
+            if (sharded) {
+                pin_to_core(i);
+            }
+            shard.run();
         });
     }
+    if (m_sharded) {
+        pin_to_core(0);
+    }
     ioc.run();
 
     for (auto& t : v) {
         t.join();
     }
 
+    // Blocking routes still queued answer to sessions that are gone
+    workers().stop();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_contexts.clear();
+    }
+
     return EXIT_SUCCESS;
 }
 
+auto server::stop() -> void
+{
+    m_stop = true;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto ioc : m_contexts) {
+        ioc->stop();
+    }
+}
+
 } // namespace http
 } // namespace gh